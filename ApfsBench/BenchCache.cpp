@@ -0,0 +1,156 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Compares lookups in the lock-free BlockCache with the mutex-based
+// ClockCache<BlockPtr> the block cache used before, at 1, 4, 16 and 64
+// threads. All lookups hit, so this measures the cost of the lookup itself
+// and how it scales when many threads share the cache.
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <vector>
+
+#include <ApfsLib/BlockCache.h>
+#include <ApfsLib/ClockCache.h>
+
+static const unsigned int g_thread_counts[] = { 1, 4, 16, 64 };
+
+// Runs ops lookups of random keys below key_cnt, split over thread_cnt
+// threads, and returns the lookups per second.
+static double RunLookups(unsigned int thread_cnt, uint64_t ops, uint64_t key_cnt, const std::function<bool(paddr_t)> &lookup)
+{
+	std::vector<std::thread> threads;
+	std::atomic<unsigned int> ready(0);
+	std::atomic<bool> start(false);
+	std::atomic<uint64_t> failed(0);
+	uint64_t ops_per_thread = ops / thread_cnt;
+	unsigned int t;
+
+	for (t = 0; t < thread_cnt; t++)
+	{
+		threads.emplace_back([&, t]() {
+			uint64_t x = t * 0x9E3779B97F4A7C15ULL + 1;
+			uint64_t k;
+			uint64_t miss = 0;
+
+			ready.fetch_add(1);
+			while (!start.load())
+				std::this_thread::yield();
+
+			for (k = 0; k < ops_per_thread; k++)
+			{
+				// xorshift, cheap enough not to show up in the numbers
+				x ^= x << 13;
+				x ^= x >> 7;
+				x ^= x << 17;
+				if (!lookup(x % key_cnt))
+					miss++;
+			}
+
+			failed.fetch_add(miss);
+		});
+	}
+
+	while (ready.load() < thread_cnt)
+		std::this_thread::yield();
+
+	auto t0 = std::chrono::steady_clock::now();
+	start.store(true);
+
+	for (t = 0; t < thread_cnt; t++)
+		threads[t].join();
+
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+	if (failed.load() != 0)
+		std::cerr << "Warning: " << failed.load() << " lookups missed." << std::endl;
+
+	return (ops_per_thread * thread_cnt) / secs;
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t key_cnt = 2048;
+	uint64_t ops = 4000000;
+	unsigned int reps = 3;
+	unsigned int k;
+	unsigned int r;
+	paddr_t paddr;
+
+	if (argc > 1)
+		key_cnt = strtoull(argv[1], nullptr, 10);
+	if (argc > 2)
+		ops = strtoull(argv[2], nullptr, 10);
+
+	if (key_cnt == 0 || ops == 0 || !strcmp(argv[argc - 1], "-h"))
+	{
+		std::cerr << "Syntax: apfs-bench-cache [blocks] [lookups]" << std::endl;
+		std::cerr << "Defaults: 2048 cached blocks, 4000000 lookups per run." << std::endl;
+		return -1;
+	}
+
+	BlockCache block_cache;
+	ClockCache<BlockPtr> mutex_cache;
+
+	block_cache.SetBlockSize(4096);
+	// Twice what is needed, so nothing gets evicted during the runs.
+	block_cache.SetSize(key_cnt * 4096 * 2);
+	mutex_cache.SetCapacity(key_cnt * 2);
+
+	for (paddr = 0; paddr < key_cnt; paddr++)
+	{
+		BlockPtr blk = block_cache.Alloc(paddr);
+
+		memset(blk->data(), 0, blk->size());
+		block_cache.Put(paddr, blk);
+		mutex_cache.Put(paddr, blk);
+	}
+
+	std::cout << key_cnt << " blocks, " << ops << " lookups per run, best of " << reps << " runs, "
+		<< std::thread::hardware_concurrency() << " hardware threads" << std::endl;
+	std::cout << "threads   mutex ClockCache   lock-free BlockCache   (M lookups/s)" << std::endl;
+
+	for (k = 0; k < sizeof(g_thread_counts) / sizeof(g_thread_counts[0]); k++)
+	{
+		double best_mutex = 0;
+		double best_lockfree = 0;
+
+		for (r = 0; r < reps; r++)
+		{
+			double m = RunLookups(g_thread_counts[k], ops, key_cnt, [&](paddr_t p) { BlockPtr b; return mutex_cache.Get(p, b); });
+			double l = RunLookups(g_thread_counts[k], ops, key_cnt, [&](paddr_t p) { BlockPtr b; return block_cache.Get(p, b); });
+
+			if (m > best_mutex)
+				best_mutex = m;
+			if (l > best_lockfree)
+				best_lockfree = l;
+		}
+
+		std::cout << std::setw(7) << g_thread_counts[k] << std::fixed << std::setprecision(1)
+			<< std::setw(19) << best_mutex / 1e6 << std::setw(23) << best_lockfree / 1e6 << std::endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,524 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// Compares the search in B-tree nodes through the key index, with the
+// scalar, SSE4.2 and AVX2 versions of LowerBound64, against FindBin
+// comparing every key with the compare function. It runs on node images
+// of the omap and fs tree of a real volume, which are dumped first:
+//   apfs-bench-search dump <device> <nodes.bin> [volume [passphrase]]
+//   apfs-bench-search run <nodes.bin> [searches]
+// The check command tests the search on a synthetic fs tree leaf, without
+// a dump:
+//   apfs-bench-search check
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <ApfsLib/ApfsContainer.h>
+#include <ApfsLib/ApfsVolume.h>
+#include <ApfsLib/BTree.h>
+#include <ApfsLib/Device.h>
+#include <ApfsLib/GptPartitionMap.h>
+#include <ApfsLib/KeySearch.h>
+
+static const char DUMP_MAGIC[8] = { 'A', 'P', 'F', 'S', 'N', 'O', 'D', 'E' };
+constexpr uint32_t DUMP_VERSION = 1;
+// Per tree, enough for a few hundred thousand keys.
+constexpr uint32_t DUMP_MAX_NODES = 4096;
+
+struct DumpHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t block_size;
+	uint32_t tree_cnt;
+	uint32_t reserved;
+};
+
+// Followed by node_cnt node images, the root first.
+struct DumpTree
+{
+	uint32_t node_cnt;
+	uint32_t reserved;
+};
+
+struct Search
+{
+	std::shared_ptr<BTreeNode> node;
+	uint8_t key[16];
+	size_t key_size;
+};
+
+struct SearchTree
+{
+	const char *name;
+	BTCompareFunc func;
+	std::unique_ptr<BTree> tree;
+	std::vector<std::shared_ptr<BTreeNode>> nodes;
+	std::vector<Search> searches;
+};
+
+static int CompareOmapKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context)
+{
+	const omap_key_t *ks = reinterpret_cast<const omap_key_t *>(skey);
+	const omap_key_t *ke = reinterpret_cast<const omap_key_t *>(ekey);
+
+	(void)skey_len;
+	(void)ekey_len;
+	(void)context;
+
+	if (ke->ok_oid != ks->ok_oid)
+		return ke->ok_oid < ks->ok_oid ? -1 : 1;
+	if (ke->ok_xid != ks->ok_xid)
+		return ke->ok_xid < ks->ok_xid ? -1 : 1;
+	return 0;
+}
+
+// Only the obj_id_and_type, id first, then type. The rest of the key
+// (names, offsets) is ignored, which is enough to find the first entry.
+static int CompareFsKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context)
+{
+	uint64_t ks = reinterpret_cast<const j_key_t *>(skey)->obj_id_and_type;
+	uint64_t ke = reinterpret_cast<const j_key_t *>(ekey)->obj_id_and_type;
+
+	(void)skey_len;
+	(void)ekey_len;
+	(void)context;
+
+	ks = (ks << 4) | (ks >> OBJ_TYPE_SHIFT);
+	ke = (ke << 4) | (ke >> OBJ_TYPE_SHIFT);
+
+	if (ke != ks)
+		return ke < ks ? -1 : 1;
+	return 0;
+}
+
+static bool WriteTree(std::ofstream &os, BTree &tree, uint32_t blksize)
+{
+	std::vector<uint8_t> images;
+	DumpTree dt;
+
+	dt.node_cnt = 0;
+	dt.reserved = 0;
+
+	tree.VisitNodes([&](const std::shared_ptr<BTreeNode> &node) -> bool {
+		if (node->blocksize() != blksize)
+			return false;
+
+		images.insert(images.end(), node->block(), node->block() + blksize);
+		dt.node_cnt++;
+
+		return dt.node_cnt < DUMP_MAX_NODES;
+	});
+
+	os.write(reinterpret_cast<const char *>(&dt), sizeof(dt));
+	os.write(reinterpret_cast<const char *>(images.data()), images.size());
+
+	std::cout << dt.node_cnt << " nodes" << std::endl;
+
+	return dt.node_cnt > 0;
+}
+
+static int Dump(const char *dev_name, const char *out_name, unsigned int vol_id, const char *passphrase)
+{
+	std::unique_ptr<Device> device;
+	std::unique_ptr<ApfsContainer> container;
+	std::unique_ptr<ApfsVolume> volume;
+	uint64_t offset = 0;
+	uint64_t size;
+	DumpHeader hdr;
+	int n;
+
+	device.reset(Device::OpenDevice(dev_name));
+
+	if (!device)
+	{
+		std::cerr << "Unable to open device " << dev_name << std::endl;
+		return -1;
+	}
+
+	size = device->GetSize();
+
+	GptPartitionMap gpt;
+	if (gpt.LoadAndVerify(*device.get()))
+	{
+		n = gpt.FindFirstAPFSPartition();
+		if (n != -1)
+			gpt.GetPartitionOffsetAndSize(n, offset, size);
+	}
+
+	container.reset(new ApfsContainer(device.get(), offset, size));
+
+	if (!container->Init())
+	{
+		std::cerr << "Unable to init container." << std::endl;
+		return -1;
+	}
+
+	volume.reset(container->GetVolume(vol_id, passphrase ? std::string(passphrase) : std::string()));
+
+	if (!volume)
+	{
+		std::cerr << "Unable to open volume " << vol_id << "." << std::endl;
+		return -1;
+	}
+
+	std::ofstream os(out_name, std::ios::binary | std::ios::trunc);
+	if (!os.is_open())
+	{
+		std::cerr << "Unable to open output file " << out_name << std::endl;
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, DUMP_MAGIC, sizeof(hdr.magic));
+	hdr.version = DUMP_VERSION;
+	hdr.block_size = container->GetBlocksize();
+	hdr.tree_cnt = 2;
+
+	os.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+
+	std::cout << "omap: ";
+	WriteTree(os, volume->omaptree(), hdr.block_size);
+	std::cout << "fs tree: ";
+	WriteTree(os, volume->fstree(), hdr.block_size);
+
+	os.close();
+
+	if (os.fail())
+	{
+		std::cerr << "Unable to write " << out_name << std::endl;
+		return -1;
+	}
+
+	volume.reset();
+	container.reset();
+	device->Close();
+
+	return 0;
+}
+
+static bool LoadTree(std::ifstream &is, ApfsContainer &container, uint32_t blksize, SearchTree &st)
+{
+	DumpTree dt;
+	BlockPtr blk;
+	BTreeEntry e;
+	Search s;
+	uint32_t k;
+	uint32_t n;
+
+	is.read(reinterpret_cast<char *>(&dt), sizeof(dt));
+	if (!is || dt.node_cnt == 0)
+		return false;
+
+	st.tree.reset(new BTree(container));
+
+	for (k = 0; k < dt.node_cnt; k++)
+	{
+		blk = BlockPtr::Create(k, blksize);
+
+		is.read(reinterpret_cast<char *>(blk->data()), blksize);
+		if (!is)
+			return false;
+
+		st.nodes.push_back(BTreeNode::CreateNode(*st.tree, blk, k));
+	}
+
+	st.tree->InitFromRoot(st.nodes[0]);
+
+	// Search for every key of the leaves, in the leaf it is in.
+	for (k = 0; k < dt.node_cnt; k++)
+	{
+		const std::shared_ptr<BTreeNode> &node = st.nodes[k];
+
+		if (node->level() != 0)
+			continue;
+
+		for (n = 0; n < node->entries_cnt(); n++)
+		{
+			node->GetEntry(e, n);
+
+			s.node = node;
+			s.key_size = std::min(e.key_len, st.func == CompareOmapKey ? sizeof(omap_key_t) : sizeof(j_key_t));
+			if (s.key_size < sizeof(j_key_t))
+				continue;
+
+			memcpy(s.key, e.key, s.key_size);
+			st.searches.push_back(s);
+		}
+	}
+
+	return !st.searches.empty();
+}
+
+// Returns the time per search in ns, and the sum of the results in chk.
+static double RunSearches(SearchTree &st, const std::vector<uint32_t> &order, bool use_index, int64_t &chk)
+{
+	size_t k;
+
+	chk = 0;
+
+	auto t0 = std::chrono::steady_clock::now();
+
+	for (k = 0; k < order.size(); k++)
+	{
+		const Search &s = st.searches[order[k]];
+
+		chk += st.tree->FindInNode(s.node, s.key, s.key_size, st.func, nullptr, use_index);
+	}
+
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / order.size();
+}
+
+static int Run(const char *in_name, size_t search_cnt)
+{
+	static const struct
+	{
+		const char *name;
+		bool use_index;
+		KeySearchImpl impl;
+	} modes[] = {
+		{ "FindBin, no key index", false, KeySearchImpl::Scalar },
+		{ "key index, scalar", true, KeySearchImpl::Scalar },
+		{ "key index, SSE4.2", true, KeySearchImpl::SSE42 },
+		{ "key index, AVX2", true, KeySearchImpl::AVX2 }
+	};
+	constexpr unsigned int reps = 5;
+
+	ApfsContainer container(nullptr, 0, 0);
+	SearchTree trees[2];
+	std::mt19937_64 rng(1);
+	DumpHeader hdr;
+	size_t m;
+	size_t t;
+	size_t k;
+	unsigned int r;
+
+	trees[0].name = "omap";
+	trees[0].func = CompareOmapKey;
+	trees[1].name = "fs tree";
+	trees[1].func = CompareFsKey;
+
+	std::ifstream is(in_name, std::ios::binary);
+	if (!is.is_open())
+	{
+		std::cerr << "Unable to open " << in_name << std::endl;
+		return -1;
+	}
+
+	is.read(reinterpret_cast<char *>(&hdr), sizeof(hdr));
+	if (!is || memcmp(hdr.magic, DUMP_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != DUMP_VERSION || hdr.tree_cnt != 2)
+	{
+		std::cerr << in_name << " is not a node dump." << std::endl;
+		return -1;
+	}
+
+	for (t = 0; t < 2; t++)
+	{
+		if (!LoadTree(is, container, hdr.block_size, trees[t]))
+		{
+			std::cerr << "Unable to read the " << trees[t].name << " nodes." << std::endl;
+			return -1;
+		}
+	}
+
+	std::cout << "best of " << reps << " runs of " << search_cnt << " random searches, ns/search" << std::endl;
+	std::cout << std::left << std::setw(24) << "" << std::right;
+	for (t = 0; t < 2; t++)
+	{
+		std::ostringstream label;
+
+		label << trees[t].name << " (" << trees[t].nodes.size() << " nodes)";
+		std::cout << std::setw(26) << label.str();
+	}
+	std::cout << std::endl;
+
+	std::vector<uint32_t> order[2];
+	int64_t ref_chk[2] = { 0, 0 };
+
+	for (t = 0; t < 2; t++)
+	{
+		order[t].resize(search_cnt);
+		for (k = 0; k < search_cnt; k++)
+			order[t][k] = rng() % trees[t].searches.size();
+	}
+
+	for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+	{
+		std::cout << std::left << std::setw(24) << modes[m].name << std::right;
+
+		if (modes[m].use_index && !SetKeySearchImpl(modes[m].impl))
+		{
+			std::cout << "  not supported by this CPU" << std::endl;
+			continue;
+		}
+
+		for (t = 0; t < 2; t++)
+		{
+			double best = 0;
+			int64_t chk = 0;
+
+			for (r = 0; r < reps; r++)
+			{
+				double ns = RunSearches(trees[t], order[t], modes[m].use_index, chk);
+
+				if (r == 0 || ns < best)
+					best = ns;
+			}
+
+			if (m == 0)
+				ref_chk[t] = chk;
+
+			std::cout << std::fixed << std::setprecision(1) << std::setw(26) << best;
+			if (chk != ref_chk[t])
+				std::cout << " (results differ!)";
+		}
+
+		std::cout << std::endl;
+	}
+
+	return 0;
+}
+
+// Builds an fs tree leaf in which runs of records share the
+// obj_id_and_type, like the records of one inode, and checks that a search
+// for the 8-byte prefix finds the first record of each run, in all modes.
+static int Check()
+{
+	constexpr uint32_t blksize = 4096;
+	constexpr uint32_t run_cnt = 8;
+	constexpr uint32_t run_len = 12;
+	constexpr uint32_t key_size = 2 * sizeof(uint64_t);
+	constexpr uint32_t cnt = run_cnt * run_len;
+	static const KeySearchImpl impls[] = { KeySearchImpl::Scalar, KeySearchImpl::SSE42, KeySearchImpl::AVX2 };
+
+	ApfsContainer container(nullptr, 0, 0);
+	BTree tree(container);
+	BlockPtr blk = BlockPtr::Create(0, blksize);
+	std::shared_ptr<BTreeNode> node;
+	btree_node_phys_t *btn;
+	btree_info_t *bti;
+	kvloc_t *toc;
+	uint8_t *keys;
+	uint64_t key[2];
+	uint64_t oid;
+	size_t fails = 0;
+	size_t i;
+	uint32_t r;
+	uint32_t k;
+	int res;
+	int exp;
+
+	memset(blk->data(), 0, blksize);
+
+	btn = reinterpret_cast<btree_node_phys_t *>(blk->data());
+	btn->btn_o.o_type = OBJECT_TYPE_BTREE | OBJ_PHYSICAL;
+	btn->btn_o.o_subtype = OBJECT_TYPE_FSTREE;
+	btn->btn_flags = BTNODE_ROOT | BTNODE_LEAF;
+	btn->btn_nkeys = cnt;
+	btn->btn_table_space.len = cnt * sizeof(kvloc_t);
+
+	bti = reinterpret_cast<btree_info_t *>(blk->data() + blksize - sizeof(btree_info_t));
+	bti->bt_fixed.bt_node_size = blksize;
+
+	toc = reinterpret_cast<kvloc_t *>(blk->data() + sizeof(btree_node_phys_t));
+	keys = blk->data() + sizeof(btree_node_phys_t) + btn->btn_table_space.len;
+
+	for (k = 0; k < cnt; k++)
+	{
+		r = k / run_len;
+		oid = 16 + r;
+		key[0] = APFS_TYPE_ID((r & 1) ? APFS_TYPE_DIR_REC : APFS_TYPE_XATTR, oid);
+		key[1] = k % run_len;
+
+		memcpy(keys + k * key_size, key, key_size);
+		toc[k].k.off = k * key_size;
+		toc[k].k.len = key_size;
+		toc[k].v.off = BTOFF_INVALID;
+		toc[k].v.len = 0;
+	}
+
+	node = BTreeNode::CreateNode(tree, blk, 0);
+	tree.InitFromRoot(node);
+
+	for (i = 0; i <= sizeof(impls) / sizeof(impls[0]); i++)
+	{
+		bool use_index = i > 0;
+
+		if (use_index && !SetKeySearchImpl(impls[i - 1]))
+			continue;
+
+		for (r = 0; r < run_cnt; r++)
+		{
+			// The prefix of the run, and the highest type of the same id,
+			// which sorts between this run and the next one.
+			oid = 16 + r;
+
+			for (k = 0; k < 2; k++)
+			{
+				key[0] = APFS_TYPE_ID(k ? 0xF : ((r & 1) ? APFS_TYPE_DIR_REC : APFS_TYPE_XATTR), oid);
+				exp = k ? (r + 1) * run_len - 1 : r * run_len;
+
+				res = tree.FindInNode(node, key, sizeof(uint64_t), CompareFsKey, nullptr, use_index);
+				if (res != exp)
+				{
+					std::cout << (use_index ? "key index" : "FindBin") << ", run " << r << (k ? ", after it" : "") << ": found " << res << ", expected " << exp << std::endl;
+					fails++;
+				}
+			}
+		}
+	}
+
+	std::cout << (fails ? "FAILED" : "OK") << std::endl;
+
+	return fails ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc >= 4 && !strcmp(argv[1], "dump"))
+		return Dump(argv[2], argv[3], argc > 4 ? strtoul(argv[4], nullptr, 10) : 0, argc > 5 ? argv[5] : nullptr);
+
+	if (argc == 2 && !strcmp(argv[1], "check"))
+		return Check();
+
+	if (argc >= 3 && !strcmp(argv[1], "run"))
+	{
+		size_t search_cnt = argc > 3 ? strtoull(argv[3], nullptr, 10) : 1000000;
+
+		if (search_cnt > 0)
+			return Run(argv[2], search_cnt);
+	}
+
+	std::cerr << "Syntax: apfs-bench-search dump <device> <nodes.bin> [volume [passphrase]]" << std::endl;
+	std::cerr << "        apfs-bench-search run <nodes.bin> [searches]" << std::endl;
+	std::cerr << "        apfs-bench-search check" << std::endl;
+	return -1;
+}
@@ -18,8 +18,14 @@
 */
 
 #include <cstring>
+#include <chrono>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <functional>
+#include <new>
+#include <thread>
+#include <cstdio>
 
 #include "ApfsContainer.h"
 #include "ApfsVolume.h"
@@ -30,6 +36,12 @@
 int g_debug = 0;
 bool g_lax = false;
 
+// Real containers have a few hundred blocks in the checkpoint descriptor
+// area, more than this means the superblock is corrupt.
+static constexpr uint32_t XP_DESC_MAX_BLOCKS = 0x10000;
+// Bytes of the checkpoint descriptor area that are read at once.
+static constexpr uint32_t XP_DESC_READ_SIZE = 4 * 1024 * 1024;
+
 ApfsContainer::ApfsContainer(Device *disk_main, uint64_t main_start, uint64_t main_len, Device *disk_tier2, uint64_t tier2_start, uint64_t tier2_len) :
 	m_main_disk(disk_main),
 	m_main_part_start(main_start),
@@ -45,10 +57,132 @@ ApfsContainer::ApfsContainer(Device *disk_main, uint64_t main_start, uint64_t ma
 	m_keymgr(*this)
 {
 	m_sm = nullptr;
+	m_prefetch_window = NX_PREFETCH_DEFAULT_WINDOW;
+	m_omap_cache_size = NX_OMAP_CACHE_DEFAULT_SIZE;
+	m_omap_preload_size = 0;
+	m_extent_cache_size = NX_EXTENT_CACHE_DEFAULT_SIZE;
+	m_read_ahead_size = NX_READAHEAD_DEFAULT_SIZE;
+	m_warmup_pending = 0;
+
+	m_block_cache.SetSize(NX_CACHE_DEFAULT_SIZE);
+	m_thread_pool.SetThreadCount(NX_WORKER_THREADS);
 }
 
 ApfsContainer::~ApfsContainer()
 {
+	WaitCacheWarmup();
+}
+
+bool ApfsContainer::ScanCheckPoints()
+{
+	const uint32_t blksize = m_nx.nx_block_size;
+	uint32_t blk_cnt = m_nx.nx_xp_desc_blocks;
+	std::vector<uint8_t> area;
+	std::vector<xid_t> xids;
+	uint32_t chunk_cnt;
+	uint32_t first;
+	uint32_t cnt;
+	uint32_t k;
+
+	m_checkpoints.clear();
+
+	// The high bit marks a descriptor area that is a tree instead of a
+	// range of blocks. Not supported, the superblock at 0 is used then.
+	if (blk_cnt & 0x80000000U)
+		return true;
+
+	if (blksize == 0 || blksize > NX_MAXIMUM_BLOCK_SIZE)
+		return false;
+
+	if (blk_cnt > XP_DESC_MAX_BLOCKS)
+	{
+		if (g_debug & Dbg_Errors)
+			std::cerr << "Checkpoint descriptor area has " << blk_cnt << " blocks, only scanning " << XP_DESC_MAX_BLOCKS << "." << std::endl;
+		blk_cnt = XP_DESC_MAX_BLOCKS;
+	}
+
+	xids.resize(blk_cnt, 0);
+
+	// Few large reads, on an image file or over the network the latency of
+	// many small reads adds up. If there isn't enough memory for that, read
+	// block by block.
+	chunk_cnt = std::min(std::max<uint32_t>(1, XP_DESC_READ_SIZE / blksize), blk_cnt);
+
+	try
+	{
+		area.resize(static_cast<size_t>(chunk_cnt) * blksize);
+	}
+	catch (const std::bad_alloc &)
+	{
+		chunk_cnt = 1;
+		area.resize(blksize);
+	}
+
+	auto verify = [&area, &xids, blksize](uint32_t base, uint32_t first, uint32_t last) {
+		for (uint32_t n = first; n < last; n++)
+		{
+			const uint8_t *data = area.data() + static_cast<size_t>(n) * blksize;
+			const nx_superblock_t *sb = reinterpret_cast<const nx_superblock_t *>(data);
+
+			// Check the type first, that skips the checksum of the cpm blocks.
+			if ((sb->nx_o.o_type & OBJECT_TYPE_MASK) != OBJECT_TYPE_NX_SUPERBLOCK)
+				continue;
+			if (!VerifyBlock(data, blksize))
+				continue;
+
+			xids[base + n] = sb->nx_o.o_xid;
+		}
+	};
+
+	for (first = 0; first < blk_cnt; first += cnt)
+	{
+		std::vector<std::thread> workers;
+		uint32_t thread_cnt;
+		uint32_t chunk;
+
+		cnt = std::min(chunk_cnt, blk_cnt - first);
+
+		if (!ReadBlocks(area.data(), m_nx.nx_xp_desc_base + first, cnt))
+		{
+			// The large read failed, try the blocks one by one.
+			for (k = 0; k < cnt; k++)
+			{
+				if (!ReadBlocks(area.data() + static_cast<size_t>(k) * blksize, m_nx.nx_xp_desc_base + first + k, 1))
+					return false;
+			}
+		}
+
+		// Plain threads instead of the pool: this runs before fuse_daemonize,
+		// and the pool threads would not survive the fork.
+		thread_cnt = std::min(NX_WORKER_THREADS, cnt / 64);
+
+		if (thread_cnt > 1)
+		{
+			chunk = (cnt + thread_cnt - 1) / thread_cnt;
+
+			for (k = chunk; k < cnt; k += chunk)
+				workers.emplace_back(verify, first, k, std::min(k + chunk, cnt));
+
+			verify(first, 0, chunk);
+
+			for (auto &t : workers)
+				t.join();
+		}
+		else
+		{
+			verify(first, 0, cnt);
+		}
+	}
+
+	for (k = 0; k < blk_cnt; k++)
+	{
+		if (xids[k] != 0)
+			m_checkpoints.push_back({ xids[k], m_nx.nx_xp_desc_base + k });
+	}
+
+	std::sort(m_checkpoints.begin(), m_checkpoints.end(), [](const CheckPoint &a, const CheckPoint &b) { return a.xid < b.xid; });
+
+	return true;
 }
 
 bool ApfsContainer::Init(xid_t req_xid)
@@ -83,55 +217,42 @@ bool ApfsContainer::Init(xid_t req_xid)
 	memcpy(&m_nx, blk.data(), sizeof(nx_superblock_t));
 
 	// Scan container for most recent superblock (might fix segfaults)
-	uint64_t max_xid = 0;
-	paddr_t max_paddr = 0;
-	paddr_t paddr;
-	std::vector<uint8_t> tmp;
+	const CheckPoint *cp = nullptr;
 
-	tmp.resize(m_nx.nx_block_size);
+	if (!ScanCheckPoints())
+		return false;
 
-	for (paddr = m_nx.nx_xp_desc_base; paddr < (m_nx.nx_xp_desc_base + m_nx.nx_xp_desc_blocks); paddr++)
+	if (req_xid)
 	{
-		if (!ReadBlocks(tmp.data(), paddr, 1))
-			return false;
-
-		if (!VerifyBlock(tmp.data(), tmp.size()))
-			continue;
-
-		const nx_superblock_t *sb = reinterpret_cast<const nx_superblock_t *>(tmp.data());
-		if ((sb->nx_o.o_type & OBJECT_TYPE_MASK) != OBJECT_TYPE_NX_SUPERBLOCK)
-			continue;
+		auto it = std::lower_bound(m_checkpoints.cbegin(), m_checkpoints.cend(), req_xid, [](const CheckPoint &c, xid_t xid) { return c.xid < xid; });
 
-		if (req_xid) {
-			if (req_xid == sb->nx_o.o_xid) {
-				max_xid = req_xid;
-				max_paddr = paddr;
-				break;
-			}
-		} else {
-			if (sb->nx_o.o_xid > max_xid)
-			{
-				max_xid = sb->nx_o.o_xid;
-				max_paddr = paddr;
-			}
-		}
+		if (it != m_checkpoints.cend() && it->xid == req_xid)
+			cp = &*it;
+	}
+	else if (!m_checkpoints.empty())
+	{
+		cp = &m_checkpoints.back();
 	}
 
-	if (max_paddr)
+	if (cp)
 	{
 		// if (g_debug & Dbg_Errors)
 		//	std::cout << "Found more recent xid " << max_xid << " than superblock 0 contained (" << m_nx.nx_o.o_xid << ")." << std::endl;
 		if (g_debug & Dbg_Info)
-			std::cout << "Mounting xid different from NXSB at 0 (xid = " << m_nx.nx_o.o_xid << "). xid = " << max_xid << std::endl;
+			std::cout << "Mounting xid different from NXSB at 0 (xid = " << m_nx.nx_o.o_xid << "). xid = " << cp->xid << std::endl;
 
-		ReadBlocks(tmp.data(), max_paddr, 1);
+		// Verified by the scan already.
+		if (!ReadBlocks(blk.data(), cp->paddr, 1))
+			return false;
 
-		memcpy(&m_nx, tmp.data(), sizeof(nx_superblock_t));
+		memcpy(&m_nx, blk.data(), sizeof(nx_superblock_t));
 	}
 
 	if (g_debug & Dbg_Info)
 		std::cout << "Mounting xid " << m_nx.nx_o.o_xid << std::endl;
 
+	m_block_cache.SetBlockSize(m_nx.nx_block_size);
+
 	if ((m_nx.nx_incompatible_features & NX_INCOMPAT_FUSION) && !m_tier2_disk)
 	{
 		std::cerr << "Need to specify two devices for a fusion drive." << std::endl;
@@ -150,6 +271,8 @@ bool ApfsContainer::Init(xid_t req_xid)
 		return false;
 	}
 
+	m_omap.PinIndexNodes();
+
 	omap_res_t omr;
 	if (!m_cpm.Lookup(omr, m_nx.nx_spaceman_oid, m_nx.nx_o.o_xid))
 	{
@@ -265,32 +388,215 @@ bool ApfsContainer::GetVolumeInfo(unsigned int fsid, apfs_superblock_t& apsb)
 }
 
 
+Device *ApfsContainer::GetDevice(uint64_t &offs, paddr_t paddr) const
+{
+	offs = m_nx.nx_block_size * paddr;
+
+	if (offs & FUSION_TIER2_DEVICE_BYTE_ADDR)
+	{
+		offs = offs - FUSION_TIER2_DEVICE_BYTE_ADDR + m_tier2_part_start;
+		return m_tier2_disk;
+	}
+	else
+	{
+		offs = offs + m_main_part_start;
+		return m_main_disk;
+	}
+}
+
 bool ApfsContainer::ReadBlocks(uint8_t * data, paddr_t paddr, uint64_t blkcnt) const
 {
 	uint64_t offs;
 	uint64_t size;
+	Device *dev;
 
 	//if ((paddr + blkcnt) > m_nx.nx_block_count)
 	//	return false;
 
-	offs = m_nx.nx_block_size * paddr;
+	dev = GetDevice(offs, paddr);
 	size = m_nx.nx_block_size * blkcnt;
 
-	if (offs & FUSION_TIER2_DEVICE_BYTE_ADDR)
+	if (!dev)
+		return false;
+
+	auto start = std::chrono::steady_clock::now();
+	bool rc;
+
+	// Background prefetching may read at the same time as the main thread.
+	if (dev->SupportsConcurrentReads())
 	{
-		if (!m_tier2_disk)
-			return false;
+		rc = dev->Read(data, offs, size);
+	}
+	else
+	{
+		std::lock_guard<std::mutex> lock(m_io_mutex);
+		rc = dev->Read(data, offs, size);
+	}
 
-		offs = offs - FUSION_TIER2_DEVICE_BYTE_ADDR + m_tier2_part_start;
-		return m_tier2_disk->Read(data, offs, size);
+	dev->AccountRead(size, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+	return rc;
+}
+
+bool ApfsContainer::ReadBlocksV(const BlockRange *ranges, size_t cnt) const
+{
+	std::vector<ReadSegment> segs;
+	ReadSegment seg;
+	uint64_t size = 0;
+	size_t k;
+	bool rc = true;
+
+	segs.reserve(cnt);
+
+	for (k = 0; k < cnt; k++)
+	{
+		// Fusion containers are rare, the tier2 blocks are read one by one.
+		if (GetDevice(seg.offs, ranges[k].paddr) != m_main_disk)
+		{
+			rc = ReadBlocks(ranges[k].data, ranges[k].paddr, ranges[k].blkcnt) && rc;
+			continue;
+		}
+
+		seg.len = m_nx.nx_block_size * ranges[k].blkcnt;
+		seg.data = ranges[k].data;
+		segs.push_back(seg);
+		size += seg.len;
+	}
+
+	if (segs.empty())
+		return rc;
+
+	auto start = std::chrono::steady_clock::now();
+
+	if (m_main_disk->SupportsConcurrentReads())
+	{
+		rc = m_main_disk->ReadV(segs.data(), segs.size()) && rc;
 	}
 	else
 	{
-		if (!m_main_disk)
-			return false;
+		std::lock_guard<std::mutex> lock(m_io_mutex);
+		rc = m_main_disk->ReadV(segs.data(), segs.size()) && rc;
+	}
 
-		offs = offs + m_main_part_start;
-		return m_main_disk->Read(data, offs, size);
+	m_main_disk->AccountRead(size, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+	return rc;
+}
+
+std::unique_ptr<ReadQueue> ApfsContainer::CreateReadQueue(unsigned int depth) const
+{
+	return m_main_disk->CreateReadQueue(depth);
+}
+
+void ApfsContainer::ReadBlocksAsync(ReadQueue &queue, uint8_t *data, paddr_t paddr, uint64_t blkcnt, uint64_t tag) const
+{
+	uint64_t offs;
+	Device *dev;
+
+	dev = GetDevice(offs, paddr);
+
+	if (dev != m_main_disk)
+	{
+		queue.Complete(tag, ReadBlocks(data, paddr, blkcnt));
+		return;
+	}
+
+	// Devices without concurrent reads read in Submit.
+	if (dev->SupportsConcurrentReads())
+	{
+		queue.Submit(data, offs, m_nx.nx_block_size * blkcnt, tag);
+	}
+	else
+	{
+		std::lock_guard<std::mutex> lock(m_io_mutex);
+		queue.Submit(data, offs, m_nx.nx_block_size * blkcnt, tag);
+	}
+}
+
+bool ApfsContainer::ReadMetaBlock(uint8_t *data, paddr_t paddr, uint8_t flags, ApfsVolume *vol) const
+{
+	if (!(flags & CB_VOLUME))
+		return ReadAndVerifyHeaderBlock(data, paddr);
+
+	if (!vol)
+		return false;
+
+	// TODO: is the crypto_id always equal to the block ID here?
+	// I think so, the xts id and the block id only differ when the
+	// volume has been converted from a HFS/FileVault volume, which
+	// used CoreStorage. After conversions, the block numbers do not
+	// match anymore, since the CoreStorage data has been removed
+	// and assigned to the apfs volume. But the metadata is always
+	// fresh and therefore the ids should match.
+	if (!ReadBlocks(data, paddr))
+	{
+		std::cerr << "ERROR: ReadMetaBlock: ReadBlocks failed!" << std::endl;
+		return false;
+	}
+
+	return CheckMetaBlock(data, paddr, flags, vol);
+}
+
+bool ApfsContainer::CheckMetaBlock(uint8_t *data, paddr_t paddr, uint8_t flags, ApfsVolume *vol) const
+{
+	vol->DecryptBlocks(data, 1, (flags & CB_ENCRYPTED) ? paddr : 0);
+
+	if (!(flags & CB_NOHEADER) && !VerifyBlock(data, m_nx.nx_block_size))
+	{
+		std::cerr << "ERROR: ReadMetaBlock: VerifyBlock failed!" << std::endl;
+		if (g_debug & Dbg_Errors)
+			DumpHex(std::cerr, data, m_nx.nx_block_size);
+		return false;
+	}
+
+	return true;
+}
+
+void ApfsContainer::ReadMetaBlocks(MetaBlockRead *reads, size_t cnt, ApfsVolume *vol) const
+{
+	std::vector<BlockRange> ranges;
+	size_t k;
+
+	ranges.reserve(cnt);
+
+	for (k = 0; k < cnt; k++)
+	{
+		reads[k].ok = false;
+
+		if ((reads[k].flags & CB_VOLUME) && !vol)
+			continue;
+
+		BlockRange r;
+		r.data = reads[k].data;
+		r.paddr = reads[k].paddr;
+		r.blkcnt = 1;
+		ranges.push_back(r);
+	}
+
+	// Find out which block is bad the slow way.
+	if (!ReadBlocksV(ranges.data(), ranges.size()))
+	{
+		for (k = 0; k < cnt; k++)
+			reads[k].ok = ReadMetaBlock(reads[k].data, reads[k].paddr, reads[k].flags, vol);
+		return;
+	}
+
+	for (k = 0; k < cnt; k++)
+	{
+		if (reads[k].flags & CB_VOLUME)
+		{
+			if (vol)
+				reads[k].ok = CheckMetaBlock(reads[k].data, reads[k].paddr, reads[k].flags, vol);
+		}
+		else if (VerifyBlock(reads[k].data, m_nx.nx_block_size))
+		{
+			reads[k].ok = true;
+		}
+		else if (g_debug & Dbg_Errors)
+		{
+			std::cerr << "ReadMetaBlocks checksum error." << std::endl;
+			DumpHex(std::cerr, reads[k].data, m_nx.nx_block_size);
+		}
 	}
 }
 
@@ -480,3 +786,272 @@ void ApfsContainer::dump(BlockDumper& bd)
 		bd.DumpNode(blk.data(), cib_oid_list[cib_id]);
 	}
 }
+
+static void WriteDeviceStats(std::ostream &os, const char *name, const Device *dev)
+{
+	DeviceStats st;
+
+	if (!dev)
+		return;
+
+	dev->GetStats(st);
+
+	os << name << ".read_ops " << st.read_ops << std::endl;
+	os << name << ".read_bytes " << st.read_bytes << std::endl;
+	os << name << ".read_usec " << st.read_nsec / 1000 << std::endl;
+}
+
+void ApfsContainer::WriteStats(std::ostream &os)
+{
+	CacheStats cs;
+	SlabStats ss;
+
+	m_block_cache.GetStats(cs);
+	m_block_cache.GetSlabStats(ss);
+
+	os << std::dec;
+	os << "cache.hits " << cs.hits << std::endl;
+	os << "cache.misses " << cs.misses << std::endl;
+	os << "cache.evictions " << cs.evictions << std::endl;
+	os << "cache.entries " << cs.entries << std::endl;
+	os << "cache.capacity " << cs.capacity << std::endl;
+	os << "cache.pinned " << cs.pinned << std::endl;
+	os << "cache.slabs " << ss.slabs << std::endl;
+	os << "cache.slab_objs_in_use " << ss.objs_in_use << std::endl;
+	os << "cache.slab_objs_total " << ss.objs_total << std::endl;
+	os << "cache.huge_pages " << (ss.huge_pages ? 1 : 0) << std::endl;
+
+	WriteDeviceStats(os, "device.main", m_main_disk);
+	WriteDeviceStats(os, "device.tier2", m_tier2_disk);
+
+	m_omap.WriteStats(os, "nx.omap");
+}
+
+static const char CACHE_MANIFEST_MAGIC[8] = { 'A', 'P', 'F', 'S', 'W', 'A', 'R', 'M' };
+constexpr uint32_t CACHE_MANIFEST_VERSION = 2;
+
+void ApfsContainer::FillManifestHeader(CacheManifestHeader &hdr, ApfsVolume *vol) const
+{
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MANIFEST_MAGIC, sizeof(hdr.magic));
+	hdr.version = CACHE_MANIFEST_VERSION;
+	hdr.block_size = m_nx.nx_block_size;
+	memcpy(hdr.nx_uuid, m_nx.nx_uuid, sizeof(apfs_uuid_t));
+	hdr.nx_xid = m_nx.nx_o.o_xid;
+
+	if (vol)
+	{
+		memcpy(hdr.vol_uuid, vol->uuid(), sizeof(apfs_uuid_t));
+		hdr.vol_xid = vol->xid();
+	}
+}
+
+bool ApfsContainer::SaveCacheManifest(const char *path, ApfsVolume *vol)
+{
+	std::vector<BlockCache::Entry> cached;
+	std::vector<CacheManifestEntry> entries;
+	CacheManifestHeader hdr;
+	CacheManifestEntry e;
+	BlockPtr blk;
+	const obj_phys_t *obj;
+	std::string tmp_path(path);
+	size_t k;
+
+	WaitCacheWarmup();
+
+	m_block_cache.GetEntries(cached);
+
+	for (k = 0; k < cached.size(); k++)
+	{
+		// Blocks that can't be verified are not warmed.
+		if (cached[k].flags & CB_NOHEADER)
+			continue;
+
+		if ((cached[k].flags & CB_VOLUME) && !vol)
+			continue;
+
+		if (!m_block_cache.Get(cached[k].paddr, blk))
+			continue;
+
+		obj = reinterpret_cast<const obj_phys_t *>(blk->data());
+
+		if (!(cached[k].flags & CB_VOLUME))
+		{
+			e.oid = cached[k].paddr;
+			e.tree = CMT_CONTAINER;
+		}
+		else if (obj->o_subtype == OBJECT_TYPE_FSTREE)
+		{
+			e.oid = obj->o_oid;
+			e.tree = CMT_FS_TREE;
+		}
+		else if (obj->o_subtype == OBJECT_TYPE_FEXT_TREE)
+		{
+			e.oid = cached[k].paddr;
+			e.tree = CMT_FEXT_TREE;
+		}
+		else
+		{
+			continue;
+		}
+
+		e.reserved = 0;
+		entries.push_back(e);
+	}
+
+	blk.reset();
+
+	FillManifestHeader(hdr, vol);
+	hdr.entry_cnt = entries.size();
+
+	// Write to a temporary file first, so a crash doesn't leave a truncated manifest.
+	tmp_path.append(".tmp");
+
+	std::ofstream os(tmp_path, std::ios::binary | std::ios::trunc);
+	if (!os.is_open())
+	{
+		std::cerr << "Unable to write cache manifest " << tmp_path << std::endl;
+		return false;
+	}
+
+	os.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+	os.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(CacheManifestEntry));
+	os.close();
+
+	if (os.fail() || std::rename(tmp_path.c_str(), path) != 0)
+	{
+		std::cerr << "Unable to write cache manifest " << path << std::endl;
+		std::remove(tmp_path.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool ApfsContainer::LoadCacheManifest(const char *path, ApfsVolume *vol)
+{
+	std::shared_ptr<std::vector<CacheManifestEntry>> entries;
+	CacheManifestHeader hdr;
+	CacheManifestHeader ref;
+	CacheStats cs;
+	size_t cnt;
+	size_t chunk;
+	size_t k;
+
+	std::ifstream is(path, std::ios::binary);
+	if (!is.is_open())
+		return false;
+
+	is.read(reinterpret_cast<char *>(&hdr), sizeof(hdr));
+	if (!is)
+		return false;
+
+	// Only valid for exactly the same state of the container and volume.
+	// Newer transactions may have reused the blocks.
+	FillManifestHeader(ref, vol);
+	ref.entry_cnt = hdr.entry_cnt;
+
+	if (memcmp(&hdr, &ref, sizeof(hdr)) != 0)
+	{
+		if (g_debug & Dbg_Info)
+			std::cout << "Cache manifest " << path << " does not match, ignoring it." << std::endl;
+		return false;
+	}
+
+	// Don't load more than fits, the later entries would only evict the earlier ones.
+	m_block_cache.GetStats(cs);
+	cnt = std::min<uint64_t>(hdr.entry_cnt, cs.capacity);
+
+	entries = std::make_shared<std::vector<CacheManifestEntry>>(cnt);
+
+	is.read(reinterpret_cast<char *>(entries->data()), cnt * sizeof(CacheManifestEntry));
+	if (!is)
+		return false;
+
+	// Each worker gets a contiguous range of oids of one tree. For the
+	// physical trees, these are addresses, which keeps the seeks short.
+	std::sort(entries->begin(), entries->end(), [](const CacheManifestEntry &a, const CacheManifestEntry &b) {
+		return a.tree != b.tree ? a.tree < b.tree : a.oid < b.oid;
+	});
+
+	chunk = (cnt + NX_WORKER_THREADS - 1) / NX_WORKER_THREADS;
+
+	for (k = 0; k < cnt; k += chunk)
+	{
+		size_t last = std::min(k + chunk, cnt);
+
+		{
+			std::lock_guard<std::mutex> lock(m_warmup_mutex);
+			m_warmup_pending++;
+		}
+
+		if (!m_thread_pool.Submit(std::bind(&ApfsContainer::WarmupTask, this, entries, k, last, vol)))
+			WarmupTask(entries, k, last, vol);
+	}
+
+	return true;
+}
+
+void ApfsContainer::WaitCacheWarmup()
+{
+	std::unique_lock<std::mutex> lock(m_warmup_mutex);
+
+	while (m_warmup_pending > 0)
+		m_warmup_cv.wait(lock);
+}
+
+void ApfsContainer::WarmupTask(std::shared_ptr<std::vector<CacheManifestEntry>> entries, size_t first, size_t last, ApfsVolume *vol)
+{
+	// The nodes are loaded in batches, each of them is read with one
+	// vectored read, and the nodes are mostly adjacent on disk.
+	constexpr size_t batch_size = 64;
+
+	std::vector<oid_t> oids;
+	uint32_t tree = 0;
+	size_t k;
+
+	for (k = first; k < last; k++)
+	{
+		const CacheManifestEntry &e = (*entries)[k];
+
+		if (!oids.empty() && (e.tree != tree || oids.size() == batch_size))
+		{
+			WarmNodes(tree, oids.data(), oids.size(), vol);
+			oids.clear();
+		}
+
+		tree = e.tree;
+		oids.push_back(e.oid);
+	}
+
+	if (!oids.empty())
+		WarmNodes(tree, oids.data(), oids.size(), vol);
+
+	std::lock_guard<std::mutex> lock(m_warmup_mutex);
+
+	m_warmup_pending--;
+	if (m_warmup_pending == 0)
+		m_warmup_cv.notify_all();
+}
+
+void ApfsContainer::WarmNodes(uint32_t tree, const oid_t *oids, size_t cnt, ApfsVolume *vol)
+{
+	// The omap trees of the container and the volumes read their nodes the
+	// same way, so the container omap can load the nodes of all of them.
+	switch (tree)
+	{
+	case CMT_CONTAINER:
+		m_omap.WarmNodes(oids, cnt);
+		break;
+	case CMT_FS_TREE:
+		if (vol)
+			vol->fstree().WarmNodes(oids, cnt);
+		break;
+	case CMT_FEXT_TREE:
+		if (vol && vol->isSealed())
+			vol->fexttree().WarmNodes(oids, cnt);
+		break;
+	default:
+		break;
+	}
+}
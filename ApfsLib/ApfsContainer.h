@@ -20,22 +20,70 @@
 #pragma once
 
 #include "Global.h"
+#include "BlockCache.h"
 #include "BTree.h"
 #include "DiskStruct.h"
 #include "Device.h"
 #include "CheckPointMap.h"
 #include "ApfsNodeMapperBTree.h"
 #include "KeyMgmt.h"
+#include "ThreadPool.h"
 
+#include <condition_variable>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
 #include <vector>
 
 class ApfsVolume;
 class BlockDumper;
 
+// Default memory budget of the metadata block cache of a container.
+constexpr size_t NX_CACHE_DEFAULT_SIZE = 64 * 1024 * 1024;
+// Default budget of the omap translation cache of each volume.
+constexpr size_t NX_OMAP_CACHE_DEFAULT_SIZE = 4 * 1024 * 1024;
+// Default budget of the extent map cache of each volume.
+constexpr size_t NX_EXTENT_CACHE_DEFAULT_SIZE = 8 * 1024 * 1024;
+// Default budget of the file data read-ahead of each volume.
+constexpr size_t NX_READAHEAD_DEFAULT_SIZE = 16 * 1024 * 1024;
+// Reads a ReadQueue of the container keeps in flight.
+constexpr unsigned int NX_READ_QUEUE_DEPTH = 32;
+// Idle ReadQueues each volume keeps for reuse.
+constexpr size_t NX_READ_QUEUE_POOL_SIZE = 8;
+// Number of leaves a BTreeIterator reads ahead in the background.
+constexpr unsigned int NX_PREFETCH_DEFAULT_WINDOW = 4;
+constexpr unsigned int NX_WORKER_THREADS = 4;
+// Worker threads of the file data read-ahead of each volume.
+constexpr unsigned int NX_READAHEAD_THREADS = 2;
+
 class ApfsContainer
 {
 public:
+	// A valid container superblock in the checkpoint descriptor area.
+	struct CheckPoint
+	{
+		xid_t xid;
+		paddr_t paddr;
+	};
+
+	// Blocks for ReadBlocksV.
+	struct BlockRange
+	{
+		uint8_t *data;
+		paddr_t paddr;
+		uint64_t blkcnt;
+	};
+
+	// A B-tree node block for ReadMetaBlocks, ok is set by the read.
+	struct MetaBlockRead
+	{
+		uint8_t *data;
+		paddr_t paddr;
+		uint8_t flags;
+		bool ok;
+	};
+
 	ApfsContainer(Device *disk_main, uint64_t main_start, uint64_t main_len, Device *disk_tier2 = 0, uint64_t tier2_start = 0, uint64_t tier2_len = 0);
 	~ApfsContainer();
 
@@ -43,9 +91,22 @@ public:
 
 	ApfsVolume *GetVolume(unsigned int fsid, const std::string &passphrase = std::string(), xid_t snap_xid = 0);
 	bool GetVolumeInfo(unsigned int fsid, apfs_superblock_t &apsb);
+	// All checkpoints found by Init, oldest first. Any of them can be
+	// mounted by passing its xid to Init.
+	const std::vector<CheckPoint> &GetCheckPoints() const { return m_checkpoints; }
 
 	bool ReadBlocks(uint8_t *data, paddr_t paddr, uint64_t blkcnt = 1) const;
+	// Reads all ranges with one vectored read, see Device::ReadV.
+	bool ReadBlocksV(const BlockRange *ranges, size_t cnt) const;
+	// Asynchronous reads, the completions are returned by queue.Wait.
+	// Blocks on the tier2 device are read right away.
+	std::unique_ptr<ReadQueue> CreateReadQueue(unsigned int depth = NX_READ_QUEUE_DEPTH) const;
+	void ReadBlocksAsync(ReadQueue &queue, uint8_t *data, paddr_t paddr, uint64_t blkcnt, uint64_t tag) const;
 	bool ReadAndVerifyHeaderBlock(uint8_t *data, paddr_t paddr) const;
+	// Reads a B-tree node block as described by its CacheBlockFlags.
+	bool ReadMetaBlock(uint8_t *data, paddr_t paddr, uint8_t flags, ApfsVolume *vol) const;
+	// Same for several blocks, with one vectored read.
+	void ReadMetaBlocks(MetaBlockRead *reads, size_t cnt, ApfsVolume *vol) const;
 
 	uint32_t GetBlocksize() const { return m_nx.nx_block_size; }
 	uint64_t GetBlockCount() const { return m_nx.nx_block_count; }
@@ -55,9 +116,81 @@ public:
 	bool GetPasswordHint(std::string &hint, const apfs_uuid_t &vol_uuid);
 	bool IsUnencrypted() const { return m_keymgr.IsUnencrypted(); }
 
+	void SetCacheSize(size_t bytes) { m_block_cache.SetSize(bytes); }
+	void SetCacheHugePages(bool enable) { m_block_cache.SetHugePages(enable); }
+	// Budget for pinning the index nodes of the omap and fs trees at mount.
+	void SetPinSize(size_t bytes) { m_block_cache.SetPinSize(bytes); }
+	BlockCache &GetBlockCache() { return m_block_cache; }
+	// Budget of the omap translation cache of volumes opened afterwards.
+	void SetOmapCacheSize(size_t bytes) { m_omap_cache_size = bytes; }
+	size_t GetOmapCacheSize() const { return m_omap_cache_size; }
+	// Volumes opened afterwards load their omap into memory at mount if it
+	// takes at most that many bytes. 0 disables the preload.
+	void SetOmapPreloadSize(size_t bytes) { m_omap_preload_size = bytes; }
+	size_t GetOmapPreloadSize() const { return m_omap_preload_size; }
+	// Budget in bytes of the extent map cache of volumes opened afterwards,
+	// 0 disables the cache.
+	void SetExtentCacheSize(size_t bytes) { m_extent_cache_size = bytes; }
+	size_t GetExtentCacheSize() const { return m_extent_cache_size; }
+	// Memory for file data read ahead by volumes opened afterwards, 0
+	// disables read-ahead.
+	void SetReadAheadSize(size_t bytes) { m_read_ahead_size = bytes; }
+	size_t GetReadAheadSize() const { return m_read_ahead_size; }
+
+	void SetPrefetchWindow(unsigned int leaves) { m_prefetch_window = leaves; }
+	unsigned int GetPrefetchWindow() const { return m_prefetch_window; }
+	ThreadPool &GetThreadPool() { return m_thread_pool; }
+
 	void dump(BlockDumper& bd);
 
+	// Writes the cache and I/O counters as "name value" lines.
+	void WriteStats(std::ostream &os);
+
+	// A cache manifest lists the blocks in the cache, so that the next mount
+	// of the same volume at the same xid can start with a warm cache.
+	// Loading only queues the reads, vol must be kept alive until
+	// WaitCacheWarmup() has returned.
+	bool SaveCacheManifest(const char *path, ApfsVolume *vol);
+	bool LoadCacheManifest(const char *path, ApfsVolume *vol);
+	void WaitCacheWarmup();
+
 private:
+	struct CacheManifestHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t block_size;
+		apfs_uuid_t nx_uuid;
+		xid_t nx_xid;
+		apfs_uuid_t vol_uuid;
+		xid_t vol_xid;
+		uint64_t entry_cnt;
+	};
+
+	// The tree a manifest entry is loaded through. The tree decides how the
+	// node is read, nothing of that is taken from the manifest.
+	enum CacheManifestTree : uint32_t
+	{
+		CMT_CONTAINER = 0, // Physical node of a tree without volume, e.g. an omap
+		CMT_FS_TREE = 1,   // Node of the volume's fs tree, by virtual oid
+		CMT_FEXT_TREE = 2  // Node of the fext tree of a sealed volume
+	};
+
+	struct CacheManifestEntry
+	{
+		oid_t oid;
+		uint32_t tree;
+		uint32_t reserved;
+	};
+
+	bool ScanCheckPoints();
+	Device *GetDevice(uint64_t &offs, paddr_t paddr) const;
+	// Decrypts and verifies a volume metadata block that has been read.
+	bool CheckMetaBlock(uint8_t *data, paddr_t paddr, uint8_t flags, ApfsVolume *vol) const;
+	void FillManifestHeader(CacheManifestHeader &hdr, ApfsVolume *vol) const;
+	void WarmupTask(std::shared_ptr<std::vector<CacheManifestEntry>> entries, size_t first, size_t last, ApfsVolume *vol);
+	void WarmNodes(uint32_t tree, const oid_t *oids, size_t cnt, ApfsVolume *vol);
+
 	Device *m_main_disk;
 	const uint64_t m_main_part_start;
 	const uint64_t m_main_part_len;
@@ -69,6 +202,21 @@ private:
 	std::string m_passphrase;
 
 	nx_superblock_t m_nx;
+	std::vector<CheckPoint> m_checkpoints;
+
+	BlockCache m_block_cache;
+	// Declared after the cache, so the workers are gone before the cache.
+	ThreadPool m_thread_pool;
+	unsigned int m_prefetch_window;
+	size_t m_omap_cache_size;
+	size_t m_omap_preload_size;
+	size_t m_extent_cache_size;
+	size_t m_read_ahead_size;
+	mutable std::mutex m_io_mutex;
+
+	std::mutex m_warmup_mutex;
+	std::condition_variable m_warmup_cv;
+	unsigned int m_warmup_pending;
 
 	CheckPointMap m_cpm;
 	ApfsNodeMapperBTree m_omap;
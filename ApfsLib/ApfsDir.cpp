@@ -30,6 +30,11 @@
 #include "BTree.h"
 #include "Util.h"
 
+// Data streams with more extents than this are read through the tree.
+static constexpr size_t EXTENT_MAP_MAX_EXTENTS = 16384;
+// Bytes an extent map takes in the cache besides the map itself.
+static constexpr size_t EXTENT_MAP_OVERHEAD = 64;
+
 #ifndef _MSC_VER
 template<size_t L>
 void strcpy_s(char (&dst)[L], const char *src)
@@ -173,7 +178,7 @@ ApfsDir::ApfsDir(ApfsVolume &vol) :
 	m_blksize_sh = log2(m_blksize);
 	m_blksize_mask_lo = m_blksize - 1;
 	m_blksize_mask_hi = ~m_blksize_mask_lo;
-	m_tmp_blk.resize(m_blksize);
+	m_tmp_blk.resize(2 * m_blksize);
 	// m_bt.EnableDebugOutput();
 }
 
@@ -189,11 +194,49 @@ bool ApfsDir::GetInode(ApfsDir::Inode& res, uint64_t inode)
 
 	key.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_INODE, inode);
 
-	rc = m_fs_tree.Lookup(bte, &key, sizeof(j_inode_key_t), CompareStdDirKey, this, true);
+	rc = m_fs_tree.Lookup(bte, DirKeyCompare(&key, sizeof(j_inode_key_t), *this), true);
 
 	if (!rc || (bte.val == nullptr))
 		return false;
 
+	ParseInode(res, inode, bte);
+
+	return true;
+}
+
+size_t ApfsDir::GetInodes(std::vector<Inode> &res, const std::vector<uint64_t> &inodes)
+{
+	std::vector<j_inode_key_t> keys(inodes.size());
+	std::vector<DirKeyCompare> cmps;
+	std::vector<BTreeEntry> entries(inodes.size());
+	size_t found = 0;
+	size_t k;
+
+	res.assign(inodes.size(), Inode());
+	cmps.reserve(inodes.size());
+
+	for (k = 0; k < inodes.size(); k++)
+	{
+		keys[k].hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_INODE, inodes[k]);
+		cmps.emplace_back(&keys[k], sizeof(j_inode_key_t), *this);
+	}
+
+	m_fs_tree.LookupBatch(entries.data(), cmps.data(), cmps.size(), true);
+
+	for (k = 0; k < inodes.size(); k++)
+	{
+		if (entries[k].val == nullptr)
+			continue;
+
+		ParseInode(res[k], inodes[k], entries[k]);
+		found++;
+	}
+
+	return found;
+}
+
+void ApfsDir::ParseInode(Inode &res, uint64_t inode, const BTreeEntry &bte)
+{
 	// const uint8_t *idata = reinterpret_cast<const uint8_t *>(bte.val);
 	const j_inode_val_t *obj = reinterpret_cast<const j_inode_val_t *>(bte.val);
 
@@ -292,56 +335,29 @@ bool ApfsDir::GetInode(ApfsDir::Inode& res, uint64_t inode)
 			xdata += ((xf[n].x_size + 7) & ~7);
 		}
 	}
-
-	return true;
 }
 
 bool ApfsDir::ListDirectory(std::vector<DirRec> &dir, uint64_t inode)
 {
 	uint8_t skey_buf[0x500];
-
-	BTreeIterator it;
-	BTreeEntry bte;
+	j_key_t hkey;
 	bool rc;
 	uint64_t skey;
 
-	const j_key_t *k;
-	const j_drec_val_t *v;
-
 	skey = APFS_TYPE_ID(APFS_TYPE_DIR_REC, inode);
 
 	dir.clear();
 
-	if (m_txt_fmt & 9)
-	{
-		j_drec_hashed_key_t *key = reinterpret_cast<j_drec_hashed_key_t *>(skey_buf);
-		key->hdr.obj_id_and_type = skey;
-		key->name_len_and_hash = 0;
-		key->name[0] = 0;
-
-		rc = m_fs_tree.GetIterator(it, key, sizeof(j_drec_hashed_key_t), CompareStdDirKey, this);
-	}
-	else
-	{
-		j_drec_key_t *key = reinterpret_cast<j_drec_key_t *>(skey_buf);
-		key->hdr.obj_id_and_type = skey;
-		key->name_len = 0;
-		key->name[0] = 0;
-
-		rc = m_fs_tree.GetIterator(it, key, sizeof(j_drec_key_t), CompareStdDirKey, this);
-	}
-
-	if (!rc)
-		return false;
+	// Only the obj_id_and_type is compared, so this is the last record.
+	hkey.obj_id_and_type = skey;
+	DirKeyCompare hi(&hkey, sizeof(j_key_t), *this);
 
-	for (;;)
+	auto visit = [this, &dir](const BTreeEntry &bte) -> bool
 	{
+		const j_key_t *k;
+		const j_drec_val_t *v;
 		DirRec e;
 
-		rc = it.GetEntry(bte);
-		if (!rc)
-			break;
-
 		if (g_debug & Dbg_Dir)
 		{
 			DumpBuffer(reinterpret_cast<const uint8_t *>(bte.key), bte.key_len, "entry key");
@@ -350,9 +366,6 @@ bool ApfsDir::ListDirectory(std::vector<DirRec> &dir, uint64_t inode)
 
 		k = reinterpret_cast<const j_key_t *>(bte.key);
 
-		if (k->obj_id_and_type != skey)
-			break;
-
 		e.parent_id = k->obj_id_and_type & OBJ_ID_MASK;
 
 		if (m_txt_fmt != 0)
@@ -403,10 +416,29 @@ bool ApfsDir::ListDirectory(std::vector<DirRec> &dir, uint64_t inode)
 
 		dir.push_back(e);
 
-		it.next();
+		return true;
+	};
+
+	if (m_txt_fmt & 9)
+	{
+		j_drec_hashed_key_t *key = reinterpret_cast<j_drec_hashed_key_t *>(skey_buf);
+		key->hdr.obj_id_and_type = skey;
+		key->name_len_and_hash = 0;
+		key->name[0] = 0;
+
+		rc = m_fs_tree.Scan(DirKeyCompare(key, sizeof(j_drec_hashed_key_t), *this), hi, visit);
+	}
+	else
+	{
+		j_drec_key_t *key = reinterpret_cast<j_drec_key_t *>(skey_buf);
+		key->hdr.obj_id_and_type = skey;
+		key->name_len = 0;
+		key->name[0] = 0;
+
+		rc = m_fs_tree.Scan(DirKeyCompare(key, sizeof(j_drec_key_t), *this), hi, visit);
 	}
 
-	return true;
+	return rc;
 }
 
 bool ApfsDir::LookupName(ApfsDir::DirRec& res, uint64_t parent_id, const char* name)
@@ -436,7 +468,7 @@ bool ApfsDir::LookupName(ApfsDir::DirRec& res, uint64_t parent_id, const char* n
 		}
 		res.hash = skey->name_len_and_hash;
 
-		rc = m_fs_tree.Lookup(e, skey, sizeof(j_drec_hashed_key_t) + (skey->name_len_and_hash & J_DREC_LEN_MASK), CompareStdDirKey, this, true);
+		rc = m_fs_tree.Lookup(e, DirKeyCompare(skey, sizeof(j_drec_hashed_key_t) + (skey->name_len_and_hash & J_DREC_LEN_MASK), *this), true);
 	}
 	else
 	{
@@ -451,7 +483,7 @@ bool ApfsDir::LookupName(ApfsDir::DirRec& res, uint64_t parent_id, const char* n
 		}
 		res.hash = 0;
 
-		rc = m_fs_tree.Lookup(e, skey, sizeof(j_drec_key_t) + skey->name_len, CompareStdDirKey, this, true);
+		rc = m_fs_tree.Lookup(e, DirKeyCompare(skey, sizeof(j_drec_key_t) + skey->name_len, *this), true);
 	}
 
 	if (!rc)
@@ -476,168 +508,391 @@ bool ApfsDir::LookupName(ApfsDir::DirRec& res, uint64_t parent_id, const char* n
 
 bool ApfsDir::ReadFile(void* data, uint64_t inode, uint64_t offs, size_t size)
 {
-	BTreeEntry e;
-	bool rc;
+	std::shared_ptr<const ExtentMap> map;
+	FileExtent ext;
+	BlockRun run;
 
 	uint8_t *bdata = reinterpret_cast<uint8_t *>(data);
 
 	size_t cur_size;
 	uint64_t blk_idx;
 	uint64_t blk_offs;
-
-	uint64_t extent_size;
+	uint64_t blk_cnt;
 	uint64_t extent_offs;
-	paddr_t extent_paddr;
-	uint64_t extent_crypto_id;
+	paddr_t paddr;
+	uint64_t tweak;
+
+	map = GetExtentMap(inode);
+
+	run.blk_cnt = 0;
+	m_block_reads.clear();
 
 	while (size > 0)
 	{
-		if (m_vol.isSealed()) {
-			fext_tree_key_t key;
-			const fext_tree_key_t *fext_key = nullptr;
-			const fext_tree_val_t *fext_val = nullptr;
+		if (map)
+		{
+			auto it = std::upper_bound(map->cbegin(), map->cend(), offs, [](uint64_t offs, const FileExtent &e) { return offs < e.logical_addr; });
 
-			key.private_id = inode;
-			key.logical_addr = offs;
+			if (it == map->cbegin())
+				return false;
 
-			rc = m_vol.fexttree().Lookup(e, &key, sizeof(key), CompareFextKey, this, false);
-			if (!rc) return false;
+			ext = *(it - 1);
+		}
+		else if (!LookupExtent(ext, inode, offs))
+		{
+			return false;
+		}
 
-			fext_key = reinterpret_cast<const fext_tree_key_t *>(e.key);
-			fext_val = reinterpret_cast<const fext_tree_val_t *>(e.val);
+		extent_offs = offs - ext.logical_addr;
 
-			extent_offs = offs - fext_key->logical_addr;
+		// Past the end of the last extent
+		if (extent_offs >= ext.len)
+			break;
 
-			extent_size = fext_val->len_and_flags & J_FILE_EXTENT_LEN_MASK;
-			extent_paddr = fext_val->phys_block_num;
-			extent_crypto_id = 0; /* TODO: Crypto on sealed volumes? Need later beta for that ... */
-		} else {
-			j_file_extent_key_t key;
-			const j_file_extent_key_t *ext_key = nullptr;
-			const j_file_extent_val_t *ext_val = nullptr;
+		cur_size = size;
 
-			key.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_FILE_EXTENT, inode);
-			key.logical_addr = offs;
+		if ((extent_offs + cur_size) > ext.len)
+			cur_size = ext.len - extent_offs;
 
-			if (g_debug & Dbg_Dir)
-				std::cout << "ReadFile(inode=" << inode << ",offs=" << offs << ",size=" << size << ")" << std::endl;
+		if (ext.paddr != 0)
+		{
+			blk_idx = extent_offs >> m_blksize_sh;
+			blk_offs = extent_offs & m_blksize_mask_lo;
+			blk_cnt = (blk_offs + cur_size + m_blksize_mask_lo) >> m_blksize_sh;
+			paddr = ext.paddr + blk_idx;
+			tweak = ext.crypto_id + blk_idx;
+
+			// Extents that continue where the last one ended, both on disk and
+			// in the buffer, are read together. Encrypted blocks also need
+			// consecutive tweaks.
+			if (run.blk_cnt != 0 && blk_offs == 0 && ((run.head + run.len) & m_blksize_mask_lo) == 0 &&
+				paddr == run.paddr + run.blk_cnt && bdata == run.data + run.len &&
+				(!m_vol.isEncrypted() || (run.tweak != 0 && tweak == run.tweak + run.blk_cnt)))
+			{
+				run.blk_cnt += blk_cnt;
+				run.len += cur_size;
+			}
+			else
+			{
+				if (!ReadBlockRun(run))
+					return false;
+
+				run.data = bdata;
+				run.paddr = paddr;
+				run.blk_cnt = blk_cnt;
+				run.tweak = tweak;
+				run.head = static_cast<uint32_t>(blk_offs);
+				run.len = cur_size;
+			}
+		}
+		else
+		{
+			memset(bdata, 0, cur_size);
+		}
+
+		bdata += cur_size;
+		offs += cur_size;
+		size -= cur_size;
+		// printf("ReadFile: offs=%016lX size=%016lX\n", offs, size);
+	}
 
-			rc = m_fs_tree.Lookup(e, &key, sizeof(key), CompareStdDirKey, this, false);
+	if (!ReadBlockRun(run))
+		return false;
 
-			if (!rc)
-				return false;
+	return FlushBlocks();
+}
 
-			ext_key = reinterpret_cast<const j_file_extent_key_t *>(e.key);
-			ext_val = reinterpret_cast<const j_file_extent_val_t *>(e.val);
+bool ApfsDir::ReadBlockRun(const BlockRun &run)
+{
+	uint64_t end;
+	uint64_t tail;
+	uint64_t first;
+	uint64_t cnt;
+	uint8_t *out;
 
-			if (g_debug & Dbg_Dir)
-			{
-				std::cout << "FileExtent " << ext_key->hdr.obj_id_and_type << " " << ext_key->logical_addr << " => ";
-				std::cout << ext_val->len_and_flags << " " << ext_val->phys_block_num << " " << ext_val->crypto_id << std::endl;
-			}
+	if (run.blk_cnt == 0)
+		return true;
 
-			if (ext_key->hdr.obj_id_and_type != key.hdr.obj_id_and_type)
-				return false;
+	end = run.head + run.len;
+	tail = end & m_blksize_mask_lo;
 
-			// Remove flags from length member
-			extent_offs = offs - ext_key->logical_addr;
+	if (g_debug & Dbg_Dir)
+		std::cout << "Read run blk " << run.paddr << " cnt " << run.blk_cnt << " head " << run.head << " len " << run.len << std::endl;
 
-			extent_size = ext_val->len_and_flags & J_FILE_EXTENT_LEN_MASK;
-			extent_paddr = ext_val->phys_block_num;
-			extent_crypto_id = ext_val->crypto_id;
-		}
+	if (run.head == 0 && tail == 0)
+	{
+		QueueBlocks(run.data, run.paddr, run.blk_cnt, run.tweak);
+		return true;
+	}
 
-		blk_idx = extent_offs >> m_blksize_sh;
-		blk_offs = extent_offs & m_blksize_mask_lo;
+	// Both blocks are partial anyway, one read into the bounce buffer.
+	if (run.blk_cnt <= 2)
+	{
+		if (!m_vol.ReadBlocks(m_tmp_blk.data(), run.paddr, run.blk_cnt, run.tweak))
+			return false;
 
-		cur_size = size;
+		memcpy(run.data, m_tmp_blk.data() + run.head, run.len);
+		return true;
+	}
 
-		if ((extent_offs + cur_size) > extent_size)
-			cur_size = extent_size - extent_offs;
+	// Only the partial edge blocks go through the bounce buffer, the rest
+	// is read straight into the destination.
+	first = 0;
+	cnt = run.blk_cnt;
+	out = run.data;
 
-		if (cur_size == 0)
-			break;
+	if (run.head != 0)
+	{
+		if (!m_vol.ReadBlocks(m_tmp_blk.data(), run.paddr, 1, run.tweak))
+			return false;
 
-		if (extent_paddr != 0)
-		{
-			if (blk_offs == 0 && cur_size > m_blksize)
-				cur_size &= m_blksize_mask_hi;
+		memcpy(out, m_tmp_blk.data() + run.head, m_blksize - run.head);
+		out += m_blksize - run.head;
+		first = 1;
+		cnt--;
+	}
 
-			if (blk_offs == 0 && (cur_size & m_blksize_mask_lo) == 0)
-			{
-				if (g_debug & Dbg_Dir)
-					std::cout << "Full read blk " << extent_paddr + blk_idx << " cnt " << (cur_size >> m_blksize_sh) << std::endl;
-				m_vol.ReadBlocks(bdata, extent_paddr + blk_idx, cur_size >> m_blksize_sh, extent_crypto_id + blk_idx);
-			}
-			else
-			{
-				if (g_debug & Dbg_Dir)
-					std::cout << "Partial read blk " << extent_paddr + blk_idx << " cnt 1" << std::endl;
+	if (tail != 0)
+	{
+		if (!m_vol.ReadBlocks(m_tmp_blk.data(), run.paddr + run.blk_cnt - 1, 1, run.tweak + run.blk_cnt - 1))
+			return false;
 
-				m_vol.ReadBlocks(m_tmp_blk.data(), extent_paddr + blk_idx, 1, extent_crypto_id + blk_idx);
+		memcpy(run.data + run.len - tail, m_tmp_blk.data(), tail);
+		cnt--;
+	}
 
-				if (blk_offs + cur_size > m_blksize)
-					cur_size = m_blksize - blk_offs;
+	QueueBlocks(out, run.paddr + first, cnt, run.tweak + first);
+	return true;
+}
 
-				if (g_debug & Dbg_Dir)
-					std::cout << "Partial copy off " << blk_offs << " size " << cur_size << std::endl;
+void ApfsDir::QueueBlocks(uint8_t *data, paddr_t paddr, uint64_t blk_cnt, uint64_t tweak)
+{
+	BlockRun rd;
 
-				memcpy(bdata, m_tmp_blk.data() + blk_offs, cur_size);
-			}
-		}
+	rd.data = data;
+	rd.paddr = paddr;
+	rd.blk_cnt = blk_cnt;
+	rd.tweak = tweak;
+	rd.head = 0;
+	rd.len = blk_cnt << m_blksize_sh;
+
+	m_block_reads.push_back(rd);
+}
+
+bool ApfsDir::FlushBlocks()
+{
+	const ApfsContainer &nx = m_vol.getContainer();
+	std::unique_ptr<ReadQueue> queue;
+	uint64_t tag;
+	bool ok;
+	bool rc = true;
+	size_t k;
+
+	if (m_block_reads.empty())
+		return true;
+
+	// Nothing to overlap with a single read.
+	if (m_block_reads.size() == 1)
+	{
+		rc = m_vol.ReadBlocks(m_block_reads[0].data, m_block_reads[0].paddr, m_block_reads[0].blk_cnt, m_block_reads[0].tweak);
+		m_block_reads.clear();
+		return rc;
+	}
+
+	queue = m_vol.BorrowReadQueue();
+
+	for (k = 0; k < m_block_reads.size(); k++)
+		nx.ReadBlocksAsync(*queue, m_block_reads[k].data, m_block_reads[k].paddr, m_block_reads[k].blk_cnt, k);
+
+	while (queue->Wait(tag, ok))
+	{
+		if (ok)
+			m_vol.DecryptBlocks(m_block_reads[tag].data, m_block_reads[tag].blk_cnt, m_block_reads[tag].tweak);
 		else
-			memset(bdata, 0, cur_size);
-		bdata += cur_size;
-		offs += cur_size;
-		size -= cur_size;
-		// printf("ReadFile: offs=%016lX size=%016lX\n", offs, size);
+			rc = false;
 	}
 
-	return true;
+	m_vol.ReturnReadQueue(std::move(queue));
+	m_block_reads.clear();
+
+	return rc;
 }
 
-bool ApfsDir::ListAttributes(std::vector<std::string>& names, uint64_t inode)
+std::shared_ptr<const ApfsDir::ExtentMap> ApfsDir::GetExtentMap(uint64_t private_id)
 {
-	j_inode_key_t skey;
-	const j_xattr_key_t *ekey;
-	BTreeIterator it;
-	BTreeEntry res;
-	bool rc;
+	ClockCache<std::shared_ptr<const ExtentMap>> &cache = m_vol.extentcache();
+	std::shared_ptr<const ExtentMap> map;
+	std::shared_ptr<ExtentMap> new_map;
 
-	skey.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_INODE, inode);
+	if (cache.GetCapacity() == 0)
+		return map;
 
-	rc = m_fs_tree.GetIterator(it, &skey, sizeof(j_inode_key_t), CompareStdDirKey, this);
-	if (!rc)
-		return false;
+	// Streams with too many extents, or whose map doesn't fit into the
+	// cache, are cached as null, so that they aren't scanned again on every
+	// read.
+	if (cache.Get(private_id, map))
+		return map;
 
-	for (;;)
+	new_map = std::make_shared<ExtentMap>();
+
+	if (LoadExtentMap(*new_map, private_id))
 	{
-		rc = it.GetEntry(res);
-		if (!rc)
-			break;
+		new_map->shrink_to_fit();
+		map = new_map;
+	}
+	else if (new_map->size() < EXTENT_MAP_MAX_EXTENTS)
+		return map;
 
-		ekey = reinterpret_cast<const j_xattr_key_t *>(res.key);
+	// Charged with the size of the map, plus its control block and slot.
+	if (!map || !cache.Put(private_id, map, sizeof(ExtentMap) + map->capacity() * sizeof(FileExtent) + EXTENT_MAP_OVERHEAD))
+		cache.Put(private_id, nullptr, EXTENT_MAP_OVERHEAD);
 
-		if ((ekey->hdr.obj_id_and_type & OBJ_ID_MASK) != inode)
-			break;
+	return map;
+}
+
+bool ApfsDir::LoadExtentMap(ExtentMap &map, uint64_t private_id)
+{
+	bool complete = true;
 
-		if ((ekey->hdr.obj_id_and_type >> OBJ_TYPE_SHIFT) < APFS_TYPE_XATTR)
+	auto add = [&map, &complete](uint64_t logical_addr, uint64_t len_and_flags, paddr_t paddr, uint64_t crypto_id) -> bool
+	{
+		if (map.size() >= EXTENT_MAP_MAX_EXTENTS)
 		{
-			it.next();
-			continue;
+			complete = false;
+			return false;
 		}
 
-		if ((ekey->hdr.obj_id_and_type >> OBJ_TYPE_SHIFT) > APFS_TYPE_XATTR)
-			break;
+		map.push_back({ logical_addr, len_and_flags & J_FILE_EXTENT_LEN_MASK, paddr, crypto_id });
+		return true;
+	};
+
+	if (m_vol.isSealed())
+	{
+		fext_tree_key_t skey;
+		fext_tree_key_t hkey;
+
+		skey.private_id = private_id;
+		skey.logical_addr = 0;
+		hkey.private_id = private_id;
+		hkey.logical_addr = UINT64_MAX;
+
+		if (!m_vol.fexttree().Scan(FextKeyCompare(skey), FextKeyCompare(hkey), [&add](const BTreeEntry &res) -> bool
+		{
+			const fext_tree_key_t *fext_key = reinterpret_cast<const fext_tree_key_t *>(res.key);
+			const fext_tree_val_t *fext_val = reinterpret_cast<const fext_tree_val_t *>(res.val);
+
+			/* TODO: Crypto on sealed volumes? Need later beta for that ... */
+			return add(fext_key->logical_addr, fext_val->len_and_flags, fext_val->phys_block_num, 0);
+		}))
+			return false;
+	}
+	else
+	{
+		j_file_extent_key_t skey;
+		j_key_t hkey;
+
+		skey.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_FILE_EXTENT, private_id);
+		skey.logical_addr = 0;
+		hkey.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_FILE_EXTENT, private_id);
 
-		names.push_back(reinterpret_cast<const char *>(ekey->name));
+		if (!m_fs_tree.Scan(DirKeyCompare(&skey, sizeof(j_file_extent_key_t), *this), DirKeyCompare(&hkey, sizeof(j_key_t), *this),
+			[&add](const BTreeEntry &res) -> bool
+		{
+			const j_file_extent_key_t *ext_key = reinterpret_cast<const j_file_extent_key_t *>(res.key);
+			const j_file_extent_val_t *ext_val = reinterpret_cast<const j_file_extent_val_t *>(res.val);
 
-		it.next();
+			return add(ext_key->logical_addr, ext_val->len_and_flags, ext_val->phys_block_num, ext_val->crypto_id);
+		}))
+			return false;
+	}
+
+	return complete;
+}
+
+bool ApfsDir::LookupExtent(FileExtent &ext, uint64_t private_id, uint64_t offs)
+{
+	BTreeEntry e;
+	bool rc;
+
+	if (m_vol.isSealed()) {
+		fext_tree_key_t key;
+		const fext_tree_key_t *fext_key = nullptr;
+		const fext_tree_val_t *fext_val = nullptr;
+
+		key.private_id = private_id;
+		key.logical_addr = offs;
+
+		rc = m_vol.fexttree().Lookup(e, FextKeyCompare(key), false);
+		if (!rc) return false;
+
+		fext_key = reinterpret_cast<const fext_tree_key_t *>(e.key);
+		fext_val = reinterpret_cast<const fext_tree_val_t *>(e.val);
+
+		if (fext_key->private_id != private_id)
+			return false;
+
+		ext.logical_addr = fext_key->logical_addr;
+		ext.len = fext_val->len_and_flags & J_FILE_EXTENT_LEN_MASK;
+		ext.paddr = fext_val->phys_block_num;
+		ext.crypto_id = 0; /* TODO: Crypto on sealed volumes? Need later beta for that ... */
+	} else {
+		j_file_extent_key_t key;
+		const j_file_extent_key_t *ext_key = nullptr;
+		const j_file_extent_val_t *ext_val = nullptr;
+
+		key.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_FILE_EXTENT, private_id);
+		key.logical_addr = offs;
+
+		if (g_debug & Dbg_Dir)
+			std::cout << "LookupExtent(inode=" << private_id << ",offs=" << offs << ")" << std::endl;
+
+		rc = m_fs_tree.Lookup(e, DirKeyCompare(&key, sizeof(key), *this), false);
+
+		if (!rc)
+			return false;
+
+		ext_key = reinterpret_cast<const j_file_extent_key_t *>(e.key);
+		ext_val = reinterpret_cast<const j_file_extent_val_t *>(e.val);
+
+		if (g_debug & Dbg_Dir)
+		{
+			std::cout << "FileExtent " << ext_key->hdr.obj_id_and_type << " " << ext_key->logical_addr << " => ";
+			std::cout << ext_val->len_and_flags << " " << ext_val->phys_block_num << " " << ext_val->crypto_id << std::endl;
+		}
+
+		if (ext_key->hdr.obj_id_and_type != key.hdr.obj_id_and_type)
+			return false;
+
+		// Remove flags from length member
+		ext.logical_addr = ext_key->logical_addr;
+		ext.len = ext_val->len_and_flags & J_FILE_EXTENT_LEN_MASK;
+		ext.paddr = ext_val->phys_block_num;
+		ext.crypto_id = ext_val->crypto_id;
 	}
 
 	return true;
 }
 
+bool ApfsDir::ListAttributes(std::vector<std::string>& names, uint64_t inode)
+{
+	j_inode_key_t skey;
+	j_key_t hkey;
+
+	skey.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_INODE, inode);
+	hkey.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_XATTR, inode);
+
+	return m_fs_tree.Scan(DirKeyCompare(&skey, sizeof(j_inode_key_t), *this), DirKeyCompare(&hkey, sizeof(j_key_t), *this),
+		[&names](const BTreeEntry &res) -> bool
+	{
+		const j_xattr_key_t *ekey = reinterpret_cast<const j_xattr_key_t *>(res.key);
+
+		if ((ekey->hdr.obj_id_and_type >> OBJ_TYPE_SHIFT) == APFS_TYPE_XATTR)
+			names.push_back(reinterpret_cast<const char *>(ekey->name));
+
+		return true;
+	});
+}
+
 bool ApfsDir::GetAttribute(std::vector<uint8_t>& data, uint64_t inode, const char* name)
 {
 	uint8_t skey_buf[0x500];
@@ -657,7 +912,7 @@ bool ApfsDir::GetAttribute(std::vector<uint8_t>& data, uint64_t inode, const cha
 	skey->name_len = static_cast<int16_t>(name_len);
 	memcpy(skey->name, name, skey->name_len);
 
-	rc = m_fs_tree.Lookup(res, skey, sizeof(j_xattr_key_t) + skey->name_len, CompareStdDirKey, this, true);
+	rc = m_fs_tree.Lookup(res, DirKeyCompare(skey, sizeof(j_xattr_key_t) + skey->name_len, *this), true);
 	if (!rc)
 		return false;
 
@@ -723,7 +978,7 @@ bool ApfsDir::GetAttributeInfo(ApfsDir::XAttr& attr, uint64_t inode, const char*
 	skey->name_len = static_cast<int16_t>(name_len);
 	memcpy(skey->name, name, skey->name_len);
 
-	rc = m_fs_tree.Lookup(res, skey, sizeof(j_xattr_key_t) + skey->name_len, CompareStdDirKey, this, true);
+	rc = m_fs_tree.Lookup(res, DirKeyCompare(skey, sizeof(j_xattr_key_t) + skey->name_len, *this), true);
 	if (!rc)
 		return false;
 
@@ -740,108 +995,81 @@ bool ApfsDir::GetAttributeInfo(ApfsDir::XAttr& attr, uint64_t inode, const char*
 	return true;
 }
 
-int ApfsDir::CompareStdDirKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context)
+ApfsDir::DirKeyCompare::DirKeyCompare(const void *key, size_t key_size, const ApfsDir &dir)
 {
-	// assert(skey_len == 8);
-	// assert(ekey_len == 8);
-
-	(void)ekey_len;
-
-	ApfsDir *dir = reinterpret_cast<ApfsDir *>(context);
+	uint64_t ks = *reinterpret_cast<const le_uint64_t *>(key);
 
-	uint64_t ks = *reinterpret_cast<const le_uint64_t *>(skey);
-	uint64_t ke = *reinterpret_cast<const le_uint64_t *>(ekey);
-
-	// std::cout << std::hex << std::uppercase << std::setfill('0');
-
-	ks = (ks << 4) | (ks >> 60);
-	ke = (ke << 4) | (ke >> 60);
+	m_key = key;
+	m_key_size = key_size;
+	m_ks = (ks << 4) | (ks >> 60);
+	m_hashed = (dir.m_txt_fmt & 9) != 0;
+}
 
-	// std::cout << std::setw(16) << ks << " : " << std::setw(16) << ke << std::endl;
+int ApfsDir::DirKeyCompare::CompareRest(const void *ekey, size_t ekey_len) const
+{
+	const void *skey = m_key;
 
-	if (ke < ks)
-		return -1;
-	if (ke > ks)
-		return 1;
+	(void)ekey_len;
 
-	if (skey_len > 8)
+	switch (m_ks & 0xF)
 	{
-		switch (ks & 0xF)
+	case APFS_TYPE_DIR_REC:
+		if (m_hashed)
 		{
-		case APFS_TYPE_DIR_REC:
-			if (dir->m_txt_fmt & 9)
-			{
-				const j_drec_hashed_key_t *s = reinterpret_cast<const j_drec_hashed_key_t *>(skey);
-				const j_drec_hashed_key_t *e = reinterpret_cast<const j_drec_hashed_key_t *>(ekey);
-
-				/* TODO: Is this correct? Yes. TODO check _apfs_cstrncmp. */
-				if ((e->name_len_and_hash & J_DREC_HASH_MASK) < (s->name_len_and_hash & J_DREC_HASH_MASK))
-					return -1;
-				if ((e->name_len_and_hash & J_DREC_HASH_MASK) > (s->name_len_and_hash & J_DREC_HASH_MASK))
-					return 1;
+			const j_drec_hashed_key_t *s = reinterpret_cast<const j_drec_hashed_key_t *>(skey);
+			const j_drec_hashed_key_t *e = reinterpret_cast<const j_drec_hashed_key_t *>(ekey);
 
-				return apfs_strncmp(e->name, e->name_len_and_hash & J_DREC_LEN_MASK, s->name, s->name_len_and_hash & J_DREC_LEN_MASK);
-			}
-			else
-			{
-				const j_drec_key_t *s = reinterpret_cast<const j_drec_key_t *>(skey);
-				const j_drec_key_t *e = reinterpret_cast<const j_drec_key_t *>(ekey);
-
-				return apfs_strncmp(e->name, e->name_len, s->name, s->name_len);
-			}
-			break;
-		case APFS_TYPE_FILE_EXTENT:
-		{
-			const j_file_extent_key_t *s = reinterpret_cast<const j_file_extent_key_t *>(skey);
-			const j_file_extent_key_t *e = reinterpret_cast<const j_file_extent_key_t *>(ekey);
-
-			assert(skey_len == sizeof(j_file_extent_key_t));
-			assert(ekey_len == sizeof(j_file_extent_key_t));
-
-			if (e->logical_addr < s->logical_addr)
+			/* TODO: Is this correct? Yes. TODO check _apfs_cstrncmp. */
+			if ((e->name_len_and_hash & J_DREC_HASH_MASK) < (s->name_len_and_hash & J_DREC_HASH_MASK))
 				return -1;
-			if (e->logical_addr > s->logical_addr)
+			if ((e->name_len_and_hash & J_DREC_HASH_MASK) > (s->name_len_and_hash & J_DREC_HASH_MASK))
 				return 1;
+
+			return apfs_strncmp(e->name, e->name_len_and_hash & J_DREC_LEN_MASK, s->name, s->name_len_and_hash & J_DREC_LEN_MASK);
 		}
-			break;
-		case APFS_TYPE_XATTR:
+		else
 		{
-			const j_xattr_key_t *s = reinterpret_cast<const j_xattr_key_t *>(skey);
-			const j_xattr_key_t *e = reinterpret_cast<const j_xattr_key_t *>(ekey);
+			const j_drec_key_t *s = reinterpret_cast<const j_drec_key_t *>(skey);
+			const j_drec_key_t *e = reinterpret_cast<const j_drec_key_t *>(ekey);
 
 			return apfs_strncmp(e->name, e->name_len, s->name, s->name_len);
 		}
-			break;
-		case APFS_TYPE_FILE_INFO:
-		{
-			const j_file_info_key_t *s = reinterpret_cast<const j_file_info_key_t *>(skey);
-			const j_file_info_key_t *e = reinterpret_cast<const j_file_info_key_t *>(ekey);
+		break;
+	case APFS_TYPE_FILE_EXTENT:
+	{
+		const j_file_extent_key_t *s = reinterpret_cast<const j_file_extent_key_t *>(skey);
+		const j_file_extent_key_t *e = reinterpret_cast<const j_file_extent_key_t *>(ekey);
 
-			if (e->info_and_lba < s->info_and_lba)
-				return -1;
-			if (e->info_and_lba > s->info_and_lba)
-				return 1;
+		assert(m_key_size == sizeof(j_file_extent_key_t));
+		assert(ekey_len == sizeof(j_file_extent_key_t));
 
-			break;
-		}
-		}
+		if (e->logical_addr < s->logical_addr)
+			return -1;
+		if (e->logical_addr > s->logical_addr)
+			return 1;
 	}
+		break;
+	case APFS_TYPE_XATTR:
+	{
+		const j_xattr_key_t *s = reinterpret_cast<const j_xattr_key_t *>(skey);
+		const j_xattr_key_t *e = reinterpret_cast<const j_xattr_key_t *>(ekey);
 
-	return 0;
-}
+		return apfs_strncmp(e->name, e->name_len, s->name, s->name_len);
+	}
+		break;
+	case APFS_TYPE_FILE_INFO:
+	{
+		const j_file_info_key_t *s = reinterpret_cast<const j_file_info_key_t *>(skey);
+		const j_file_info_key_t *e = reinterpret_cast<const j_file_info_key_t *>(ekey);
+
+		if (e->info_and_lba < s->info_and_lba)
+			return -1;
+		if (e->info_and_lba > s->info_and_lba)
+			return 1;
+
+		break;
+	}
+	}
 
-int ApfsDir::CompareFextKey(const void* skey, size_t skey_len, const void* ekey, size_t ekey_len, void* context)
-{
-	const fext_tree_key_t *s = reinterpret_cast<const fext_tree_key_t *>(skey);
-	const fext_tree_key_t *e = reinterpret_cast<const fext_tree_key_t *>(ekey);
-
-	if (e->private_id < s->private_id)
-		return -1;
-	if (e->private_id > s->private_id)
-		return 1;
-	if (e->logical_addr < s->logical_addr)
-		return -1;
-	if (e->logical_addr > s->logical_addr)
-		return 1;
 	return 0;
 }
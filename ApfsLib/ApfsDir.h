@@ -19,12 +19,14 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "DiskStruct.h"
 
 class BTree;
+class BTreeEntry;
 class ApfsVolume;
 
 class ApfsDir
@@ -119,11 +121,25 @@ public:
 		j_xattr_dstream_t xstrm;
 	};
 
+	struct FileExtent
+	{
+		uint64_t logical_addr;
+		uint64_t len;
+		paddr_t paddr;
+		uint64_t crypto_id;
+	};
+
+	// All extents of a data stream, sorted by logical address.
+	typedef std::vector<FileExtent> ExtentMap;
+
 
 	ApfsDir(ApfsVolume &vol);
 	~ApfsDir();
 
 	bool GetInode(Inode &res, uint64_t inode);
+	// Looks up all inodes with one sweep over the fs tree. The obj_id of
+	// res[k] is 0 if inodes[k] doesn't exist. Returns the number found.
+	size_t GetInodes(std::vector<Inode> &res, const std::vector<uint64_t> &inodes);
 
 	bool ListDirectory(std::vector<DirRec> &dir, uint64_t inode);
 	bool LookupName(DirRec &res, uint64_t parent_id, const char *name);
@@ -133,8 +149,98 @@ public:
 	bool GetAttributeInfo(XAttr &attr, uint64_t inode, const char *name);
 
 private:
-	static int CompareStdDirKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context);
-	static int CompareFextKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context);
+	void ParseInode(Inode &res, uint64_t inode, const BTreeEntry &bte);
+
+	// Returns the extent map of a data stream from the cache of the volume,
+	// or loads it. Returns null if the stream has too many extents to keep
+	// them in memory, its map doesn't fit into the cache, the scan failed,
+	// or the cache is disabled. A stream without extents gets an empty map,
+	// which is cached too, so that it isn't scanned on every read.
+	std::shared_ptr<const ExtentMap> GetExtentMap(uint64_t private_id);
+	bool LoadExtentMap(ExtentMap &map, uint64_t private_id);
+	bool LookupExtent(FileExtent &ext, uint64_t private_id, uint64_t offs);
+
+	// Physically contiguous blocks of a read, from one or more extents.
+	struct BlockRun
+	{
+		uint8_t *data;
+		paddr_t paddr;
+		uint64_t blk_cnt;
+		uint64_t tweak;
+		uint32_t head; // Offset of the first byte in the first block
+		uint64_t len;
+	};
+
+	bool ReadBlockRun(const BlockRun &run);
+	// Whole blocks are read straight into the destination. These reads are
+	// collected and issued together by FlushBlocks.
+	void QueueBlocks(uint8_t *data, paddr_t paddr, uint64_t blk_cnt, uint64_t tweak);
+	bool FlushBlocks();
+
+	// Compare object for the fs tree. The obj_id_and_type of the search key
+	// is rotated once, so that keys sort by id first, then by type.
+	class DirKeyCompare
+	{
+	public:
+		DirKeyCompare(const void *key, size_t key_size, const ApfsDir &dir);
+
+		const void *key() const { return m_key; }
+		size_t key_size() const { return m_key_size; }
+
+		int operator()(const void *ekey, size_t ekey_len) const
+		{
+			uint64_t ke = *reinterpret_cast<const le_uint64_t *>(ekey);
+
+			ke = (ke << 4) | (ke >> 60);
+
+			if (ke < m_ks)
+				return -1;
+			if (ke > m_ks)
+				return 1;
+
+			if (m_key_size > 8)
+				return CompareRest(ekey, ekey_len);
+
+			return 0;
+		}
+
+	private:
+		int CompareRest(const void *ekey, size_t ekey_len) const;
+
+		const void *m_key;
+		size_t m_key_size;
+		uint64_t m_ks;
+		bool m_hashed;
+	};
+
+	class FextKeyCompare
+	{
+	public:
+		FextKeyCompare(const fext_tree_key_t &key) : m_key(key) {}
+
+		const void *key() const { return &m_key; }
+		size_t key_size() const { return sizeof(fext_tree_key_t); }
+
+		int operator()(const void *ekey, size_t ekey_len) const
+		{
+			(void)ekey_len;
+
+			const fext_tree_key_t *e = reinterpret_cast<const fext_tree_key_t *>(ekey);
+
+			if (e->private_id < m_key.private_id)
+				return -1;
+			if (e->private_id > m_key.private_id)
+				return 1;
+			if (e->logical_addr < m_key.logical_addr)
+				return -1;
+			if (e->logical_addr > m_key.logical_addr)
+				return 1;
+			return 0;
+		}
+
+	private:
+		const fext_tree_key_t &m_key;
+	};
 
 	ApfsVolume &m_vol;
 	BTree &m_fs_tree;
@@ -143,5 +249,7 @@ private:
 	uint64_t m_blksize_mask_hi;
 	uint64_t m_blksize_mask_lo;
 	int m_blksize_sh;
+	// Bounce buffer for partial blocks
 	std::vector<uint8_t> m_tmp_blk;
+	std::vector<BlockRun> m_block_reads;
 };
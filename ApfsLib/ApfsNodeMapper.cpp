@@ -27,3 +27,19 @@ ApfsNodeMapper::ApfsNodeMapper()
 ApfsNodeMapper::~ApfsNodeMapper()
 {
 }
+
+size_t ApfsNodeMapper::LookupBatch(omap_res_t *res, const oid_t *oids, size_t cnt, xid_t xid)
+{
+	size_t k;
+	size_t found = 0;
+
+	for (k = 0; k < cnt; k++)
+	{
+		if (Lookup(res[k], oids[k], xid))
+			found++;
+		else
+			res[k].paddr = 0;
+	}
+
+	return found;
+}
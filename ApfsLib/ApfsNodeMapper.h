@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include <cstddef>
+
 #include "ApfsTypes.h"
 
 struct omap_res_t
@@ -37,4 +39,7 @@ public:
 	virtual ~ApfsNodeMapper();
 
 	virtual bool Lookup(omap_res_t &res, oid_t oid, xid_t xid) = 0;
+	// Maps cnt oids at once. res[k].paddr is 0 if oids[k] is not found.
+	// Returns the number of oids found.
+	virtual size_t LookupBatch(omap_res_t *res, const oid_t *oids, size_t cnt, xid_t xid);
 };
@@ -17,6 +17,7 @@
 	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <iostream>
@@ -24,32 +25,44 @@
 #include "ApfsNodeMapperBTree.h"
 #include "ApfsContainer.h"
 
-static int CompareOMapKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context)
+class OMapKeyCompare
 {
-	(void)context;
-	(void)skey_len;
-	(void)ekey_len;
-
-	assert(skey_len == sizeof(omap_key_t));
-	assert(ekey_len == sizeof(omap_val_t));
-
-	const omap_key_t *skey_map = reinterpret_cast<const omap_key_t *>(skey);
-	const omap_key_t *ekey_map = reinterpret_cast<const omap_key_t *>(ekey);
-
-	if (ekey_map->ok_oid < skey_map->ok_oid)
-		return -1;
-	if (ekey_map->ok_oid > skey_map->ok_oid)
-		return 1;
-	if (ekey_map->ok_xid < skey_map->ok_xid)
-		return -1;
-	if (ekey_map->ok_xid > skey_map->ok_xid)
-		return 1;
-	return 0;
-}
+public:
+	OMapKeyCompare(const omap_key_t &key) : m_key(key) {}
+
+	const void *key() const { return &m_key; }
+	size_t key_size() const { return sizeof(omap_key_t); }
+
+	int operator()(const void *ekey, size_t ekey_len) const
+	{
+		(void)ekey_len;
+
+		assert(ekey_len == sizeof(omap_key_t));
+
+		const omap_key_t *ekey_map = reinterpret_cast<const omap_key_t *>(ekey);
+
+		if (ekey_map->ok_oid < m_key.ok_oid)
+			return -1;
+		if (ekey_map->ok_oid > m_key.ok_oid)
+			return 1;
+		if (ekey_map->ok_xid < m_key.ok_xid)
+			return -1;
+		if (ekey_map->ok_xid > m_key.ok_xid)
+			return 1;
+		return 0;
+	}
+
+private:
+	const omap_key_t &m_key;
+};
 
 ApfsNodeMapperBTree::ApfsNodeMapperBTree(ApfsContainer &container) :
 	m_tree(container),
-	m_container(container)
+	m_preload_xid(0),
+	m_container(container),
+	m_stat_lookups(0),
+	m_stat_not_found(0),
+	m_stat_preload_hits(0)
 {
 }
 
@@ -81,6 +94,24 @@ bool ApfsNodeMapperBTree::Init(oid_t omap_oid, xid_t xid)
 }
 
 bool ApfsNodeMapperBTree::Lookup(omap_res_t &omr, oid_t oid, xid_t xid)
+{
+	m_stat_lookups.fetch_add(1, std::memory_order_relaxed);
+
+	if (UsePreload(xid))
+		return LookupPreload(omr, oid, xid);
+
+	if (m_cache.Get(omr, oid, xid))
+		return true;
+
+	if (!LookupTree(omr, oid, xid))
+		return false;
+
+	m_cache.Put(omr, oid, xid);
+
+	return true;
+}
+
+bool ApfsNodeMapperBTree::LookupTree(omap_res_t &omr, oid_t oid, xid_t xid)
 {
 	omap_key_t key;
 
@@ -94,8 +125,9 @@ bool ApfsNodeMapperBTree::Lookup(omap_res_t &omr, oid_t oid, xid_t xid)
 
 	// std::cout << std::hex << "Omap Lookup: oid = " << oid << ", xid = " << xid << " => ";
 
-	if (!m_tree.Lookup(res, &key, sizeof(key), CompareOMapKey, this, false))
+	if (!m_tree.Lookup(res, OMapKeyCompare(key), false))
 	{
+		m_stat_not_found.fetch_add(1, std::memory_order_relaxed);
 		// std::cout << "NOT FOUND" << std::endl;
 		std::cerr << std::hex << "oid " << oid << " xid " << xid << " NOT FOUND!!!" << std::endl;
 		return false;
@@ -115,6 +147,7 @@ bool ApfsNodeMapperBTree::Lookup(omap_res_t &omr, oid_t oid, xid_t xid)
 
 	if (key.ok_oid != res_key->ok_oid)
 	{
+		m_stat_not_found.fetch_add(1, std::memory_order_relaxed);
 		// std::cout << "NOT FOUND" << std::endl;
 		std::cerr << std::hex << "oid " << oid << " xid " << xid << " NOT FOUND!!!" << std::endl;
 		omr.oid = oid;
@@ -135,3 +168,204 @@ bool ApfsNodeMapperBTree::Lookup(omap_res_t &omr, oid_t oid, xid_t xid)
 
 	return true;
 }
+
+bool ApfsNodeMapperBTree::LookupPreload(omap_res_t &omr, oid_t oid, xid_t xid)
+{
+	auto it = std::lower_bound(m_preload.cbegin(), m_preload.cend(), oid, [](const PreloadEntry &e, oid_t oid) {
+		return e.oid < oid;
+	});
+
+	if (it == m_preload.cend() || it->oid != oid)
+	{
+		m_stat_not_found.fetch_add(1, std::memory_order_relaxed);
+		std::cerr << std::hex << "oid " << oid << " xid " << xid << " NOT FOUND!!!" << std::endl;
+		omr.oid = oid;
+		omr.xid = xid;
+		omr.flags = 0;
+		omr.size = 0;
+		omr.paddr = 0;
+		return false;
+	}
+
+	m_stat_preload_hits.fetch_add(1, std::memory_order_relaxed);
+
+	omr.oid = it->oid;
+	omr.xid = it->xid;
+	omr.flags = it->flags;
+	omr.size = it->size;
+	omr.paddr = it->paddr;
+
+	return true;
+}
+
+bool ApfsNodeMapperBTree::Preload(xid_t xid, size_t max_bytes)
+{
+	std::vector<PreloadEntry> entries;
+	size_t max_cnt = max_bytes / sizeof(PreloadEntry);
+	bool complete = true;
+
+	// The entries come sorted by oid and xid, so the last one of an oid that
+	// isn't newer than xid is the one a lookup would find.
+	if (!m_tree.Scan(BTScanBegin(), BTScanEnd(), [&](const BTreeEntry &e) -> bool {
+		const omap_key_t *key = reinterpret_cast<const omap_key_t *>(e.key);
+		const omap_val_t *val = reinterpret_cast<const omap_val_t *>(e.val);
+
+		if (e.key_len != sizeof(omap_key_t) || e.val_len != sizeof(omap_val_t))
+		{
+			complete = false;
+			return false;
+		}
+
+		if (key->ok_xid > xid)
+			return true;
+
+		if (entries.empty() || entries.back().oid != key->ok_oid)
+		{
+			if (entries.size() >= max_cnt)
+			{
+				complete = false;
+				return false;
+			}
+			entries.emplace_back();
+		}
+
+		PreloadEntry &pe = entries.back();
+
+		pe.oid = key->ok_oid;
+		pe.xid = key->ok_xid;
+		pe.paddr = val->ov_paddr;
+		pe.flags = val->ov_flags;
+		pe.size = val->ov_size;
+
+		return true;
+	}))
+		return false;
+
+	if (!complete || entries.empty())
+		return false;
+
+	entries.shrink_to_fit();
+	m_preload.swap(entries);
+	m_preload_xid = xid;
+
+	return true;
+}
+
+size_t ApfsNodeMapperBTree::LookupBatch(omap_res_t *res, const oid_t *oids, size_t cnt, xid_t xid)
+{
+	std::vector<omap_key_t> keys;
+	std::vector<OMapKeyCompare> cmps;
+	std::vector<size_t> misses;
+	size_t k;
+	size_t n;
+	size_t found = 0;
+
+	m_stat_lookups.fetch_add(cnt, std::memory_order_relaxed);
+
+	if (UsePreload(xid))
+	{
+		for (k = 0; k < cnt; k++)
+		{
+			if (LookupPreload(res[k], oids[k], xid))
+				found++;
+		}
+		return found;
+	}
+
+	for (k = 0; k < cnt; k++)
+	{
+		if (m_cache.Get(res[k], oids[k], xid))
+			found++;
+		else
+			misses.push_back(k);
+	}
+
+	if (misses.empty())
+		return found;
+
+	std::vector<BTreeEntry> entries(misses.size());
+
+	keys.resize(misses.size());
+	cmps.reserve(misses.size());
+
+	for (n = 0; n < misses.size(); n++)
+	{
+		keys[n].ok_oid = oids[misses[n]];
+		keys[n].ok_xid = xid;
+		cmps.emplace_back(keys[n]);
+	}
+
+	m_tree.LookupBatch(entries.data(), cmps.data(), misses.size(), false);
+
+	for (n = 0; n < misses.size(); n++)
+	{
+		omap_res_t &omr = res[misses[n]];
+		oid_t oid = keys[n].ok_oid;
+		const omap_key_t *res_key = reinterpret_cast<const omap_key_t *>(entries[n].key);
+		const omap_val_t *res_val = reinterpret_cast<const omap_val_t *>(entries[n].val);
+
+		if (!res_key || res_key->ok_oid != oid)
+		{
+			m_stat_not_found.fetch_add(1, std::memory_order_relaxed);
+			std::cerr << std::hex << "oid " << oid << " xid " << xid << " NOT FOUND!!!" << std::endl;
+			omr.oid = oid;
+			omr.xid = xid;
+			omr.flags = 0;
+			omr.size = 0;
+			omr.paddr = 0;
+			continue;
+		}
+
+		assert(entries[n].val_len == sizeof(omap_val_t));
+
+		omr.oid = res_key->ok_oid;
+		omr.xid = res_key->ok_xid;
+		omr.flags = res_val->ov_flags;
+		omr.size = res_val->ov_size;
+		omr.paddr = res_val->ov_paddr;
+		found++;
+
+		m_cache.Put(omr, oid, xid);
+	}
+
+	return found;
+}
+
+void ApfsNodeMapperBTree::GetStats(OmapStats &st) const
+{
+	CacheStats cs;
+
+	m_cache.GetStats(cs);
+
+	st.lookups = m_stat_lookups.load(std::memory_order_relaxed);
+	st.not_found = m_stat_not_found.load(std::memory_order_relaxed);
+	st.cache_hits = cs.hits;
+	st.cache_misses = cs.misses;
+	st.cache_evictions = cs.evictions;
+	st.cache_entries = cs.entries;
+	st.cache_capacity = cs.capacity;
+	st.preload_entries = m_preload.size();
+	st.preload_hits = m_stat_preload_hits.load(std::memory_order_relaxed);
+}
+
+void ApfsNodeMapperBTree::WriteStats(std::ostream &os, const char *name) const
+{
+	OmapStats st;
+	std::string tree_name(name);
+
+	GetStats(st);
+
+	os << std::dec;
+	os << name << ".lookups " << st.lookups << std::endl;
+	os << name << ".not_found " << st.not_found << std::endl;
+	os << name << ".cache_hits " << st.cache_hits << std::endl;
+	os << name << ".cache_misses " << st.cache_misses << std::endl;
+	os << name << ".cache_evictions " << st.cache_evictions << std::endl;
+	os << name << ".cache_entries " << st.cache_entries << std::endl;
+	os << name << ".cache_capacity " << st.cache_capacity << std::endl;
+	os << name << ".preload_entries " << st.preload_entries << std::endl;
+	os << name << ".preload_hits " << st.preload_hits << std::endl;
+
+	tree_name.append(".tree");
+	m_tree.WriteStats(os, tree_name.c_str());
+}
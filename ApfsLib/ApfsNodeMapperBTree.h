@@ -19,13 +19,30 @@
 
 #pragma once
 
+#include <atomic>
+#include <vector>
+
 #include "DiskStruct.h"
 
 #include "ApfsNodeMapper.h"
 #include "BTree.h"
+#include "OmapCache.h"
 
 class BlockDumper;
 
+struct OmapStats
+{
+	uint64_t lookups;
+	uint64_t not_found;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t cache_evictions;
+	uint64_t cache_entries;
+	uint64_t cache_capacity;
+	uint64_t preload_entries;
+	uint64_t preload_hits;
+};
+
 class ApfsNodeMapperBTree : public ApfsNodeMapper
 {
 public:
@@ -34,12 +51,49 @@ public:
 
 	bool Init(oid_t omap_oid, xid_t xid);
 	bool Lookup(omap_res_t & omr, oid_t oid, xid_t xid) override;
+	size_t LookupBatch(omap_res_t *res, const oid_t *oids, size_t cnt, xid_t xid) override;
+
+	size_t PinIndexNodes() { return m_tree.PinIndexNodes(); }
+	size_t WarmNodes(const oid_t *oids, size_t cnt) { return m_tree.WarmNodes(oids, cnt); }
+	// Budget of the translation cache. Must be set before the first lookup.
+	void SetCacheSize(size_t bytes) { m_cache.SetSize(bytes); }
+	// Reads the whole omap once and keeps the entries valid at xid in a
+	// sorted table, lookups at xid then don't touch the tree anymore. Fails
+	// if the table would need more than max_bytes. Must be called before
+	// the first lookup.
+	bool Preload(xid_t xid, size_t max_bytes);
+	bool IsPreloaded() const { return !m_preload.empty(); }
+
+	void GetStats(OmapStats &st) const;
+	void WriteStats(std::ostream &os, const char *name) const;
 
 	void dump(BlockDumper &bd) { m_tree.dump(bd); }
+	BTree &tree() { return m_tree; }
 
 private:
+	struct PreloadEntry
+	{
+		oid_t oid;
+		xid_t xid;
+		paddr_t paddr;
+		uint32_t flags;
+		uint32_t size;
+	};
+
+	bool LookupTree(omap_res_t &omr, oid_t oid, xid_t xid);
+	bool UsePreload(xid_t xid) const { return xid == m_preload_xid && !m_preload.empty(); }
+	bool LookupPreload(omap_res_t &omr, oid_t oid, xid_t xid);
+
 	omap_phys_t m_omap;
 	BTree m_tree;
+	OmapCache m_cache;
+	// Sorted by oid, one entry per oid.
+	std::vector<PreloadEntry> m_preload;
+	xid_t m_preload_xid;
 
 	ApfsContainer &m_container;
+
+	std::atomic<uint64_t> m_stat_lookups;
+	std::atomic<uint64_t> m_stat_not_found;
+	std::atomic<uint64_t> m_stat_preload_hits;
 };
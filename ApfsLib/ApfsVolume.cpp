@@ -34,10 +34,14 @@ ApfsVolume::ApfsVolume(ApfsContainer &container) :
 	m_fs_tree(container, this),
 	m_extentref_tree(container, this),
 	m_snap_meta_tree(container, this),
-	m_fext_tree(container, this)
+	m_fext_tree(container, this),
+	m_read_ahead(*this)
 {
 	m_apsb_paddr = 0;
 	m_is_encrypted = false;
+
+	m_extent_cache.SetCapacity(container.GetExtentCacheSize());
+	m_read_ahead.SetSize(container.GetReadAheadSize());
 }
 
 ApfsVolume::~ApfsVolume()
@@ -63,6 +67,8 @@ bool ApfsVolume::Init(paddr_t apsb_paddr)
 	if (m_sb.apfs_magic != APFS_MAGIC)
 		return false;
 
+	m_omap.SetCacheSize(m_container.GetOmapCacheSize());
+
 	if (!m_omap.Init(m_sb.apfs_omap_oid, m_sb.apfs_o.o_xid)) {
 		std::cerr << "WARNING: Volume omap tree init failed." << std::endl;
 		return false;
@@ -109,6 +115,9 @@ bool ApfsVolume::Init(paddr_t apsb_paddr)
 			std::cerr << "ERROR: fext tree init failed" << std::endl;
 	}
 
+	PreloadOmap();
+	PinIndexNodes();
+
 	return true;
 }
 
@@ -151,6 +160,8 @@ bool ApfsVolume::MountSnapshot(paddr_t apsb_paddr, xid_t snap_xid)
 
 	snap_val = reinterpret_cast<const j_snap_metadata_val_t *>(snap_entry.val);
 
+	m_omap.SetCacheSize(m_container.GetOmapCacheSize());
+
 	if (!m_omap.Init(m_sb.apfs_omap_oid, m_sb.apfs_o.o_xid)) {
 		std::cerr << "WARNING: Volume omap tree init failed." << std::endl;
 		return false;
@@ -211,9 +222,65 @@ bool ApfsVolume::MountSnapshot(paddr_t apsb_paddr, xid_t snap_xid)
 			std::cerr << "ERROR: fext tree init failed" << std::endl;
 	}
 
+	PreloadOmap();
+	PinIndexNodes();
+
 	return true;
 }
 
+void ApfsVolume::PreloadOmap()
+{
+	size_t max_bytes = m_container.GetOmapPreloadSize();
+
+	if (max_bytes == 0)
+		return;
+
+	if (m_omap.Preload(m_sb.apfs_o.o_xid, max_bytes))
+	{
+		// All lookups of the volume are at this xid, the cache would stay empty.
+		m_omap.SetCacheSize(0);
+	}
+	else
+	{
+		std::cerr << "WARNING: Volume omap could not be preloaded, using the tree." << std::endl;
+	}
+}
+
+void ApfsVolume::PinIndexNodes()
+{
+	// The omap comes first, every fs tree node has to go through it.
+	if (!m_omap.IsPreloaded())
+		m_omap.PinIndexNodes();
+	m_fs_tree.PinIndexNodes();
+
+	if (isSealed())
+		m_fext_tree.PinIndexNodes();
+}
+
+void ApfsVolume::WriteStats(std::ostream &os)
+{
+	CacheStats cs;
+
+	m_omap.WriteStats(os, "vol.omap");
+	m_fs_tree.WriteStats(os, "vol.fs_tree");
+	m_snap_meta_tree.WriteStats(os, "vol.snap_meta_tree");
+
+	if (isSealed())
+		m_fext_tree.WriteStats(os, "vol.fext_tree");
+
+	m_extent_cache.GetStats(cs);
+
+	os << std::dec;
+	os << "vol.extent_cache.hits " << cs.hits << std::endl;
+	os << "vol.extent_cache.misses " << cs.misses << std::endl;
+	os << "vol.extent_cache.evictions " << cs.evictions << std::endl;
+	os << "vol.extent_cache.entries " << cs.entries << std::endl;
+	os << "vol.extent_cache.bytes " << m_extent_cache.GetSize() << std::endl;
+	os << "vol.extent_cache.capacity_bytes " << cs.capacity << std::endl;
+
+	m_read_ahead.WriteStats(os, "vol.readahead");
+}
+
 void ApfsVolume::dump(BlockDumper& bd)
 {
 	std::vector<uint8_t> blk;
@@ -345,13 +412,20 @@ void ApfsVolume::dump(BlockDumper& bd)
 
 bool ApfsVolume::ReadBlocks(uint8_t * data, paddr_t paddr, uint64_t blkcnt, uint64_t xts_tweak)
 {
-	constexpr int encryption_block_size = 0x200;
-
 	if (!m_container.ReadBlocks(data, paddr, blkcnt))
 		return false;
 
+	DecryptBlocks(data, blkcnt, xts_tweak);
+
+	return true;
+}
+
+void ApfsVolume::DecryptBlocks(uint8_t *data, uint64_t blkcnt, uint64_t xts_tweak)
+{
+	constexpr int encryption_block_size = 0x200;
+
 	if (!m_is_encrypted || (xts_tweak == 0))
-		return true;
+		return;
 
 	uint64_t cs_factor = m_container.GetBlocksize() / encryption_block_size;
 	uint64_t uno = xts_tweak * cs_factor;
@@ -363,8 +437,35 @@ bool ApfsVolume::ReadBlocks(uint8_t * data, paddr_t paddr, uint64_t blkcnt, uint
 		m_aes.Decrypt(data + k, data + k, encryption_block_size, uno);
 		uno++;
 	}
+}
 
-	return true;
+std::unique_ptr<ReadQueue> ApfsVolume::BorrowReadQueue()
+{
+	std::unique_ptr<ReadQueue> queue;
+
+	{
+		std::lock_guard<std::mutex> lock(m_read_queue_mtx);
+
+		if (!m_read_queues.empty())
+		{
+			queue = std::move(m_read_queues.back());
+			m_read_queues.pop_back();
+		}
+	}
+
+	if (!queue)
+		queue = m_container.CreateReadQueue();
+
+	return queue;
+}
+
+void ApfsVolume::ReturnReadQueue(std::unique_ptr<ReadQueue> queue)
+{
+	std::lock_guard<std::mutex> lock(m_read_queue_mtx);
+
+	// More than this are only needed while many requests run at once.
+	if (m_read_queues.size() < NX_READ_QUEUE_POOL_SIZE)
+		m_read_queues.push_back(std::move(queue));
 }
 
 int ApfsVolume::CompareSnapMetaKey(const void* skey, size_t skey_len, const void* ekey, size_t ekey_len, void* context)
@@ -20,13 +20,21 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <ostream>
 
 #include "DiskStruct.h"
+#include "ApfsDir.h"
 #include "ApfsNodeMapperBTree.h"
 #include "BTree.h"
+#include "ClockCache.h"
+#include "ReadAhead.h"
 #include <Crypto/AesXts.h>
 
 class ApfsContainer;
+class ReadQueue;
 class BlockDumper;
 
 class ApfsVolume
@@ -39,19 +47,40 @@ public:
 	bool MountSnapshot(paddr_t apsb_paddr, xid_t snap_xid);
 
 	const char *name() const { return reinterpret_cast<const char *>(m_sb.apfs_volname); }
+	const apfs_uuid_t &uuid() const { return m_sb.apfs_vol_uuid; }
+	xid_t xid() const { return m_sb.apfs_o.o_xid; }
 
 	void dump(BlockDumper &bd);
 
+	// Writes the counters of the volume trees as "name value" lines.
+	void WriteStats(std::ostream &os);
+
 	BTree &fstree() { return m_fs_tree; }
 	BTree &fexttree() { return m_fext_tree; }
+	BTree &omaptree() { return m_omap.tree(); }
+	// Extent maps of recently read data streams, by private_id. Each map is
+	// charged with its size in bytes.
+	ClockCache<std::shared_ptr<const ApfsDir::ExtentMap>> &extentcache() { return m_extent_cache; }
+	ReadAhead &readahead() { return m_read_ahead; }
 	uint32_t getTextFormat() const { return m_sb.apfs_incompatible_features & 0x9; }
 
 	ApfsContainer &getContainer() const { return m_container; }
 
 	bool ReadBlocks(uint8_t *data, paddr_t paddr, uint64_t blkcnt, uint64_t xts_tweak);
+	// Decrypts blocks that have been read without ReadBlocks, does nothing
+	// if the volume or the blocks are not encrypted.
+	void DecryptBlocks(uint8_t *data, uint64_t blkcnt, uint64_t xts_tweak);
+	// ApfsDir lives for a single request, so it borrows a ReadQueue from the
+	// volume instead of setting up its own, and gives it back when done.
+	std::unique_ptr<ReadQueue> BorrowReadQueue();
+	void ReturnReadQueue(std::unique_ptr<ReadQueue> queue);
 	bool isSealed() const { return (m_sb.apfs_incompatible_features & APFS_INCOMPAT_SEALED_VOLUME) != 0; }
+	bool isEncrypted() const { return m_is_encrypted; }
 
 private:
+	void PreloadOmap();
+	void PinIndexNodes();
+
 	static int CompareSnapMetaKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context);
 
 	ApfsContainer &m_container;
@@ -63,9 +92,17 @@ private:
 	BTree m_extentref_tree;
 	BTree m_snap_meta_tree;
 	BTree m_fext_tree;
+	ClockCache<std::shared_ptr<const ApfsDir::ExtentMap>> m_extent_cache;
 
 	paddr_t m_apsb_paddr;
 
 	bool m_is_encrypted;
 	AesXts m_aes;
+
+	std::mutex m_read_queue_mtx;
+	std::vector<std::unique_ptr<ReadQueue>> m_read_queues;
+
+	// Declared last, so that the queued reads are done before anything
+	// else of the volume goes away.
+	ReadAhead m_read_ahead;
 };
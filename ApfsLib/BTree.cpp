@@ -24,10 +24,14 @@
 
 #include <iostream>
 #include <iomanip>
+#include <functional>
+#include <algorithm>
+#include <new>
 
 #include "ApfsContainer.h"
 #include "ApfsVolume.h"
 #include "BTree.h"
+#include "KeySearch.h"
 #include "Util.h"
 #include "BlockDumper.h"
 
@@ -50,6 +54,22 @@ int CompareStdKey(const void *skey, size_t skey_len, const void *ekey, size_t ek
 	return 0;
 }
 
+BTreeKeyIndex::BTreeKeyIndex(uint32_t cnt, bool fixed) :
+	cnt(cnt),
+	k0(reinterpret_cast<uint64_t *>(this + 1)),
+	k1(fixed ? (k0 + cnt) : nullptr)
+{
+}
+
+BTreeKeyIndex *BTreeKeyIndex::Create(uint32_t cnt, bool fixed)
+{
+	static_assert(sizeof(BTreeKeyIndex) % sizeof(uint64_t) == 0, "BTreeKeyIndex arrays misaligned");
+
+	void *mem = ::operator new(sizeof(BTreeKeyIndex) + (fixed ? 2 : 1) * cnt * sizeof(uint64_t));
+
+	return new(mem) BTreeKeyIndex(cnt, fixed);
+}
+
 BTreeEntry::BTreeEntry()
 {
 	key = nullptr;
@@ -72,42 +92,41 @@ void BTreeEntry::clear()
 	m_node.reset();
 }
 
-BTreeNode::BTreeNode(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index) :
+BTreeNode::BTreeNode(BTree &tree, const BlockPtr &block, paddr_t paddr) :
+	m_block(block),
 	m_tree(tree),
-	m_parent_index(parent_index),
-	m_parent(parent),
 	m_paddr(paddr)
 {
-	m_block.assign(block, block + blocksize);
-	m_btn = reinterpret_cast<const btree_node_phys_t *>(m_block.data());
+	m_data = m_block->data();
+	m_btn = reinterpret_cast<const btree_node_phys_t *>(m_data);
 
 	assert(m_btn->btn_table_space.off == 0);
 
 	m_keys_start = sizeof(btree_node_phys_t) + m_btn->btn_table_space.len;
 	if (m_btn->btn_flags & BTNODE_ROOT)
-		m_vals_start = blocksize - sizeof(btree_info_t);
+		m_vals_start = m_block->size() - sizeof(btree_info_t);
 	else
-		m_vals_start = blocksize;
+		m_vals_start = m_block->size();
 }
 
-std::shared_ptr<BTreeNode> BTreeNode::CreateNode(BTree & tree, const uint8_t * block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index)
+std::shared_ptr<BTreeNode> BTreeNode::CreateNode(BTree & tree, const BlockPtr &block, paddr_t paddr)
 {
-	const btree_node_phys_t *btn = reinterpret_cast<const btree_node_phys_t *>(block);
+	const btree_node_phys_t *btn = reinterpret_cast<const btree_node_phys_t *>(block->data());
 
 	if (btn->btn_flags & BTNODE_FIXED_KV_SIZE)
-		return std::make_shared<BTreeNodeFix>(tree, block, blocksize, paddr, parent, parent_index);
+		return std::make_shared<BTreeNodeFix>(tree, block, paddr);
 	else
-		return std::make_shared<BTreeNodeVar>(tree, block, blocksize, paddr, parent, parent_index);
+		return std::make_shared<BTreeNodeVar>(tree, block, paddr);
 }
 
 BTreeNode::~BTreeNode()
 {
 }
 
-BTreeNodeFix::BTreeNodeFix(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index) :
-	BTreeNode(tree, block, blocksize, paddr, parent, parent_index)
+BTreeNodeFix::BTreeNodeFix(BTree &tree, const BlockPtr &block, paddr_t paddr) :
+	BTreeNode(tree, block, paddr)
 {
-	m_entries = reinterpret_cast<const kvoff_t *>(m_block.data() + sizeof(btree_node_phys_t));
+	m_entries = reinterpret_cast<const kvoff_t *>(m_data + sizeof(btree_node_phys_t));
 }
 
 bool BTreeNodeFix::GetEntry(BTreeEntry & result, uint32_t index) const
@@ -117,12 +136,12 @@ bool BTreeNodeFix::GetEntry(BTreeEntry & result, uint32_t index) const
 	if (index >= m_btn->btn_nkeys)
 		return false;
 
-	result.key = m_block.data() + m_keys_start + m_entries[index].k;
+	result.key = m_data + m_keys_start + m_entries[index].k;
 	result.key_len = m_tree.GetKeyLen();
 
 	if (m_entries[index].v != BTOFF_INVALID)
 	{
-		result.val = m_block.data() + m_vals_start - m_entries[index].v;
+		result.val = m_data + m_vals_start - m_entries[index].v;
 		result.val_len = (m_btn->btn_flags & BTNODE_LEAF) ? m_tree.GetValLen() : sizeof(oid_t);
 	}
 	else
@@ -134,10 +153,10 @@ bool BTreeNodeFix::GetEntry(BTreeEntry & result, uint32_t index) const
 	return true;
 }
 
-BTreeNodeVar::BTreeNodeVar(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index) :
-	BTreeNode(tree, block, blocksize, paddr, parent, parent_index)
+BTreeNodeVar::BTreeNodeVar(BTree &tree, const BlockPtr &block, paddr_t paddr) :
+	BTreeNode(tree, block, paddr)
 {
-	m_entries = reinterpret_cast<const kvloc_t *>(m_block.data() + sizeof(btree_node_phys_t));
+	m_entries = reinterpret_cast<const kvloc_t *>(m_data + sizeof(btree_node_phys_t));
 }
 
 bool BTreeNodeVar::GetEntry(BTreeEntry & result, uint32_t index) const
@@ -147,12 +166,12 @@ bool BTreeNodeVar::GetEntry(BTreeEntry & result, uint32_t index) const
 	if (index >= m_btn->btn_nkeys)
 		return false;
 
-	result.key = m_block.data() + m_keys_start + m_entries[index].k.off;
+	result.key = m_data + m_keys_start + m_entries[index].k.off;
 	result.key_len = m_entries[index].k.len;
 
 	if (m_entries[index].v.off != BTOFF_INVALID)
 	{
-		result.val = m_block.data() + m_vals_start - m_entries[index].v.off;
+		result.val = m_data + m_vals_start - m_entries[index].v.off;
 		result.val_len = m_entries[index].v.len;
 	}
 	else
@@ -164,39 +183,50 @@ bool BTreeNodeVar::GetEntry(BTreeEntry & result, uint32_t index) const
 	return true;
 }
 
+static std::atomic<uint64_t> s_next_tree_id(1);
+
 BTree::BTree(ApfsContainer &container, ApfsVolume *volume) :
-	m_container(container)
+	m_container(container),
+	m_id(s_next_tree_id.fetch_add(1, std::memory_order_relaxed)),
+	m_stat_lookups(0),
+	m_stat_iterators(0),
+	m_stat_node_hits(0),
+	m_stat_node_misses(0),
+	m_stat_prefetches(0),
+	m_stat_finger_hits(0)
 {
 	m_volume = volume;
 
 	m_root_node = nullptr;
 	m_omap = nullptr;
 	m_xid = 0;
+	m_key_index_type = KeyIndexType::None;
 	m_debug = false;
+	m_prefetch_pending = 0;
 }
 
 BTree::~BTree()
 {
-#ifdef BTREE_USE_MAP
-	m_nodes.clear();
-#endif
+	// Background reads still reference this tree.
+	std::unique_lock<std::mutex> lock(m_prefetch_mutex);
+
+	while (m_prefetch_pending > 0)
+		m_prefetch_cv.wait(lock);
 }
 
 bool BTree::Init(oid_t oid_root, xid_t xid, ApfsNodeMapper *omap)
 {
-	std::shared_ptr<BTreeNode> dummy;
-
 	m_omap = omap;
 	m_oid = oid_root;
 	m_xid = xid;
 
 	if (oid_root == 0) return false;
 
-	m_root_node = GetNode(oid_root, dummy, 0);
+	m_root_node = GetNode(oid_root);
 
 	if (m_root_node)
 	{
-		memcpy(&m_treeinfo, m_root_node->block().data() + m_root_node->block().size() - sizeof(btree_info_t), sizeof(btree_info_t));
+		InitFromRoot(m_root_node);
 		return true;
 	}
 	else
@@ -206,151 +236,209 @@ bool BTree::Init(oid_t oid_root, xid_t xid, ApfsNodeMapper *omap)
 	}
 }
 
-bool BTree::Lookup(BTreeEntry &result, const void *key, size_t key_size, BTCompareFunc func, void *context, bool exact)
+void BTree::InitFromRoot(const std::shared_ptr<BTreeNode> &root)
 {
-	if (!m_root_node)
-		return false;
+	m_root_node = root;
 
-	oid_t oid;
-	oid_t oid_parent;
-	int index;
+	memcpy(&m_treeinfo, root->block() + root->blocksize() - sizeof(btree_info_t), sizeof(btree_info_t));
 
-	std::shared_ptr<BTreeNode> node(m_root_node);
-	BTreeEntry e;
+	m_key_index_type = KeyIndexType::None;
 
-	if (m_debug)
+	switch (root->subtype())
 	{
-		// std::cout << std::hex << "BTree::Lookup: key=" << *reinterpret_cast<const uint64_t *>(key) << " root=" << node->nodeid() << std::endl;
-		std::cout << "BTree::Lookup: ";
-		DumpHex(std::cout, reinterpret_cast<const uint8_t *>(key), key_size, key_size);
+	case OBJECT_TYPE_OMAP:
+	case OBJECT_TYPE_FEXT_TREE:
+		if ((root->flags() & BTNODE_FIXED_KV_SIZE) && m_treeinfo.bt_fixed.bt_key_size == 2 * sizeof(uint64_t))
+			m_key_index_type = KeyIndexType::Fixed128;
+		break;
+	case OBJECT_TYPE_FSTREE:
+		if (!(root->flags() & BTNODE_HASHED))
+			m_key_index_type = KeyIndexType::JKey;
+		break;
+	default:
+		break;
 	}
+}
 
-	while (node->level() > 0)
-	{
-		index = FindBin(node, key, key_size, func, context, FindMode::LE);
+int BTree::FindInNode(const std::shared_ptr<BTreeNode> &node, const void *key, size_t key_size, BTCompareFunc func, void *context, bool use_index)
+{
+	return FindBin(node, BTFuncCompare(key, key_size, func, context), FindMode::LE, use_index);
+}
 
-		if (index < 0)
-			return false;
+bool BTree::Lookup(BTreeEntry &result, const void *key, size_t key_size, BTCompareFunc func, void *context, bool exact)
+{
+	return Lookup(result, BTFuncCompare(key, key_size, func, context), exact);
+}
 
-		node->GetEntry(e, index);
-		// DumpHex(std::cout, reinterpret_cast<const uint8_t*>(e.val), e.val_len, 32);
+bool BTree::GetIterator(BTreeIterator& it, const void* key, size_t key_size, BTCompareFunc func, void *context)
+{
+	return GetIterator(it, BTFuncCompare(key, key_size, func, context));
+}
 
-		oid_parent = node->nodeid();
+bool BTree::GetIteratorBegin(BTreeIterator& it)
+{
+	std::shared_ptr<BTreeNode> node(m_root_node);
 
-		if (node->flags() & BTNODE_HASHED) {
-			const btn_index_node_val_t *binv = reinterpret_cast<const btn_index_node_val_t*>(e.val);
-			oid = binv->binv_child_oid + m_oid;
-		} else {
-			assert(e.val_len == sizeof(oid_t));
-			oid = *reinterpret_cast<const oid_t *>(e.val);
-		}
+	if (!node)
+		return false;
 
-		node = GetNode(oid, node, index);
+	m_stat_iterators.fetch_add(1, std::memory_order_relaxed);
 
-		if (!node)
-		{
-			std::cerr << "BTree::Lookup: Node " << oid << " with parent " << oid_parent << " not found." << std::endl;
-			return false;
-		}
-	}
+	it.Setup(this);
 
-	index = FindBin(node, key, key_size, func, context, exact ? FindMode::EQ : FindMode::LE);
+	while (node->level() > 0)
+	{
+		it.Push(node, 0);
 
-	if (m_debug)
-		std::cout << "Result = " << node->nodeid() << ":" << index << std::endl;
+		node = GetChildNode(node, 0);
 
-	if (index < 0)
-		return false;
+		if (!node)
+			return false;
+	}
 
-	node->GetEntry(result, index);
-	result.m_node = node;
+	it.SetLeaf(node, 0);
 
 	return true;
 }
 
-bool BTree::GetIterator(BTreeIterator& it, const void* key, size_t key_size, BTCompareFunc func, void *context)
+size_t BTree::PinIndexNodes()
 {
-	oid_t oid;
-	int index;
-
-	std::shared_ptr<BTreeNode> node(m_root_node);
+	BlockCache &cache = m_container.GetBlockCache();
+	std::vector<std::shared_ptr<BTreeNode>> level;
+	std::vector<std::shared_ptr<BTreeNode>> next;
+	std::shared_ptr<BTreeNode> child;
 	BTreeEntry e;
+	size_t cnt = 0;
+	size_t n;
+	uint32_t k;
 
-	if (m_debug)
-		std::cout << std::hex << "BTree::GetIterator: key=" << *reinterpret_cast<const uint64_t *>(key) << " root=" << node->nodeid() << std::endl;
+	if (!m_root_node || cache.GetPinSize() == 0)
+		return 0;
 
-	while (node->level() > 0)
+	if (m_root_node->level() == 0)
+		return 0;
+
+	if (cache.Pin(m_root_node->paddr(), m_root_node->cache_block()))
+		cnt++;
+	else if (cache.IsPinFull())
+		return 0;
+
+	level.push_back(m_root_node);
+
+	// Every child is pinned right after it has been loaded, so at most one
+	// node is read beyond the budget. A node that finds no free slot stays
+	// unpinned, the others are still pinned until the budget is used up.
+	while (!level.empty() && level[0]->level() > 1)
 	{
-		index = FindBin(node, key, key_size, func, context, FindMode::LE);
+		next.clear();
 
-		if (index < 0)
-			index = 0;
+		for (n = 0; n < level.size(); n++)
+		{
+			for (k = 0; k < level[n]->entries_cnt(); k++)
+			{
+				if (!level[n]->GetEntry(e, k))
+					continue;
 
-		node->GetEntry(e, index);
+				child = GetNode(GetChildOid(level[n], e));
+				if (!child)
+					continue;
+
+				if (cache.Pin(child->paddr(), child->cache_block()))
+					cnt++;
+				else if (cache.IsPinFull())
+					return cnt;
 
-		if (node->flags() & BTNODE_HASHED) {
-			const btn_index_node_val_t *binv = reinterpret_cast<const btn_index_node_val_t*>(e.val);
-			oid = binv->binv_child_oid + m_oid;
-		} else {
-			assert(e.val_len == sizeof(oid_t));
-			oid = *reinterpret_cast<const oid_t *>(e.val);
+				if (child->level() > 1)
+					next.push_back(child);
+			}
 		}
 
-		node = GetNode(oid, node, index);
+		level.swap(next);
 	}
 
-	index = FindBin(node, key, key_size, func, context, FindMode::GE);
+	return cnt;
+}
 
-	if (m_debug)
-		std::cout << "Result = " << node->nodeid() << ":" << index << std::endl;
+void BTree::GetStats(BTreeStats &st) const
+{
+	st.lookups = m_stat_lookups.load(std::memory_order_relaxed);
+	st.iterators = m_stat_iterators.load(std::memory_order_relaxed);
+	st.node_hits = m_stat_node_hits.load(std::memory_order_relaxed);
+	st.node_misses = m_stat_node_misses.load(std::memory_order_relaxed);
+	st.prefetches = m_stat_prefetches.load(std::memory_order_relaxed);
+	st.finger_hits = m_stat_finger_hits.load(std::memory_order_relaxed);
+}
 
-	if (index < 0)
-	{
-		index = node->entries_cnt() - 1;
-		it.Setup(this, node, index);
-		it.next();
-		if (m_debug)
-			std::cout << "Iterator next entry" << std::endl;
-	}
-	else
-	{
-		it.Setup(this, node, index);
-	}
+void BTree::WriteStats(std::ostream &os, const char *name) const
+{
+	BTreeStats st;
 
-#if 0
-	it.GetEntry(e);
+	GetStats(st);
 
-	if (func(key, key_size, e.key, e.key_len) < 0)
-		it.next();
-#endif
+	os << std::dec;
+	os << name << ".lookups " << st.lookups << std::endl;
+	os << name << ".iterators " << st.iterators << std::endl;
+	os << name << ".node_hits " << st.node_hits << std::endl;
+	os << name << ".node_misses " << st.node_misses << std::endl;
+	os << name << ".prefetches " << st.prefetches << std::endl;
+	os << name << ".finger_hits " << st.finger_hits << std::endl;
+}
 
-	return true;
+oid_t BTree::GetChildOid(const std::shared_ptr<BTreeNode> &node, const BTreeEntry &e) const
+{
+	if (node->flags() & BTNODE_HASHED) {
+		const btn_index_node_val_t *binv = reinterpret_cast<const btn_index_node_val_t*>(e.val);
+		return binv->binv_child_oid + m_oid;
+	} else {
+		return *reinterpret_cast<const oid_t *>(e.val);
+	}
 }
 
-bool BTree::GetIteratorBegin(BTreeIterator& it)
+std::shared_ptr<BTreeNode> BTree::GetChildNode(const std::shared_ptr<BTreeNode> &node, uint32_t index)
 {
+	std::shared_ptr<BTreeNode> child;
+	BTreeEntry e;
 	oid_t oid;
 
-	std::shared_ptr<BTreeNode> node(m_root_node);
-	BTreeEntry e;
+	if (!node->GetEntry(e, index))
+		return child;
 
-	while (node->level() > 0)
-	{
-		if (!node->GetEntry(e, 0))
-			return false;
+	oid = GetChildOid(node, e);
+	child = GetNode(oid);
 
-		if (node->flags() & BTNODE_HASHED) {
-			const btn_index_node_val_t *binv = reinterpret_cast<const btn_index_node_val_t*>(e.val);
-			oid = binv->binv_child_oid + m_oid;
-		} else {
-			oid = *reinterpret_cast<const oid_t *>(e.val);
-		}
-		node = GetNode(oid, node, 0);
-	}
+	if (!child)
+		std::cerr << "BTree: Node " << oid << " with parent " << node->nodeid() << " not found." << std::endl;
 
-	it.Setup(this, node, 0);
+	return child;
+}
 
-	return true;
+std::shared_ptr<BTreeNode> BTree::GetCachedNode(paddr_t paddr)
+{
+	std::shared_ptr<BTreeNode> node;
+	BlockPtr blk;
+
+	// The omap flags aren't known here, but the block must at least have
+	// been read the way this tree reads its nodes.
+	if (m_container.GetBlockCache().Get(paddr, blk) && (blk->flags() & CB_VOLUME) == (m_volume ? CB_VOLUME : 0))
+		node = BTreeNode::CreateNode(*this, blk, paddr);
+
+	return node;
+}
+
+BTree::Finger &BTree::GetFinger() const
+{
+	static constexpr size_t FINGER_SLOTS = 8;
+	static thread_local Finger fingers[FINGER_SLOTS];
+
+	return fingers[m_id % FINGER_SLOTS];
+}
+
+void BTree::SetFinger(const Finger &f)
+{
+	Finger &dst = GetFinger();
+
+	dst = f;
+	dst.tree_id = m_id;
 }
 
 void BTree::dump(BlockDumper& out)
@@ -371,7 +459,7 @@ void BTree::DumpTreeInternal(BlockDumper& out, const std::shared_ptr<BTreeNode>
 	if (!node)
 		return;
 
-	out.DumpNode(node->block().data(), node->paddr());
+	out.DumpNode(node->block(), node->paddr());
 
 	if (node->level() > 0)
 	{
@@ -406,7 +494,7 @@ void BTree::DumpTreeInternal(BlockDumper& out, const std::shared_ptr<BTreeNode>
 				}
 			}
 
-			child = GetNode(oid_child, node, k);
+			child = GetNode(oid_child);
 
 			if (child)
 				DumpTreeInternal(out, child);
@@ -416,119 +504,277 @@ void BTree::DumpTreeInternal(BlockDumper& out, const std::shared_ptr<BTreeNode>
 	}
 }
 
-std::shared_ptr<BTreeNode> BTree::GetNode(oid_t oid, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index)
+void BTree::VisitNodes(const std::function<bool(const std::shared_ptr<BTreeNode> &)> &visit)
+{
+	if (m_root_node)
+		VisitNodesInternal(m_root_node, visit);
+}
+
+bool BTree::VisitNodesInternal(const std::shared_ptr<BTreeNode> &node, const std::function<bool(const std::shared_ptr<BTreeNode> &)> &visit)
+{
+	std::shared_ptr<BTreeNode> child;
+	uint32_t k;
+
+	if (!visit(node))
+		return false;
+
+	if (node->level() == 0)
+		return true;
+
+	for (k = 0; k < node->entries_cnt(); k++)
+	{
+		child = GetChildNode(node, k);
+
+		if (child && !VisitNodesInternal(child, visit))
+			return false;
+	}
+
+	return true;
+}
+
+std::shared_ptr<BTreeNode> BTree::GetNode(oid_t oid)
 {
 	std::shared_ptr<BTreeNode> node;
-	bool rc;
+	BlockPtr blk;
+	paddr_t paddr;
+
+	if (LoadBlock(blk, paddr, oid))
+		node = BTreeNode::CreateNode(*this, blk, paddr);
+
+	return node;
+}
+
+bool BTree::LoadBlock(BlockPtr &blk, paddr_t &paddr, oid_t oid)
+{
+	omap_res_t omr;
 
 	// printf("GetNode oid=%" PRIx64 "\n", oid);
 
-#ifdef BTREE_USE_MAP
-	m_mutex.lock();
-	auto it = m_nodes.find(oid);
+	if (!MapNode(omr, oid))
+		return false;
 
-	if (it != m_nodes.end())
-		node = it->second;
+	// A block read with other flags, e.g. not decrypted, is read again.
+	if (m_container.GetBlockCache().Get(omr.paddr, blk) && blk->flags() == NodeFlags(omr))
+		m_stat_node_hits.fetch_add(1, std::memory_order_relaxed);
+	else if (!ReadNode(blk, omr))
+		return false;
 
-	m_mutex.unlock();
+	paddr = omr.paddr;
 
-	if (!node)
-#endif
-	{
-		omap_res_t omr;
+	return true;
+}
 
-		omr.oid = oid;
-		omr.xid = m_xid;
-		omr.flags = 0;
-		omr.size = m_treeinfo.bt_fixed.bt_node_size;
-		omr.paddr = oid;
+bool BTree::MapNode(omap_res_t &omr, oid_t oid)
+{
+	bool rc;
 
-		std::vector<uint8_t> blk;
+	omr.oid = oid;
+	omr.xid = m_xid;
+	omr.flags = 0;
+	omr.size = m_treeinfo.bt_fixed.bt_node_size;
+	omr.paddr = oid;
 
-		if (m_omap)
-		{
-			rc = m_omap->Lookup(omr, oid, m_xid);
+	if (m_omap)
+	{
+		rc = m_omap->Lookup(omr, oid, m_xid);
 
-			if (g_debug & Dbg_Info) {
-				std::cout << "omap: oid=" << omr.oid << " xid=" << omr.xid << " flags=" << omr.flags << " size=" << omr.size << " paddr=" << omr.paddr << std::endl;
-			}
+		if (g_debug & Dbg_Info) {
+			std::cout << "omap: oid=" << omr.oid << " xid=" << omr.xid << " flags=" << omr.flags << " size=" << omr.size << " paddr=" << omr.paddr << std::endl;
+		}
 
-			if (!rc)
-			{
-				std::cerr << "ERROR: GetNode: omap entry oid " << std::hex << oid << " xid " << m_xid << " not found." << std::endl;
-				return node;
-			}
+		if (!rc)
+		{
+			std::cerr << "ERROR: GetNode: omap entry oid " << std::hex << oid << " xid " << m_xid << " not found." << std::endl;
+			return false;
 		}
+	}
 
-		blk.resize(m_container.GetBlocksize());
+	return true;
+}
 
-		if (m_volume)
-		{
-			// TODO: is the crypto_id always equal to the block ID here?
-			// I think so, the xts id and the block id only differ when the
-			// volume has been converted from a HFS/FileVault volume, which
-			// used CoreStorage. After conversions, the block numbers do not
-			// match anymore, since the CoreStorage data has been removed
-			// and assigned to the apfs volume. But the metadata is always
-			// fresh and therefore the ids should match.
-			if (!m_volume->ReadBlocks(blk.data(), omr.paddr, 1, (omr.flags & OMAP_VAL_ENCRYPTED) ? omr.paddr : 0))
-			{
-				std::cerr << "ERROR: GetNode: ReadBlocks failed!" << std::endl;
-				return node;
-			}
+uint8_t BTree::NodeFlags(const omap_res_t &omr) const
+{
+	uint8_t flags = 0;
 
-			if (!(omr.flags & OMAP_VAL_NOHEADER)) {
-				if (!VerifyBlock(blk.data(), blk.size()))
-				{
-					std::cerr << "ERROR: GetNode: VerifyBlock failed!" << std::endl;
-					if (g_debug & Dbg_Errors)
-						DumpHex(std::cerr, blk.data(), blk.size());
-					return node;
-				}
-			} else {
-				/*
-				std::cout << "BTNode @ " << omr.paddr << ":" << std::endl;
-				DumpHex(std::cout, blk.data(), blk.size());
-				std::cout << std::endl;
-				*/
-			}
+	if (m_volume)
+	{
+		flags |= CB_VOLUME;
+		if (omr.flags & OMAP_VAL_ENCRYPTED)
+			flags |= CB_ENCRYPTED;
+		if (omr.flags & OMAP_VAL_NOHEADER)
+			flags |= CB_NOHEADER;
+	}
+
+	return flags;
+}
+
+bool BTree::ReadNode(BlockPtr &blk, const omap_res_t &omr)
+{
+	uint8_t flags;
+
+	m_stat_node_misses.fetch_add(1, std::memory_order_relaxed);
+
+	flags = NodeFlags(omr);
+
+	blk = m_container.GetBlockCache().Alloc(omr.paddr);
+
+	if (!m_container.ReadMetaBlock(blk->data(), omr.paddr, flags, m_volume))
+	{
+		std::cerr << "ERROR: GetNode: Reading node " << std::hex << omr.oid << " @ " << omr.paddr << " failed!" << std::endl;
+		blk.reset();
+		return false;
+	}
+
+	blk->SetFlags(flags);
+	m_container.GetBlockCache().Put(omr.paddr, blk);
+
+	return true;
+}
+
+size_t BTree::WarmNodes(const oid_t *oids, size_t cnt)
+{
+	std::vector<NodeLoad> nodes(cnt);
+	size_t loaded = 0;
+	size_t k;
+
+	for (k = 0; k < cnt; k++)
+		nodes[k].oid = oids[k];
+
+	LoadNodes(nodes, true);
+
+	for (k = 0; k < cnt; k++)
+	{
+		if (nodes[k].blk)
+			loaded++;
+	}
+
+	return loaded;
+}
+
+void BTree::LoadNodes(std::vector<NodeLoad> &nodes, bool need_header)
+{
+	std::vector<omap_res_t> omrs(nodes.size());
+	std::vector<oid_t> oids(nodes.size());
+	std::vector<size_t> misses;
+	std::vector<ApfsContainer::MetaBlockRead> reads;
+	size_t k;
+
+	if (nodes.empty())
+		return;
+
+	for (k = 0; k < nodes.size(); k++)
+	{
+		oids[k] = nodes[k].oid;
+		nodes[k].blk.reset();
+	}
+
+	// One sweep over the omap for all nodes, instead of one lookup each.
+	if (m_omap)
+	{
+		m_omap->LookupBatch(omrs.data(), oids.data(), oids.size(), m_xid);
+
+		for (k = 0; k < nodes.size(); k++)
+			omrs[k].size = m_treeinfo.bt_fixed.bt_node_size;
+	}
+
+	for (k = 0; k < nodes.size(); k++)
+	{
+		if (oids[k] == 0)
+			continue;
+
+		if (m_omap)
+		{
+			if (omrs[k].paddr == 0)
+				continue;
 		}
 		else
 		{
-			if (!m_container.ReadAndVerifyHeaderBlock(blk.data(), omr.paddr))
-			{
-				std::cerr << "ERROR: GetNode: ReadAndVerifyHeaderBlock failed!" << std::endl;
-				return node;
-			}
+			MapNode(omrs[k], oids[k]);
 		}
 
-		node = BTreeNode::CreateNode(*this, blk.data(), blk.size(), omr.paddr, parent, parent_index);
-#ifdef BTREE_USE_MAP
-		m_mutex.lock();
+		if (need_header && (NodeFlags(omrs[k]) & CB_NOHEADER))
+			continue;
+
+		nodes[k].paddr = omrs[k].paddr;
+
+		if (m_container.GetBlockCache().Get(omrs[k].paddr, nodes[k].blk) && nodes[k].blk->flags() == NodeFlags(omrs[k]))
+			m_stat_node_hits.fetch_add(1, std::memory_order_relaxed);
+		else
+			misses.push_back(k);
+	}
 
-		if (m_nodes.size() > BTREE_MAP_MAX_NODES)
+	if (misses.empty())
+		return;
+
+	if (misses.size() == 1)
+	{
+		ReadNode(nodes[misses[0]].blk, omrs[misses[0]]);
+		return;
+	}
+
+	// Read all missing nodes with one vectored read. Nodes written together
+	// are often adjacent on disk, the device merges those.
+	m_stat_node_misses.fetch_add(misses.size(), std::memory_order_relaxed);
+
+	reads.resize(misses.size());
+
+	for (k = 0; k < misses.size(); k++)
+	{
+		size_t n = misses[k];
+
+		nodes[n].blk = m_container.GetBlockCache().Alloc(omrs[n].paddr);
+		reads[k].data = nodes[n].blk->data();
+		reads[k].paddr = omrs[n].paddr;
+		reads[k].flags = NodeFlags(omrs[n]);
+	}
+
+	m_container.ReadMetaBlocks(reads.data(), reads.size(), m_volume);
+
+	for (k = 0; k < misses.size(); k++)
+	{
+		size_t n = misses[k];
+
+		if (!reads[k].ok)
 		{
-#if 0
-			m_nodes.clear(); // TODO: Make this somewhat more intelligent ...
-#else
-			// This might be somewhat more intelligent ...
-			for (it = m_nodes.begin(); it != m_nodes.end();)
-			{
-				if (it->second.use_count() == 1)
-					it = m_nodes.erase(it);
-				else
-					++it;
-			}
-#endif
+			std::cerr << "ERROR: LoadNodes: Reading node " << std::hex << oids[n] << " @ " << omrs[n].paddr << " failed!" << std::endl;
+			nodes[n].blk.reset();
+			continue;
 		}
 
-		m_nodes[oid] = node;
+		nodes[n].blk->SetFlags(reads[k].flags);
+		m_container.GetBlockCache().Put(omrs[n].paddr, nodes[n].blk);
+	}
+}
 
-		m_mutex.unlock();
-#endif
+void BTree::PrefetchNode(oid_t oid)
+{
+	m_stat_prefetches.fetch_add(1, std::memory_order_relaxed);
+
+	{
+		std::lock_guard<std::mutex> lock(m_prefetch_mutex);
+		m_prefetch_pending++;
 	}
 
-	return node;
+	if (!m_container.GetThreadPool().Submit(std::bind(&BTree::PrefetchTask, this, oid)))
+		PrefetchDone();
+}
+
+void BTree::PrefetchTask(oid_t oid)
+{
+	BlockPtr blk;
+	paddr_t paddr;
+
+	LoadBlock(blk, paddr, oid);
+	PrefetchDone();
+}
+
+void BTree::PrefetchDone()
+{
+	std::lock_guard<std::mutex> lock(m_prefetch_mutex);
+
+	m_prefetch_pending--;
+	if (m_prefetch_pending == 0)
+		m_prefetch_cv.notify_all();
 }
 
 uint32_t BTree::Find(const std::shared_ptr<BTreeNode> &node, const void *key, size_t key_size, BTCompareFunc func, void *context)
@@ -560,76 +806,59 @@ uint32_t BTree::Find(const std::shared_ptr<BTreeNode> &node, const void *key, si
 	return k;
 }
 
-int BTree::FindBin(const std::shared_ptr<BTreeNode>& node, const void* key, size_t key_size, BTCompareFunc func, void *context, FindMode mode)
+void BTree::FindInIndex(const std::shared_ptr<BTreeNode> &node, const void *key, size_t key_size, int &beg, int &end, bool &eq)
 {
-	static const char resstr[3] = { '<', '=', '>' };
+	const BTreeKeyIndex *idx = nullptr;
+	const le_uint64_t *skey = reinterpret_cast<const le_uint64_t *>(key);
+	uint64_t s0;
+	uint64_t s1;
 
-	int beg;
-	int end;
-	int mid = -1;
-	int cnt = node->entries_cnt();
-	int res;
+	if (m_key_index_type == KeyIndexType::Fixed128 ? (key_size == 2 * sizeof(uint64_t)) : (key_size >= sizeof(uint64_t)))
+		idx = GetKeyIndex(node);
 
-	BTreeEntry e;
-	int rc;
+	if (!idx)
+		return;
 
-	if (cnt <= 0)
-		return -1;
+	s0 = skey[0];
+	if (m_key_index_type == KeyIndexType::JKey)
+		s0 = (s0 << 4) | (s0 >> 60);
 
-	beg = 0;
-	end = cnt - 1;
+	beg = LowerBound64(idx->k0, idx->cnt, s0);
+	end = beg + SkipEqual64(idx->k0 + beg, idx->cnt - beg, s0);
 
-	if (m_debug)
+	// Fixed keys are complete in the index, nothing left to compare.
+	if (m_key_index_type == KeyIndexType::Fixed128)
 	{
-		std::cout << "FindBin    : ";
-		DumpHex(std::cout, reinterpret_cast<const uint8_t *>(key), key_size, key_size);
+		s1 = skey[1];
+		beg += LowerBound64(idx->k1 + beg, end - beg, s1);
+		eq = (beg < end && idx->k1[beg] == s1);
+		end = beg;
 	}
+}
 
-	while (beg <= end)
-	{
-		mid = (beg + end) / 2;
-
-		node->GetEntry(e, mid);
-		rc = func(key, key_size, e.key, e.key_len, context);
-
-		if (m_debug)
-		{
-			std::cout << std::dec << std::setfill(' ');
-			std::cout << std::setw(2) << beg << " [" << std::setw(2) << mid << "] " << std::setw(2) << end << " : " << resstr[rc + 1] << " : ";
-			DumpHex(std::cout, reinterpret_cast<const uint8_t *>(e.key), e.key_len, e.key_len);
-		}
-
-		if (rc == 0)
-			break;
-
-		if (rc == -1)
-			beg = mid + 1;
-		else if (rc == 1)
-			end = mid - 1;
-	}
+int BTree::FindResult(int beg, bool eq, int cnt, FindMode mode) const
+{
+	int res;
 
 	if (m_debug)
-	{
-		std::cout << std::dec << std::setfill(' ');
-		std::cout << " => " << resstr[rc + 1] << ", " << mid;
-	}
+		std::cout << std::dec << " => " << (eq ? '=' : '>') << ", " << beg;
 
 	switch (mode)
 	{
 	case FindMode::EQ:
-		res = (rc == 0) ? mid : -1;
+		res = eq ? beg : -1;
 		break;
 	case FindMode::LE:
-		res = (rc <= 0) ? mid : (mid - 1);
+		res = eq ? beg : (beg - 1);
 		break;
 	case FindMode::LT:
-		res = (rc < 0) ? mid : (mid - 1);
+		res = beg - 1;
 		break;
 	case FindMode::GE:
-		res = (rc >= 0) ? mid : (mid + 1);
+		res = beg;
 		break;
 	case FindMode::GT:
-		res = (rc > 0) ? mid : (mid + 1);
+		res = eq ? (beg + 1) : beg;
 		break;
 	default:
 		assert(false);
@@ -646,31 +875,107 @@ int BTree::FindBin(const std::shared_ptr<BTreeNode>& node, const void* key, size
 	return res;
 }
 
+void BTree::DebugFindStep(int beg, int mid, int end, int rc, const BTreeEntry &e) const
+{
+	static const char resstr[3] = { '<', '=', '>' };
+
+	std::cout << std::dec << std::setfill(' ');
+	std::cout << std::setw(2) << beg << " [" << std::setw(2) << mid << "] " << std::setw(2) << end << " : " << resstr[(rc > 0) - (rc < 0) + 1] << " : ";
+	DumpHex(std::cout, reinterpret_cast<const uint8_t *>(e.key), e.key_len, e.key_len);
+}
+
+const BTreeKeyIndex *BTree::GetKeyIndex(const std::shared_ptr<BTreeNode> &node)
+{
+	const CacheBlockAux *aux;
+	BTreeKeyIndex *idx;
+	BTreeEntry e;
+	uint32_t cnt;
+	uint32_t k;
+	uint64_t v;
+
+	if (m_key_index_type == KeyIndexType::None)
+		return nullptr;
+
+	aux = node->cache_block()->aux();
+	if (aux)
+		return static_cast<const BTreeKeyIndex *>(aux);
+
+	cnt = node->entries_cnt();
+
+	idx = BTreeKeyIndex::Create(cnt, m_key_index_type == KeyIndexType::Fixed128);
+
+	for (k = 0; k < cnt; k++)
+	{
+		node->GetEntry(e, k);
+
+		const le_uint64_t *ekey = reinterpret_cast<const le_uint64_t *>(e.key);
+
+		if (m_key_index_type == KeyIndexType::Fixed128)
+		{
+			if (e.key_len != 2 * sizeof(uint64_t))
+				break;
+
+			idx->k0[k] = ekey[0];
+			idx->k1[k] = ekey[1];
+		}
+		else
+		{
+			if (e.key_len < sizeof(uint64_t))
+				break;
+
+			v = ekey[0];
+			idx->k0[k] = (v << 4) | (v >> 60);
+		}
+	}
+
+	// Malformed node, leave it to the compare function.
+	if (k < cnt)
+	{
+		delete idx;
+		return nullptr;
+	}
+
+	return static_cast<const BTreeKeyIndex *>(node->cache_block()->SetAux(idx));
+}
+
 BTreeIterator::BTreeIterator()
 {
 	m_tree = nullptr;
 	m_index = 0;
+	m_prefetch_parent = 0;
+	m_prefetch_next = 0;
+}
+
+BTreeIterator::~BTreeIterator()
+{
 }
 
-BTreeIterator::BTreeIterator(BTree *tree, const std::shared_ptr<BTreeNode> &node, uint32_t index)
+void BTreeIterator::Setup(BTree *tree)
 {
 	m_tree = tree;
-	m_node = node;
-	m_index = index;
+	m_node.reset();
+	m_index = 0;
+	m_path.clear();
+	m_prefetch_parent = 0;
+	m_prefetch_next = 0;
 }
 
-BTreeIterator::~BTreeIterator()
+void BTreeIterator::Push(const std::shared_ptr<BTreeNode> &node, uint32_t index)
 {
+	PathEntry pe;
+
+	pe.node = node;
+	pe.index = index;
+
+	m_path.push_back(pe);
 }
 
-void BTreeIterator::Setup(BTree* tree, const std::shared_ptr<BTreeNode>& node, uint32_t index)
+void BTreeIterator::SetLeaf(const std::shared_ptr<BTreeNode> &node, uint32_t index)
 {
-	m_tree = tree;
 	m_node = node;
 	m_index = index;
 }
 
-
 bool BTreeIterator::next()
 {
 	if (!m_node)
@@ -680,13 +985,25 @@ bool BTreeIterator::next()
 
 	if (m_index < m_node->entries_cnt())
 		return true;
-	else {
-		std::shared_ptr<BTreeNode> node = next_node();
-		if (node) {
-			m_index = 0;
-			m_node = node;
-			return true;
-		}
+
+	return next_leaf();
+}
+
+bool BTreeIterator::next_leaf()
+{
+	std::shared_ptr<BTreeNode> node;
+
+	if (!m_node)
+		return false;
+
+	node = next_node();
+	if (node) {
+		m_index = 0;
+		m_node = node;
+		// Only scans spanning more than one leaf read ahead, short
+		// lookups shouldn't cause any extra I/O.
+		prefetch();
+		return true;
 	}
 	return false;
 }
@@ -696,6 +1013,9 @@ void BTreeIterator::reset()
 	m_tree = nullptr;
 	m_node.reset();
 	m_index = 0;
+	m_path.clear();
+	m_prefetch_parent = 0;
+	m_prefetch_next = 0;
 }
 
 bool BTreeIterator::GetEntry(BTreeEntry& res) const
@@ -706,54 +1026,58 @@ bool BTreeIterator::GetEntry(BTreeEntry& res) const
 	return m_node->GetEntry(res, m_index);
 }
 
-#undef BTITDBG
-
 std::shared_ptr<BTreeNode> BTreeIterator::next_node()
 {
 	std::shared_ptr<BTreeNode> node;
-	uint32_t pidx;
-	BTreeEntry e;
-	oid_t oid;
 
-	node = m_node;
+	// Up to the first index node with entries left ...
+	while (!m_path.empty() && m_path.back().index + 1 >= m_path.back().node->entries_cnt())
+		m_path.pop_back();
 
-#ifdef BTITDBG
-	std::cout << "======== ******** BTreeIterator::next_node() ******** ========" << std::endl;
-	std::cout << "  Current node: " << node->nodeid() << std::endl;
-#endif
+	if (m_path.empty())
+		return node;
 
-	do {
-		pidx = node->parent_index();
-		node = node->parent();
-#ifdef BTITDBG
-		std::cout << "  Navigating up to node " << node->nodeid() << " index " << pidx << std::endl;
-#endif
-		pidx++;
-	} while (node && pidx >= node->entries_cnt());
+	m_path.back().index++;
+	node = m_tree->GetChildNode(m_path.back().node, m_path.back().index);
 
-	if (!node)
-		return std::shared_ptr<BTreeNode>();
+	// ... and down the leftmost path from there.
+	while (node && node->level() > 0)
+	{
+		Push(node, 0);
+		node = m_tree->GetChildNode(node, 0);
+	}
 
-	while (node->level() > 0) {
-		node->GetEntry(e, pidx);
+	return node;
+}
 
-		if (node->flags() & BTNODE_HASHED) {
-			const btn_index_node_val_t *binv = reinterpret_cast<const btn_index_node_val_t *>(e.val);
-			oid = binv->binv_child_oid + m_tree->m_oid;
-		} else {
-			oid = *reinterpret_cast<const uint64_t *>(e.val);
-		}
+void BTreeIterator::prefetch()
+{
+	unsigned int window = m_tree->m_container.GetPrefetchWindow();
+	uint32_t first;
+	uint32_t last;
+	uint32_t k;
+	BTreeEntry e;
 
-#ifdef BTITDBG
-		std::cout << "  Navigating down to node " << oid << std::endl;
-#endif
-		node = m_tree->GetNode(oid, node, pidx);
+	if (m_path.empty() || window == 0)
+		return;
 
-		if (!node)
-			std::cerr << "Failed to load btree node oid " << oid << std::endl;
+	const std::shared_ptr<BTreeNode> &parent = m_path.back().node;
+
+	first = m_path.back().index + 1;
+	last = std::min<uint32_t>(first + window, parent->entries_cnt());
 
-		pidx = 0;
+	if (parent->paddr() == m_prefetch_parent && first < m_prefetch_next)
+		first = m_prefetch_next;
+
+	for (k = first; k < last; k++)
+	{
+		if (parent->GetEntry(e, k))
+			m_tree->PrefetchNode(m_tree->GetChildOid(parent, e));
 	}
 
-	return node;
+	if (first < last)
+	{
+		m_prefetch_parent = parent->paddr();
+		m_prefetch_next = last;
+	}
 }
@@ -19,15 +19,21 @@
 
 #pragma once
 
+#include <algorithm>
 #include <vector>
-#include <map>
 #include <memory>
+#include <iostream>
+#include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
 
 #include "Global.h"
 #include "DiskStruct.h"
+#include "Util.h"
 
 #include "ApfsNodeMapper.h"
+#include "BlockCache.h"
 
 class BTree;
 class BTreeNode;
@@ -37,17 +43,77 @@ class BlockDumper;
 class ApfsContainer;
 class ApfsVolume;
 
-// This enables a rudimentary disk cache ...
-#define BTREE_USE_MAP
-// TODO: Think about a better solution.
-// 8192 will take max. 32 MB of RAM. Higher may be faster, but use more RAM.
-#define BTREE_MAP_MAX_NODES 8192
-
 // ekey < skey: -1, ekey > skey: 1, ekey == skey: 0
 typedef int(*BTCompareFunc)(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context);
 
 int CompareStdKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context);
 
+// The templated Lookup and GetIterator take a compare object holding the
+// search key, instead of a compare function. It has to provide
+//   const void *key() const;
+//   size_t key_size() const;
+//   int operator()(const void *ekey, size_t ekey_len) const;
+// with operator() returning the same as a BTCompareFunc. Since the compare
+// is inlined, the object can also prepare the search key once up front.
+// BTFuncCompare adapts a BTCompareFunc to this.
+class BTFuncCompare
+{
+public:
+	BTFuncCompare(const void *key, size_t key_size, BTCompareFunc func, void *context) :
+		m_key(key), m_key_size(key_size), m_func(func), m_context(context) {}
+
+	const void *key() const { return m_key; }
+	size_t key_size() const { return m_key_size; }
+	int operator()(const void *ekey, size_t ekey_len) const { return m_func(m_key, m_key_size, ekey, ekey_len, m_context); }
+
+private:
+	const void *m_key;
+	size_t m_key_size;
+	BTCompareFunc m_func;
+	void *m_context;
+};
+
+// Open bounds for BTree::Scan.
+struct BTScanBegin
+{
+};
+
+struct BTScanEnd
+{
+	int operator()(const void *ekey, size_t ekey_len) const { (void)ekey; (void)ekey_len; return -1; }
+};
+
+struct BTreeStats
+{
+	uint64_t lookups;
+	uint64_t iterators;
+	uint64_t node_hits;
+	uint64_t node_misses;
+	uint64_t prefetches;
+	uint64_t finger_hits;
+};
+
+// Keys of a node, decoded into contiguous arrays the first time the node is
+// searched, and kept with its cache block. Fixed-size 16 byte keys (omap,
+// fext tree) are stored completely, so the search needs no compare
+// function. Of variable-size keys only the obj_id_and_type is stored, with
+// the type in the low bits, and the compare function is only called for
+// entries with the same prefix as the search key.
+// The arrays follow the object in the same allocation, to save a few
+// cache misses per search.
+class BTreeKeyIndex : public CacheBlockAux
+{
+	BTreeKeyIndex(uint32_t cnt, bool fixed);
+
+public:
+	static BTreeKeyIndex *Create(uint32_t cnt, bool fixed);
+	static void operator delete(void *p) { ::operator delete(p); }
+
+	const uint32_t cnt;
+	uint64_t * const k0;
+	uint64_t * const k1; // Only for fixed keys
+};
+
 class BTreeEntry
 {
 	friend class BTree;
@@ -72,10 +138,10 @@ private:
 class BTreeNode
 {
 protected:
-	BTreeNode(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index);
+	BTreeNode(BTree &tree, const BlockPtr &block, paddr_t paddr);
 
 public:
-	static std::shared_ptr<BTreeNode> CreateNode(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index);
+	static std::shared_ptr<BTreeNode> CreateNode(BTree &tree, const BlockPtr &block, paddr_t paddr);
 
 	virtual ~BTreeNode();
 
@@ -83,26 +149,24 @@ public:
 	uint32_t entries_cnt() const { return m_btn->btn_nkeys; }
 	uint16_t level() const { return m_btn->btn_level; }
 	uint16_t flags() const { return m_btn->btn_flags; }
+	uint32_t subtype() const { return m_btn->btn_o.o_subtype; }
 	paddr_t paddr() const { return m_paddr; }
 
-	const std::shared_ptr<BTreeNode> &parent() const { return m_parent; }
-	uint16_t parent_index() const { return m_parent_index; }
-
 	virtual bool GetEntry(BTreeEntry &result, uint32_t index) const = 0;
 	// virtual uint32_t Find(const void *key, size_t key_size, BTCompareFunc func) const = 0;
 
-	const std::vector<uint8_t> &block() const { return m_block; }
+	const uint8_t *block() const { return m_block->data(); }
+	uint32_t blocksize() const { return m_block->size(); }
+	const BlockPtr &cache_block() const { return m_block; }
 
 protected:
-	std::vector<uint8_t> m_block;
+	const BlockPtr m_block;
+	const uint8_t *m_data;
 	BTree &m_tree;
 
 	uint16_t m_keys_start; // Up
 	uint16_t m_vals_start; // Dn
 
-	const uint32_t m_parent_index;
-	const std::shared_ptr<BTreeNode> m_parent;
-
 	const paddr_t m_paddr;
 
 	const btree_node_phys_t *m_btn;
@@ -111,7 +175,7 @@ protected:
 class BTreeNodeFix : public BTreeNode
 {
 public:
-	BTreeNodeFix(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index);
+	BTreeNodeFix(BTree &tree, const BlockPtr &block, paddr_t paddr);
 
 	bool GetEntry(BTreeEntry &result, uint32_t index) const override;
 	// uint32_t Find(const void *key, size_t key_size, BTCompareFunc func) const override;
@@ -123,7 +187,7 @@ private:
 class BTreeNodeVar : public BTreeNode
 {
 public:
-	BTreeNodeVar(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index);
+	BTreeNodeVar(BTree &tree, const BlockPtr &block, paddr_t paddr);
 
 	bool GetEntry(BTreeEntry &result, uint32_t index) const override;
 	// uint32_t Find(const void *key, size_t key_size, BTCompareFunc func) const override;
@@ -143,6 +207,15 @@ class BTree
 		GT
 	};
 
+	// What the key index of the nodes contains. The compare function passed
+	// to Lookup and GetIterator has to order the keys the same way.
+	enum class KeyIndexType
+	{
+		None,
+		Fixed128, // Two 64 bit words, e.g. oid/xid
+		JKey      // obj_id_and_type of a j_key_t, id first, then type
+	};
+
 	friend class BTreeIterator;
 public:
 	BTree(ApfsContainer &container, ApfsVolume *vol = nullptr);
@@ -154,6 +227,40 @@ public:
 	bool GetIterator(BTreeIterator &it, const void *key, size_t key_size, BTCompareFunc func, void *context);
 	bool GetIteratorBegin(BTreeIterator &it);
 
+	template <class Cmp> bool Lookup(BTreeEntry &result, const Cmp &cmp, bool exact);
+	template <class Cmp> bool GetIterator(BTreeIterator &it, const Cmp &cmp);
+	// Looks up cnt keys at once. The keys are sorted and resolved in one sweep
+	// over the tree, reading the child nodes needed on each level together.
+	// results[k] is cleared if key k isn't found. Returns the number of keys
+	// found.
+	template <class Cmp> size_t LookupBatch(BTreeEntry *results, const Cmp *cmps, size_t cnt, bool exact);
+	// Calls visit(const BTreeEntry &) for all entries from the first one >= lo
+	// up to the last one <= hi, in order, until visit returns false. Pass
+	// BTScanBegin/BTScanEnd for an open range. The entry only holds pointers
+	// into the node, it is valid during the call only. Returns false if the
+	// tree can't be read.
+	template <class CmpLo, class CmpHi, class Visitor> bool Scan(const CmpLo &lo, const CmpHi &hi, Visitor visit);
+
+	// Pins the index nodes into the block cache, top level first, until the
+	// pin budget of the cache is used up. Returns the number of pinned nodes.
+	size_t PinIndexNodes();
+	// Loads the nodes into the block cache, the same way a lookup reads
+	// them. Nodes without an object header are left out, since they can't
+	// be verified. Returns the number of nodes in the cache.
+	size_t WarmNodes(const oid_t *oids, size_t cnt);
+
+	// Calls visit for every node of the tree, parents first, until it
+	// returns false. Reads the whole tree, so only for tools.
+	void VisitNodes(const std::function<bool(const std::shared_ptr<BTreeNode> &)> &visit);
+	// Like Init, for a tree whose nodes don't come from a device, e.g. node
+	// images from a dump. Child nodes can't be loaded then, only FindInNode
+	// is useful. For benchmarks.
+	void InitFromRoot(const std::shared_ptr<BTreeNode> &root);
+	// Searches a single node the way a lookup does on each level. Returns
+	// the index of the last entry <= key, or -1. Without use_index, the key
+	// index is bypassed and every compare goes through func. For benchmarks.
+	int FindInNode(const std::shared_ptr<BTreeNode> &node, const void *key, size_t key_size, BTCompareFunc func, void *context, bool use_index);
+
 	uint16_t GetKeyLen() const { return m_treeinfo.bt_fixed.bt_key_size; }
 	uint16_t GetValLen() const { return m_treeinfo.bt_fixed.bt_val_size; }
 
@@ -161,12 +268,73 @@ public:
 
 	void EnableDebugOutput() { m_debug = true; }
 
+	void GetStats(BTreeStats &st) const;
+	void WriteStats(std::ostream &os, const char *name) const;
+
 private:
 	void DumpTreeInternal(BlockDumper &out, const std::shared_ptr<BTreeNode> &node);
+	bool VisitNodesInternal(const std::shared_ptr<BTreeNode> &node, const std::function<bool(const std::shared_ptr<BTreeNode> &)> &visit);
 	uint32_t Find(const std::shared_ptr<BTreeNode> &node, const void *key, size_t key_size, BTCompareFunc func, void *context);
-	int FindBin(const std::shared_ptr<BTreeNode> &node, const void *key, size_t key_size, BTCompareFunc func, void *context, FindMode mode);
+	template <class Cmp> int FindBin(const std::shared_ptr<BTreeNode> &node, const Cmp &cmp, FindMode mode, bool use_index = true);
+	// Narrows [beg, end) down to the entries the key index can't decide.
+	void FindInIndex(const std::shared_ptr<BTreeNode> &node, const void *key, size_t key_size, int &beg, int &end, bool &eq);
+	int FindResult(int beg, bool eq, int cnt, FindMode mode) const;
+	void DebugFindStep(int beg, int mid, int end, int rc, const BTreeEntry &e) const;
+	const BTreeKeyIndex *GetKeyIndex(const std::shared_ptr<BTreeNode> &node);
+
+	std::shared_ptr<BTreeNode> GetNode(oid_t oid);
+	bool LoadBlock(BlockPtr &blk, paddr_t &paddr, oid_t oid);
+	// Loads a node into the block cache in the background.
+	void PrefetchNode(oid_t oid);
+	void PrefetchTask(oid_t oid);
+	void PrefetchDone();
+
+	struct NodeLoad
+	{
+		oid_t oid;
+		paddr_t paddr;
+		BlockPtr blk;
+	};
 
-	std::shared_ptr<BTreeNode> GetNode(oid_t oid, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index);
+	// Gets the blocks of all nodes, reading the ones not in the cache with
+	// one vectored read. blk stays empty if a node can't be loaded, or oid
+	// is 0. With need_header, nodes without an object header are skipped.
+	void LoadNodes(std::vector<NodeLoad> &nodes, bool need_header = false);
+	bool MapNode(omap_res_t &omr, oid_t oid);
+	uint8_t NodeFlags(const omap_res_t &omr) const;
+	bool ReadNode(BlockPtr &blk, const omap_res_t &omr);
+	template <class Cmp> bool ScanSeek(BTreeIterator &it, const Cmp &lo) { return GetIterator(it, lo); }
+	bool ScanSeek(BTreeIterator &it, const BTScanBegin &lo) { (void)lo; return GetIteratorBegin(it); }
+	template <class Cmp> size_t LookupBatchNode(const std::shared_ptr<BTreeNode> &node, BTreeEntry *results, const Cmp *cmps, const uint32_t *order, size_t cnt, bool exact);
+	oid_t GetChildOid(const std::shared_ptr<BTreeNode> &node, const BTreeEntry &e) const;
+	std::shared_ptr<BTreeNode> GetChildNode(const std::shared_ptr<BTreeNode> &node, uint32_t index);
+	// Returns the node at paddr, if it is in the block cache. No omap
+	// lookup and no read.
+	std::shared_ptr<BTreeNode> GetCachedNode(paddr_t paddr);
+
+	static constexpr uint32_t MAX_FINGER_DEPTH = 8;
+
+	// Last leaf found in this tree, per thread, with the path of index nodes
+	// leading to it, root first. Only addresses are kept, the nodes are
+	// looked up in the block cache again, so a finger never keeps anything
+	// alive.
+	struct Finger
+	{
+		uint64_t tree_id;
+		paddr_t leaf;
+		uint32_t depth;
+		paddr_t path[MAX_FINGER_DEPTH];
+		uint32_t index[MAX_FINGER_DEPTH];
+	};
+
+	Finger &GetFinger() const;
+	void SetFinger(const Finger &f);
+	// Returns the leaf the key belongs to. If it is given, the path to the
+	// leaf is set up in the iterator. Without an iterator, a key before the
+	// first entry of the tree returns nullptr.
+	template <class Cmp> std::shared_ptr<BTreeNode> FindLeaf(const Cmp &cmp, BTreeIterator *it);
+	template <class Cmp> std::shared_ptr<BTreeNode> GetFingerLeaf(const Cmp &cmp, BTreeIterator *it);
+	template <class Cmp> int CompareEntry(const std::shared_ptr<BTreeNode> &node, uint32_t index, const Cmp &cmp) const;
 
 	ApfsContainer &m_container;
 	ApfsVolume *m_volume;
@@ -175,35 +343,480 @@ private:
 	ApfsNodeMapper *m_omap;
 
 	btree_info_t m_treeinfo;
+	KeyIndexType m_key_index_type;
 
 	oid_t m_oid;
 	xid_t m_xid;
 	bool m_debug;
-
-#ifdef BTREE_USE_MAP
-	std::map<uint64_t, std::shared_ptr<BTreeNode>> m_nodes;
-	std::mutex m_mutex;
-#endif
+	// Unique for the lifetime of the process, a new tree at the address of a
+	// deleted one must not find its fingers.
+	const uint64_t m_id;
+
+	std::mutex m_prefetch_mutex;
+	std::condition_variable m_prefetch_cv;
+	unsigned int m_prefetch_pending;
+
+	std::atomic<uint64_t> m_stat_lookups;
+	std::atomic<uint64_t> m_stat_iterators;
+	std::atomic<uint64_t> m_stat_node_hits;
+	std::atomic<uint64_t> m_stat_node_misses;
+	std::atomic<uint64_t> m_stat_prefetches;
+	std::atomic<uint64_t> m_stat_finger_hits;
 };
 
 class BTreeIterator
 {
+	friend class BTree;
 public:
 	BTreeIterator();
-	BTreeIterator(BTree *tree, const std::shared_ptr<BTreeNode> &node, uint32_t index);
 	~BTreeIterator();
 
 	bool next();
+	// Moves to the first entry of the next leaf.
+	bool next_leaf();
 	void reset();
 
 	bool GetEntry(BTreeEntry &res) const;
 
-	void Setup(BTree *tree, const std::shared_ptr<BTreeNode> &node, uint32_t index);
+	const std::shared_ptr<BTreeNode> &node() const { return m_node; }
+	uint32_t index() const { return m_index; }
 
 private:
+	struct PathEntry
+	{
+		std::shared_ptr<BTreeNode> node;
+		uint32_t index;
+	};
+
+	// Used by BTree to set up the iterator: Setup, then Push for every index
+	// node on the way down, then SetLeaf.
+	void Setup(BTree *tree);
+	void Push(const std::shared_ptr<BTreeNode> &node, uint32_t index);
+	void SetLeaf(const std::shared_ptr<BTreeNode> &node, uint32_t index);
+
 	BTree *m_tree;
 	std::shared_ptr<BTreeNode> m_node;
 	uint32_t m_index;
+	// Index nodes above m_node, root first, with the index of the child taken.
+	std::vector<PathEntry> m_path;
+
+	// Siblings of the current leaf up to m_prefetch_next have been requested.
+	paddr_t m_prefetch_parent;
+	uint32_t m_prefetch_next;
 
 	std::shared_ptr<BTreeNode> next_node();
+	void prefetch();
 };
+
+template <class Cmp>
+bool BTree::Lookup(BTreeEntry &result, const Cmp &cmp, bool exact)
+{
+	std::shared_ptr<BTreeNode> node;
+	int index;
+
+	if (!m_root_node)
+		return false;
+
+	m_stat_lookups.fetch_add(1, std::memory_order_relaxed);
+
+	if (m_debug)
+	{
+		std::cout << "BTree::Lookup: ";
+		DumpHex(std::cout, reinterpret_cast<const uint8_t *>(cmp.key()), cmp.key_size(), cmp.key_size());
+	}
+
+	node = FindLeaf(cmp, nullptr);
+
+	if (!node)
+		return false;
+
+	index = FindBin(node, cmp, exact ? FindMode::EQ : FindMode::LE);
+
+	if (m_debug)
+		std::cout << "Result = " << node->nodeid() << ":" << index << std::endl;
+
+	if (index < 0)
+		return false;
+
+	node->GetEntry(result, index);
+	result.m_node = node;
+
+	return true;
+}
+
+template <class Cmp>
+size_t BTree::LookupBatch(BTreeEntry *results, const Cmp *cmps, size_t cnt, bool exact)
+{
+	std::vector<uint32_t> order(cnt);
+	size_t k;
+
+	for (k = 0; k < cnt; k++)
+	{
+		results[k].clear();
+		order[k] = k;
+	}
+
+	if (!m_root_node || cnt == 0)
+		return 0;
+
+	m_stat_lookups.fetch_add(cnt, std::memory_order_relaxed);
+
+	if (m_debug)
+		std::cout << "BTree::LookupBatch: " << cnt << " keys" << std::endl;
+
+	// a < b if the entry a compares less than the search key b.
+	std::stable_sort(order.begin(), order.end(), [cmps](uint32_t a, uint32_t b) {
+		return cmps[b](cmps[a].key(), cmps[a].key_size()) < 0;
+	});
+
+	return LookupBatchNode(m_root_node, results, cmps, order.data(), cnt, exact);
+}
+
+template <class CmpLo, class CmpHi, class Visitor>
+bool BTree::Scan(const CmpLo &lo, const CmpHi &hi, Visitor visit)
+{
+	BTreeIterator it;
+	BTreeEntry e;
+	uint32_t cnt;
+	uint32_t k;
+
+	if (!m_root_node)
+		return false;
+
+	if (!ScanSeek(it, lo))
+		return false;
+
+	// Walk the leaves directly, the iterator is only used to get to the next
+	// leaf, which also keeps the read-ahead of the iterator.
+	do
+	{
+		const std::shared_ptr<BTreeNode> &node = it.node();
+
+		cnt = node->entries_cnt();
+
+		for (k = it.index(); k < cnt; k++)
+		{
+			node->GetEntry(e, k);
+
+			if (hi(e.key, e.key_len) > 0)
+				return true;
+
+			if (!visit(e))
+				return true;
+		}
+	} while (it.next_leaf());
+
+	return true;
+}
+
+template <class Cmp>
+size_t BTree::LookupBatchNode(const std::shared_ptr<BTreeNode> &node, BTreeEntry *results, const Cmp *cmps, const uint32_t *order, size_t cnt, bool exact)
+{
+	std::vector<NodeLoad> children;
+	std::vector<uint32_t> child_index;
+	std::vector<size_t> group_start;
+	std::shared_ptr<BTreeNode> child;
+	BTreeEntry e;
+	size_t found = 0;
+	size_t k;
+	size_t g;
+	int index;
+
+	if (node->level() == 0)
+	{
+		for (k = 0; k < cnt; k++)
+		{
+			index = FindBin(node, cmps[order[k]], exact ? FindMode::EQ : FindMode::LE);
+
+			if (index < 0)
+				continue;
+
+			node->GetEntry(results[order[k]], index);
+			results[order[k]].m_node = node;
+			found++;
+		}
+
+		return found;
+	}
+
+	// The keys are sorted, so the keys going to the same child are adjacent.
+	for (k = 0; k < cnt; k++)
+	{
+		index = FindBin(node, cmps[order[k]], FindMode::LE);
+
+		if (index < 0)
+			continue;
+
+		if (!child_index.empty() && child_index.back() == static_cast<uint32_t>(index))
+			continue;
+
+		children.emplace_back();
+		children.back().oid = node->GetEntry(e, index) ? GetChildOid(node, e) : 0;
+		child_index.push_back(index);
+		group_start.push_back(k);
+	}
+
+	group_start.push_back(cnt);
+
+	LoadNodes(children);
+
+	for (g = 0; g < children.size(); g++)
+	{
+		if (!children[g].blk)
+		{
+			std::cerr << "BTree: Node " << children[g].oid << " with parent " << node->nodeid() << " not found." << std::endl;
+			continue;
+		}
+
+		child = BTreeNode::CreateNode(*this, children[g].blk, children[g].paddr);
+		children[g].blk.reset();
+
+		found += LookupBatchNode(child, results, cmps, order + group_start[g], group_start[g + 1] - group_start[g], exact);
+	}
+
+	return found;
+}
+
+template <class Cmp>
+bool BTree::GetIterator(BTreeIterator &it, const Cmp &cmp)
+{
+	std::shared_ptr<BTreeNode> node;
+	int index;
+
+	if (!m_root_node)
+		return false;
+
+	m_stat_iterators.fetch_add(1, std::memory_order_relaxed);
+
+	if (m_debug)
+		std::cout << std::hex << "BTree::GetIterator: key=" << *reinterpret_cast<const uint64_t *>(cmp.key()) << " root=" << m_root_node->nodeid() << std::endl;
+
+	node = FindLeaf(cmp, &it);
+
+	if (!node)
+		return false;
+
+	index = FindBin(node, cmp, FindMode::GE);
+
+	if (m_debug)
+		std::cout << "Result = " << node->nodeid() << ":" << index << std::endl;
+
+	if (index < 0)
+	{
+		index = node->entries_cnt() - 1;
+		it.SetLeaf(node, index);
+		it.next();
+		if (m_debug)
+			std::cout << "Iterator next entry" << std::endl;
+	}
+	else
+	{
+		it.SetLeaf(node, index);
+	}
+
+	return true;
+}
+
+template <class Cmp>
+std::shared_ptr<BTreeNode> BTree::FindLeaf(const Cmp &cmp, BTreeIterator *it)
+{
+	std::shared_ptr<BTreeNode> node;
+	Finger f;
+	int index;
+
+	node = GetFingerLeaf(cmp, it);
+
+	if (node)
+	{
+		m_stat_finger_hits.fetch_add(1, std::memory_order_relaxed);
+		return node;
+	}
+
+	if (it)
+		it->Setup(this);
+
+	node = m_root_node;
+	f.depth = 0;
+
+	while (node->level() > 0)
+	{
+		index = FindBin(node, cmp, FindMode::LE);
+
+		if (index < 0)
+		{
+			if (!it)
+				return std::shared_ptr<BTreeNode>();
+			index = 0;
+		}
+
+		if (it)
+			it->Push(node, index);
+
+		if (f.depth < MAX_FINGER_DEPTH)
+		{
+			f.path[f.depth] = node->paddr();
+			f.index[f.depth] = index;
+		}
+		f.depth++;
+
+		node = GetChildNode(node, index);
+
+		if (!node)
+			return node;
+	}
+
+	if (f.depth > 0 && f.depth <= MAX_FINGER_DEPTH)
+	{
+		f.leaf = node->paddr();
+		SetFinger(f);
+	}
+
+	return node;
+}
+
+template <class Cmp>
+int BTree::FindBin(const std::shared_ptr<BTreeNode> &node, const Cmp &cmp, FindMode mode, bool use_index)
+{
+	BTreeEntry e;
+	int cnt = node->entries_cnt();
+	int beg;
+	int end;
+	int mid;
+	int rc;
+	bool eq = false;
+
+	if (cnt <= 0)
+		return -1;
+
+	if (m_debug)
+	{
+		std::cout << "FindBin    : ";
+		DumpHex(std::cout, reinterpret_cast<const uint8_t *>(cmp.key()), cmp.key_size(), cmp.key_size());
+	}
+
+	// Find the first entry >= key.
+	beg = 0;
+	end = cnt;
+
+	if (use_index)
+		FindInIndex(node, cmp.key(), cmp.key_size(), beg, end, eq);
+
+	while (beg < end)
+	{
+		mid = beg + (end - beg) / 2;
+
+		node->GetEntry(e, mid);
+		rc = cmp(e.key, e.key_len);
+
+		if (m_debug)
+			DebugFindStep(beg, mid, end, rc, e);
+
+		// Keep going left on a match, keys may occur more than once when
+		// only a prefix is compared.
+		if (rc == 0)
+		{
+			eq = true;
+			end = mid;
+		}
+		else if (rc < 0)
+			beg = mid + 1;
+		else
+			end = mid;
+	}
+
+	return FindResult(beg, eq, cnt, mode);
+}
+
+template <class Cmp>
+int BTree::CompareEntry(const std::shared_ptr<BTreeNode> &node, uint32_t index, const Cmp &cmp) const
+{
+	BTreeEntry e;
+
+	node->GetEntry(e, index);
+
+	return cmp(e.key, e.key_len);
+}
+
+// Returns the leaf of the finger, if the key belongs there, or to its right
+// sibling, which then becomes the finger. Returns nullptr if unsure, or if
+// a node of the path is no longer in the cache.
+template <class Cmp>
+std::shared_ptr<BTreeNode> BTree::GetFingerLeaf(const Cmp &cmp, BTreeIterator *it)
+{
+	std::shared_ptr<BTreeNode> leaf;
+	std::shared_ptr<BTreeNode> parent;
+	std::shared_ptr<BTreeNode> sibling;
+	std::shared_ptr<BTreeNode> node;
+	// A copy, loading the sibling can do lookups in the omap tree, which
+	// may share the slot.
+	Finger f = GetFinger();
+	uint32_t cnt;
+	uint32_t next;
+	uint32_t l;
+
+	if (f.tree_id != m_id || f.depth == 0)
+		return leaf;
+
+	leaf = GetCachedNode(f.leaf);
+
+	if (!leaf || leaf->level() != 0 || leaf->entries_cnt() == 0)
+		return std::shared_ptr<BTreeNode>();
+
+	// Key < first entry: somewhere further left.
+	if (CompareEntry(leaf, 0, cmp) > 0)
+		return std::shared_ptr<BTreeNode>();
+
+	// Key > last entry: here, unless the right sibling starts at or before key.
+	if (CompareEntry(leaf, leaf->entries_cnt() - 1, cmp) < 0)
+	{
+		parent = GetCachedNode(f.path[f.depth - 1]);
+
+		if (!parent)
+			return std::shared_ptr<BTreeNode>();
+
+		cnt = parent->entries_cnt();
+		next = f.index[f.depth - 1] + 1;
+
+		if (next >= cnt)
+			return std::shared_ptr<BTreeNode>();
+
+		if (CompareEntry(parent, next, cmp) <= 0)
+		{
+			// The sibling, if key is before the one after it.
+			if (next + 1 >= cnt || CompareEntry(parent, next + 1, cmp) <= 0)
+				return std::shared_ptr<BTreeNode>();
+
+			sibling = GetChildNode(parent, next);
+
+			if (!sibling || sibling->level() != 0)
+				return std::shared_ptr<BTreeNode>();
+
+			f.leaf = sibling->paddr();
+			f.index[f.depth - 1] = next;
+			SetFinger(f);
+			leaf = sibling;
+		}
+	}
+
+	if (!it)
+		return leaf;
+
+	it->Setup(this);
+
+	for (l = 0; l < f.depth; l++)
+	{
+		if (l == 0)
+			node = m_root_node;
+		else if (l == f.depth - 1 && parent)
+			node = parent;
+		else
+			node = GetCachedNode(f.path[l]);
+
+		if (!node || node->paddr() != f.path[l])
+			return std::shared_ptr<BTreeNode>();
+
+		it->Push(node, f.index[l]);
+	}
+
+	return leaf;
+}
@@ -0,0 +1,542 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <new>
+#include <cstdint>
+
+#include "BlockCache.h"
+
+CacheBlock::CacheBlock(paddr_t paddr, uint32_t size, uint8_t *data, SlabAllocator *owner)
+{
+	m_size = size;
+	m_paddr = paddr;
+	m_data = data;
+	m_owner = owner;
+	m_pinned = 0;
+	m_flags = 0;
+	m_aux.store(nullptr, std::memory_order_relaxed);
+	m_accessed.store(0, std::memory_order_relaxed);
+	m_refcnt.store(1, std::memory_order_release);
+}
+
+CacheBlock::~CacheBlock()
+{
+	delete m_aux.load(std::memory_order_relaxed);
+}
+
+CacheBlock *CacheBlock::Create(paddr_t paddr, uint32_t size)
+{
+	static_assert(sizeof(CacheBlock) <= HEADER_SIZE, "CacheBlock header too big");
+
+	// The data is intentionally left uninitialized, it gets overwritten by the read.
+	uint8_t *mem = reinterpret_cast<uint8_t *>(::operator new(HEADER_SIZE + size));
+
+	return new(mem) CacheBlock(paddr, size, mem + HEADER_SIZE, nullptr);
+}
+
+bool CacheBlock::TryAddRef()
+{
+	uint32_t cnt = m_refcnt.load(std::memory_order_relaxed);
+
+	do
+	{
+		if (cnt == 0)
+			return false;
+	} while (!m_refcnt.compare_exchange_weak(cnt, cnt + 1, std::memory_order_acquire, std::memory_order_relaxed));
+
+	return true;
+}
+
+const CacheBlockAux *CacheBlock::SetAux(CacheBlockAux *aux)
+{
+	CacheBlockAux *cur = nullptr;
+
+	if (m_aux.compare_exchange_strong(cur, aux, std::memory_order_acq_rel, std::memory_order_acquire))
+		return aux;
+
+	delete aux;
+	return cur;
+}
+
+void CacheBlock::Release()
+{
+	if (m_refcnt.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+		SlabAllocator *owner = m_owner;
+		uint8_t *data = m_data;
+
+		this->~CacheBlock();
+
+		if (owner)
+			owner->Free(this, data);
+		else
+			::operator delete(this);
+	}
+}
+
+BlockPtr &BlockPtr::operator=(const BlockPtr &o)
+{
+	if (o.m_blk)
+		o.m_blk->AddRef();
+	if (m_blk)
+		m_blk->Release();
+	m_blk = o.m_blk;
+	return *this;
+}
+
+BlockPtr &BlockPtr::operator=(BlockPtr &&o)
+{
+	if (this != &o)
+	{
+		if (m_blk)
+			m_blk->Release();
+		m_blk = o.m_blk;
+		o.m_blk = nullptr;
+	}
+	return *this;
+}
+
+void BlockPtr::reset()
+{
+	if (m_blk)
+		m_blk->Release();
+	m_blk = nullptr;
+}
+
+BlockCache::BlockCache()
+{
+	size_t k;
+
+	for (k = 0; k < SHARD_CNT; k++)
+	{
+		m_shards[k].mask = 0;
+		m_shards[k].hand = 0;
+		m_shards[k].cnt = 0;
+		m_shards[k].cap = 0;
+		m_shards[k].pinned = 0;
+		m_shards[k].hits = 0;
+		m_shards[k].misses = 0;
+		m_shards[k].evictions = 0;
+	}
+
+	m_capacity = 0;
+	m_size = 0;
+	m_pin_capacity = 0;
+	m_pin_size = 0;
+	m_pin_cnt = 0;
+	m_blksize = 0;
+	m_huge_pages = false;
+	m_use_slab = false;
+}
+
+BlockCache::~BlockCache()
+{
+	Clear();
+}
+
+void BlockCache::SetSize(size_t bytes)
+{
+	m_size = bytes;
+	UpdateCapacity();
+}
+
+void BlockCache::SetPinSize(size_t bytes)
+{
+	m_pin_size = bytes;
+	UpdateCapacity();
+}
+
+void BlockCache::SetBlockSize(uint32_t blksize)
+{
+	m_blksize = blksize;
+	m_use_slab = m_alloc.Init(blksize, m_huge_pages);
+	UpdateCapacity();
+}
+
+BlockPtr BlockCache::Alloc(paddr_t paddr)
+{
+	uint8_t *data;
+	void *hdr;
+
+	if (m_use_slab)
+	{
+		hdr = m_alloc.Alloc(data);
+		if (hdr)
+			return BlockPtr(new(hdr) CacheBlock(paddr, m_blksize, data, &m_alloc));
+	}
+
+	return BlockPtr::Create(paddr, m_blksize);
+}
+
+bool BlockCache::Get(paddr_t paddr, BlockPtr &blk)
+{
+	uint64_t hash = Hash(paddr);
+	Shard &sh = GetShard(hash);
+	CacheBlock *b;
+	size_t idx;
+	size_t k;
+
+	if (sh.cap == 0)
+		return false;
+
+	for (k = 0; k < MAX_PROBE; k++)
+	{
+		idx = (hash + k) & sh.mask;
+
+		b = sh.slots[idx].load(std::memory_order_acquire);
+		if (!b)
+			continue;
+
+		// The block may have been evicted and recycled since we loaded the
+		// pointer, so it only counts if it is still in the slot after we got
+		// our reference.
+		if (!b->TryAddRef())
+			continue;
+
+		if (sh.slots[idx].load(std::memory_order_acquire) == b && b->m_paddr == paddr)
+		{
+			if (!b->m_accessed.load(std::memory_order_relaxed))
+				b->m_accessed.store(1, std::memory_order_relaxed);
+
+			blk = BlockPtr(b);
+			sh.hits.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		b->Release();
+	}
+
+	sh.misses.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+void BlockCache::Put(paddr_t paddr, const BlockPtr &blk)
+{
+	uint64_t hash = Hash(paddr);
+	Shard &sh = GetShard(hash);
+	std::lock_guard<std::mutex> lock(sh.mtx);
+	CacheBlock *b;
+	size_t idx;
+	size_t k;
+
+	// Blocks outside of the slabs are not type-stable, so they can't be
+	// handed to lock-free readers.
+	if (sh.cap == 0 || !blk || !blk->m_owner)
+		return;
+
+	for (k = 0; k < MAX_PROBE; k++)
+	{
+		idx = (hash + k) & sh.mask;
+		b = sh.slots[idx].load(std::memory_order_relaxed);
+
+		if (!b || b->m_paddr != paddr)
+			continue;
+
+		// Another thread loaded the same block in the meantime.
+		if (b->m_flags == blk->m_flags || b->m_pinned)
+			return;
+
+		// The cached copy was read in a different way, replace it.
+		blk->AddRef();
+		blk->m_pinned = 0;
+		sh.slots[idx].store(blk.get(), std::memory_order_release);
+		b->Release();
+		return;
+	}
+
+	if (sh.cnt >= sh.cap)
+		EvictOne(sh);
+
+	idx = FindSlot(sh, hash);
+	if (idx == SIZE_MAX)
+		return;
+
+	blk->AddRef();
+	blk->m_pinned = 0;
+	sh.slots[idx].store(blk.get(), std::memory_order_release);
+	sh.cnt++;
+}
+
+bool BlockCache::Pin(paddr_t paddr, const BlockPtr &blk)
+{
+	uint64_t hash = Hash(paddr);
+	Shard &sh = GetShard(hash);
+	std::lock_guard<std::mutex> lock(sh.mtx);
+	CacheBlock *b;
+	size_t idx;
+	size_t k;
+
+	if (sh.cap == 0 || !blk || !blk->m_owner)
+		return false;
+
+	if (m_pin_cnt.fetch_add(1, std::memory_order_relaxed) >= m_pin_capacity)
+	{
+		m_pin_cnt.fetch_sub(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	for (k = 0; k < MAX_PROBE; k++)
+	{
+		b = sh.slots[(hash + k) & sh.mask].load(std::memory_order_relaxed);
+
+		if (b && b->m_paddr == paddr)
+		{
+			if (b->m_pinned)
+			{
+				m_pin_cnt.fetch_sub(1, std::memory_order_relaxed);
+			}
+			else
+			{
+				b->m_pinned = 1;
+				sh.cnt--;
+				sh.pinned++;
+			}
+			return true;
+		}
+	}
+
+	idx = FindSlot(sh, hash);
+	if (idx == SIZE_MAX)
+	{
+		m_pin_cnt.fetch_sub(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	blk->AddRef();
+	blk->m_pinned = 1;
+	sh.slots[idx].store(blk.get(), std::memory_order_release);
+	sh.pinned++;
+
+	return true;
+}
+
+void BlockCache::Clear()
+{
+	size_t k;
+	size_t n;
+
+	for (k = 0; k < SHARD_CNT; k++)
+	{
+		Shard &sh = m_shards[k];
+		std::lock_guard<std::mutex> lock(sh.mtx);
+
+		if (!sh.slots)
+			continue;
+
+		for (n = 0; n <= sh.mask; n++)
+		{
+			CacheBlock *b = sh.slots[n].exchange(nullptr, std::memory_order_acq_rel);
+			if (b)
+				b->Release();
+		}
+
+		sh.hand = 0;
+		sh.cnt = 0;
+		sh.pinned = 0;
+	}
+
+	m_pin_cnt = 0;
+}
+
+void BlockCache::GetEntries(std::vector<Entry> &entries)
+{
+	std::vector<Entry> unpinned;
+	Entry e;
+	size_t k;
+	size_t n;
+
+	entries.clear();
+
+	for (k = 0; k < SHARD_CNT; k++)
+	{
+		Shard &sh = m_shards[k];
+		std::lock_guard<std::mutex> lock(sh.mtx);
+
+		if (!sh.slots)
+			continue;
+
+		for (n = 0; n <= sh.mask; n++)
+		{
+			CacheBlock *b = sh.slots[n].load(std::memory_order_relaxed);
+
+			if (!b)
+				continue;
+
+			e.paddr = b->m_paddr;
+			e.flags = b->m_flags;
+
+			if (b->m_pinned)
+				entries.push_back(e);
+			else
+				unpinned.push_back(e);
+		}
+	}
+
+	entries.insert(entries.end(), unpinned.begin(), unpinned.end());
+}
+
+void BlockCache::GetStats(CacheStats &st)
+{
+	size_t k;
+
+	st.hits = 0;
+	st.misses = 0;
+	st.evictions = 0;
+	st.entries = 0;
+	st.capacity = m_capacity;
+	st.pinned = 0;
+
+	for (k = 0; k < SHARD_CNT; k++)
+	{
+		Shard &sh = m_shards[k];
+
+		st.hits += sh.hits.load(std::memory_order_relaxed);
+		st.misses += sh.misses.load(std::memory_order_relaxed);
+		st.evictions += sh.evictions.load(std::memory_order_relaxed);
+
+		std::lock_guard<std::mutex> lock(sh.mtx);
+		st.entries += sh.cnt;
+		st.pinned += sh.pinned;
+	}
+}
+
+void BlockCache::UpdateCapacity()
+{
+	size_t entries;
+	size_t pin_entries;
+	size_t cap;
+	size_t pin_cap;
+	size_t tblsize;
+	size_t k;
+	size_t n;
+
+	if (m_blksize == 0)
+		return;
+
+	entries = m_size / m_blksize;
+	pin_entries = m_pin_size / m_blksize;
+	if (entries == m_capacity && pin_entries == m_pin_capacity)
+		return;
+
+	Clear();
+
+	cap = (entries + SHARD_CNT - 1) / SHARD_CNT;
+	pin_cap = (pin_entries + SHARD_CNT - 1) / SHARD_CNT;
+
+	// Keep the load factor at or below 0.5, so the probe windows stay short.
+	tblsize = MAX_PROBE;
+	while (tblsize < 2 * (cap + pin_cap))
+		tblsize <<= 1;
+
+	for (k = 0; k < SHARD_CNT; k++)
+	{
+		Shard &sh = m_shards[k];
+		std::lock_guard<std::mutex> lock(sh.mtx);
+
+		if (cap == 0)
+		{
+			sh.slots.reset();
+			sh.mask = 0;
+		}
+		else
+		{
+			sh.slots.reset(new std::atomic<CacheBlock *>[tblsize]);
+			for (n = 0; n < tblsize; n++)
+				sh.slots[n].store(nullptr, std::memory_order_relaxed);
+			sh.mask = tblsize - 1;
+		}
+
+		sh.hand = 0;
+		sh.cnt = 0;
+		sh.cap = cap;
+	}
+
+	m_capacity = entries;
+	m_pin_capacity = (cap == 0) ? 0 : pin_entries;
+}
+
+size_t BlockCache::FindSlot(Shard &sh, uint64_t hash)
+{
+	CacheBlock *b;
+	size_t idx;
+	size_t victim = SIZE_MAX;
+	bool victim_accessed = true;
+	size_t k;
+
+	// Find a free slot in the probe window. If there is none, replace the
+	// first unpinned entry, preferring one that has not been accessed
+	// recently.
+	for (k = 0; k < MAX_PROBE; k++)
+	{
+		idx = (hash + k) & sh.mask;
+		b = sh.slots[idx].load(std::memory_order_relaxed);
+
+		if (!b)
+			return idx;
+
+		if (b->m_pinned)
+			continue;
+
+		if (victim == SIZE_MAX || (victim_accessed && !b->m_accessed.load(std::memory_order_relaxed)))
+		{
+			victim = idx;
+			victim_accessed = b->m_accessed.load(std::memory_order_relaxed) != 0;
+		}
+	}
+
+	if (victim != SIZE_MAX)
+		Evict(sh, victim);
+
+	return victim;
+}
+
+void BlockCache::Evict(Shard &sh, size_t idx)
+{
+	CacheBlock *b = sh.slots[idx].exchange(nullptr, std::memory_order_acq_rel);
+
+	if (b)
+	{
+		b->Release();
+		sh.cnt--;
+		sh.evictions.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void BlockCache::EvictOne(Shard &sh)
+{
+	CacheBlock *b;
+
+	// Advance the hand, giving every recently used block a second chance.
+	for (;;)
+	{
+		b = sh.slots[sh.hand].load(std::memory_order_relaxed);
+
+		if (b && !b->m_pinned)
+		{
+			if (!b->m_accessed.load(std::memory_order_relaxed))
+				break;
+			b->m_accessed.store(0, std::memory_order_relaxed);
+		}
+
+		sh.hand = (sh.hand + 1) & sh.mask;
+	}
+
+	Evict(sh, sh.hand);
+	sh.hand = (sh.hand + 1) & sh.mask;
+}
@@ -0,0 +1,218 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "ApfsTypes.h"
+#include "ClockCache.h"
+#include "SlabAllocator.h"
+
+// How a block has to be read and verified, so that it can be loaded again
+// without the tree it belongs to (e.g. from a cache manifest).
+enum CacheBlockFlags : uint8_t
+{
+	CB_VOLUME = 1,    // Read through the volume, not the container
+	CB_ENCRYPTED = 2, // Decrypted with the paddr as tweak
+	CB_NOHEADER = 4   // No object header, can't be verified
+};
+
+// Data derived from the contents of a block, e.g. a decoded key index.
+// It is owned by the block and deleted together with it.
+class CacheBlockAux
+{
+public:
+	virtual ~CacheBlockAux() {}
+};
+
+// Refcounted metadata block. The device read fills the data in place. Once a
+// block has been published to the cache, it is never modified again.
+// Blocks either come from the slab allocator of a BlockCache, or, if created
+// standalone, have header and data in one heap allocation.
+class CacheBlock
+{
+	friend class BlockPtr;
+	friend class BlockCache;
+
+	CacheBlock(paddr_t paddr, uint32_t size, uint8_t *data, SlabAllocator *owner);
+	~CacheBlock();
+
+public:
+	static CacheBlock *Create(paddr_t paddr, uint32_t size);
+
+	uint8_t *data() { return m_data; }
+	const uint8_t *data() const { return m_data; }
+	uint32_t size() const { return m_size; }
+	paddr_t paddr() const { return m_paddr; }
+	uint8_t flags() const { return m_flags; }
+	void SetFlags(uint8_t flags) { m_flags = flags; }
+
+	const CacheBlockAux *aux() const { return m_aux.load(std::memory_order_acquire); }
+	// Attaches aux to the block, unless another thread was faster. Returns
+	// the attached object, aux is deleted if it wasn't used.
+	const CacheBlockAux *SetAux(CacheBlockAux *aux);
+
+private:
+	static constexpr size_t HEADER_SIZE = SlabAllocator::HEADER_SIZE;
+
+	void AddRef() { m_refcnt.fetch_add(1, std::memory_order_relaxed); }
+	bool TryAddRef();
+	void Release();
+
+	// Set to 1 by the constructor with an atomic store instead of a member
+	// initializer, a lock-free reader may still be looking at the header of
+	// a recycled slab block. TryAddRef never takes a reference at 0, and
+	// BlockCache::Get checks the slot again after it got one.
+	std::atomic<uint32_t> m_refcnt;
+	std::atomic<uint8_t> m_accessed;
+	uint8_t m_pinned;
+	uint8_t m_flags;
+	uint32_t m_size;
+	paddr_t m_paddr;
+	uint8_t *m_data;
+	SlabAllocator *m_owner;
+	std::atomic<CacheBlockAux *> m_aux;
+};
+
+// Reference to a CacheBlock, shared between the cache and all nodes using it.
+class BlockPtr
+{
+public:
+	BlockPtr() : m_blk(nullptr) {}
+	explicit BlockPtr(CacheBlock *blk) : m_blk(blk) {}
+	BlockPtr(const BlockPtr &o) : m_blk(o.m_blk) { if (m_blk) m_blk->AddRef(); }
+	BlockPtr(BlockPtr &&o) : m_blk(o.m_blk) { o.m_blk = nullptr; }
+	~BlockPtr() { if (m_blk) m_blk->Release(); }
+
+	BlockPtr &operator=(const BlockPtr &o);
+	BlockPtr &operator=(BlockPtr &&o);
+
+	void reset();
+
+	static BlockPtr Create(paddr_t paddr, uint32_t size) { return BlockPtr(CacheBlock::Create(paddr, size)); }
+
+	CacheBlock *get() const { return m_blk; }
+	CacheBlock *operator->() const { return m_blk; }
+	explicit operator bool() const { return m_blk != nullptr; }
+
+private:
+	CacheBlock *m_blk;
+};
+
+// Container-wide cache of metadata blocks, keyed by physical address.
+// All trees of a container draw from this cache, so the whole container
+// stays within one memory budget.
+//
+// Lookups don't take any lock. Each shard is an open addressing table of
+// block pointers, which is only modified under the shard lock. Since the
+// blocks live in type-stable slab memory, a reader can safely take a
+// reference to a block that is concurrently evicted, and then checks if it
+// is still the one it was looking for. Races only ever cause a miss.
+// Eviction is done by a CLOCK hand running over the table.
+// Pinned blocks have a separate budget and are never evicted.
+class BlockCache
+{
+public:
+	struct Entry
+	{
+		paddr_t paddr;
+		uint8_t flags;
+	};
+
+private:
+	static constexpr int SHARD_BITS = 4;
+	static constexpr size_t SHARD_CNT = 1U << SHARD_BITS;
+	static constexpr size_t MAX_PROBE = 8;
+
+	struct Shard
+	{
+		std::mutex mtx;
+		std::unique_ptr<std::atomic<CacheBlock *>[]> slots;
+		size_t mask;
+		size_t hand;
+		size_t cnt;
+		size_t cap;
+		size_t pinned;
+
+		std::atomic<uint64_t> hits;
+		std::atomic<uint64_t> misses;
+		std::atomic<uint64_t> evictions;
+	};
+
+public:
+	BlockCache();
+	~BlockCache();
+
+	BlockCache(const BlockCache &o) = delete;
+	BlockCache &operator=(const BlockCache &o) = delete;
+
+	// These must not be called while the cache is in use.
+	void SetSize(size_t bytes);
+	size_t GetSize() const { return m_size; }
+	void SetBlockSize(uint32_t blksize);
+	void SetHugePages(bool enable) { m_huge_pages = enable; }
+	void SetPinSize(size_t bytes);
+	size_t GetPinSize() const { return m_pin_size; }
+
+	// Returns a new, unpublished block with uninitialized data.
+	BlockPtr Alloc(paddr_t paddr);
+
+	bool Get(paddr_t paddr, BlockPtr &blk);
+	// Replaces a cached copy of the block with other flags, unless it is
+	// pinned.
+	void Put(paddr_t paddr, const BlockPtr &blk);
+	// Returns false if the pin budget is used up, or if there is no slot
+	// left for the block in its probe window.
+	bool Pin(paddr_t paddr, const BlockPtr &blk);
+	bool IsPinFull() const { return m_pin_cnt.load(std::memory_order_relaxed) >= m_pin_capacity; }
+	void Clear();
+
+	// Returns all cached blocks, pinned ones first.
+	void GetEntries(std::vector<Entry> &entries);
+
+	void GetStats(CacheStats &st);
+	void GetSlabStats(SlabStats &st) { m_alloc.GetStats(st); }
+
+private:
+	static uint64_t Hash(paddr_t paddr) { return paddr * 0x9E3779B97F4A7C15ULL; }
+	Shard &GetShard(uint64_t hash) { return m_shards[hash >> (64 - SHARD_BITS)]; }
+
+	void UpdateCapacity();
+	size_t FindSlot(Shard &sh, uint64_t hash);
+	void Evict(Shard &sh, size_t idx);
+	void EvictOne(Shard &sh);
+
+	// Must outlive the shards, since the cached blocks are returned to it.
+	SlabAllocator m_alloc;
+	Shard m_shards[SHARD_CNT];
+	size_t m_capacity;
+	size_t m_size;
+	size_t m_pin_capacity;
+	size_t m_pin_size;
+	std::atomic<size_t> m_pin_cnt;
+	uint32_t m_blksize;
+	bool m_huge_pages;
+	bool m_use_slab;
+};
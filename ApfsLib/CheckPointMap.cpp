@@ -4,6 +4,7 @@
 #include "DiskStruct.h"
 #include "BlockDumper.h"
 #include "CheckPointMap.h"
+#include "Util.h"
 
 CheckPointMap::CheckPointMap(ApfsContainer& container) : m_container(container)
 {
@@ -18,16 +19,30 @@ CheckPointMap::~CheckPointMap()
 bool CheckPointMap::Init(oid_t root_oid, uint32_t blk_count)
 {
 	uint32_t n;
+	uint32_t k;
+	uint32_t max_cnt;
 	const checkpoint_map_phys_t *cpm;
+	omap_res_t res;
 
 	m_blksize = m_container.GetBlocksize();
 	m_cpm_data.resize(m_blksize * blk_count);
+	m_index.clear();
+
+	max_cnt = (m_blksize - sizeof(checkpoint_map_phys_t)) / sizeof(checkpoint_mapping_t);
+
+	// The cpm blocks are consecutive, so get them all in one go.
+	if (!m_container.ReadBlocks(m_cpm_data.data(), root_oid, blk_count))
+	{
+		m_cpm_data.clear();
+		return false;
+	}
 
 	for (n = 0; n < blk_count; n++)
 	{
-		if (!m_container.ReadAndVerifyHeaderBlock(m_cpm_data.data() + n * m_blksize, root_oid + n))
+		if (!VerifyBlock(m_cpm_data.data() + n * m_blksize, m_blksize))
 		{
 			m_cpm_data.clear();
+			m_index.clear();
 			return false;
 		}
 
@@ -35,11 +50,24 @@ bool CheckPointMap::Init(oid_t root_oid, uint32_t blk_count)
 
 		assert((cpm->cpm_o.o_type & OBJECT_TYPE_MASK) == OBJECT_TYPE_CHECKPOINT_MAP);
 
-		if ((cpm->cpm_o.o_type & OBJECT_TYPE_MASK) != OBJECT_TYPE_CHECKPOINT_MAP)
+		if ((cpm->cpm_o.o_type & OBJECT_TYPE_MASK) != OBJECT_TYPE_CHECKPOINT_MAP || cpm->cpm_count > max_cnt)
 		{
 			m_cpm_data.clear();
+			m_index.clear();
 			return false;
 		}
+
+		for (k = 0; k < cpm->cpm_count; k++)
+		{
+			res.oid = cpm->cpm_map[k].cpm_oid;
+			res.xid = cpm->cpm_o.o_xid;
+			res.flags = 0;
+			res.size = cpm->cpm_map[k].cpm_size;
+			res.paddr = cpm->cpm_map[k].cpm_paddr;
+
+			// The first mapping of an oid wins, like with a linear search.
+			m_index.emplace(res.oid, res);
+		}
 	}
 
 	m_cpm_oid = root_oid;
@@ -49,35 +77,16 @@ bool CheckPointMap::Init(oid_t root_oid, uint32_t blk_count)
 
 bool CheckPointMap::Lookup(omap_res_t & res, oid_t oid, xid_t xid)
 {
-	uint32_t blk_offs;
-	uint32_t k;
-	uint32_t cnt;
-	const checkpoint_map_phys_t * cpm;
-
 	(void)xid;
 
-	for (blk_offs = 0; blk_offs < m_cpm_data.size(); blk_offs += m_blksize)
-	{
-		cpm = reinterpret_cast<const checkpoint_map_phys_t *>(m_cpm_data.data() + blk_offs);
+	auto it = m_index.find(oid);
 
-		cnt = cpm->cpm_count;
+	if (it == m_index.end())
+		return false;
 
-		for (k = 0; k < cnt; k++)
-		{
-			if (oid == cpm->cpm_map[k].cpm_oid)
-			{
-				res.oid = cpm->cpm_map[k].cpm_oid;
-				res.xid = cpm->cpm_o.o_xid;
-				res.flags = 0;
-				res.size = cpm->cpm_map[k].cpm_size;
-				res.paddr = cpm->cpm_map[k].cpm_paddr;
-
-				return true;
-			}
-		}
-	}
+	res = it->second;
 
-	return false;
+	return true;
 }
 
 void CheckPointMap::dump(BlockDumper& bd)
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <unordered_map>
 #include <vector>
 
 #include "DiskStruct.h"
@@ -22,6 +23,8 @@ public:
 private:
 	ApfsContainer &m_container;
 	std::vector<uint8_t> m_cpm_data;
+	// All mappings of all cpm blocks, built by Init.
+	std::unordered_map<oid_t, omap_res_t> m_index;
 	oid_t m_cpm_oid;
 	uint32_t m_blksize;
 };
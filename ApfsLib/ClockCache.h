@@ -0,0 +1,271 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct CacheStats
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t entries;
+	uint64_t capacity;
+	uint64_t pinned;
+};
+
+// Sharded CLOCK cache. Each shard has its own lock, index and clock hand,
+// so eviction is amortized O(1) and threads only contend if they hit the
+// same shard. A capacity of 0 disables caching.
+// Every entry is charged against the capacity, by default with 1, so the
+// capacity is a number of entries. Callers that pass the size of the value
+// as charge get a cache that is bounded in bytes.
+template<typename V>
+class ClockCache
+{
+	static constexpr int SHARD_BITS = 4;
+	static constexpr size_t SHARD_CNT = 1U << SHARD_BITS;
+
+	struct Slot
+	{
+		uint64_t key;
+		V val;
+		size_t charge;
+		bool ref;
+	};
+
+	struct Shard
+	{
+		std::mutex mtx;
+		std::unordered_map<uint64_t, size_t> index;
+		std::vector<Slot> slots;
+		size_t hand;
+		size_t cap;
+		size_t used;
+	};
+
+public:
+	ClockCache();
+	~ClockCache();
+
+	ClockCache(const ClockCache &o) = delete;
+	ClockCache &operator=(const ClockCache &o) = delete;
+
+	void SetCapacity(size_t capacity);
+	size_t GetCapacity() const { return m_capacity; }
+	// Sum of the charges of all entries.
+	size_t GetSize();
+
+	bool Get(uint64_t key, V &val);
+	// Returns false if the entry is not cached, because it alone would take
+	// more than the capacity of its shard.
+	bool Put(uint64_t key, const V &val, size_t charge = 1);
+	void Clear();
+
+	void GetStats(CacheStats &st);
+
+private:
+	Shard &GetShard(uint64_t key) { return m_shards[(key * 0x9E3779B97F4A7C15ULL) >> (64 - SHARD_BITS)]; }
+	void Remove(Shard &sh, size_t idx);
+
+	Shard m_shards[SHARD_CNT];
+	size_t m_capacity;
+
+	std::atomic<uint64_t> m_hits;
+	std::atomic<uint64_t> m_misses;
+	std::atomic<uint64_t> m_evictions;
+};
+
+template<typename V>
+ClockCache<V>::ClockCache() : m_hits(0), m_misses(0), m_evictions(0)
+{
+	size_t k;
+
+	for (k = 0; k < SHARD_CNT; k++)
+	{
+		m_shards[k].hand = 0;
+		m_shards[k].cap = 0;
+		m_shards[k].used = 0;
+	}
+
+	m_capacity = 0;
+}
+
+template<typename V>
+ClockCache<V>::~ClockCache()
+{
+	Clear();
+}
+
+template<typename V>
+void ClockCache<V>::SetCapacity(size_t capacity)
+{
+	size_t k;
+
+	for (k = 0; k < SHARD_CNT; k++)
+	{
+		Shard &sh = m_shards[k];
+		std::lock_guard<std::mutex> lock(sh.mtx);
+
+		sh.index.clear();
+		sh.slots.clear();
+		sh.slots.shrink_to_fit();
+		sh.hand = 0;
+		sh.cap = (capacity + SHARD_CNT - 1) / SHARD_CNT;
+		sh.used = 0;
+	}
+
+	m_capacity = capacity;
+}
+
+template<typename V>
+size_t ClockCache<V>::GetSize()
+{
+	size_t size = 0;
+	size_t k;
+
+	for (k = 0; k < SHARD_CNT; k++)
+	{
+		std::lock_guard<std::mutex> lock(m_shards[k].mtx);
+		size += m_shards[k].used;
+	}
+
+	return size;
+}
+
+template<typename V>
+bool ClockCache<V>::Get(uint64_t key, V &val)
+{
+	Shard &sh = GetShard(key);
+	std::lock_guard<std::mutex> lock(sh.mtx);
+
+	auto it = sh.index.find(key);
+
+	if (it == sh.index.end())
+	{
+		m_misses.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	Slot &s = sh.slots[it->second];
+	s.ref = true;
+	val = s.val;
+
+	m_hits.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+template<typename V>
+bool ClockCache<V>::Put(uint64_t key, const V &val, size_t charge)
+{
+	Shard &sh = GetShard(key);
+	std::lock_guard<std::mutex> lock(sh.mtx);
+
+	if (charge > sh.cap)
+		return false;
+
+	auto it = sh.index.find(key);
+
+	// Another thread loaded the same entry in the meantime.
+	if (it != sh.index.end())
+		Remove(sh, it->second);
+
+	while (sh.used + charge > sh.cap)
+	{
+		// Advance the hand, giving every recently used entry a second chance.
+		while (sh.slots[sh.hand].ref)
+		{
+			sh.slots[sh.hand].ref = false;
+			sh.hand++;
+			if (sh.hand == sh.slots.size())
+				sh.hand = 0;
+		}
+
+		Remove(sh, sh.hand);
+		m_evictions.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	sh.index[key] = sh.slots.size();
+	sh.slots.push_back(Slot{ key, val, charge, false });
+	sh.used += charge;
+
+	return true;
+}
+
+template<typename V>
+void ClockCache<V>::Remove(Shard &sh, size_t idx)
+{
+	sh.used -= sh.slots[idx].charge;
+	sh.index.erase(sh.slots[idx].key);
+
+	// The last slot takes the place of the removed one.
+	if (idx != sh.slots.size() - 1)
+	{
+		sh.slots[idx] = std::move(sh.slots.back());
+		sh.index[sh.slots[idx].key] = idx;
+	}
+
+	sh.slots.pop_back();
+
+	if (sh.hand >= sh.slots.size())
+		sh.hand = 0;
+}
+
+template<typename V>
+void ClockCache<V>::Clear()
+{
+	size_t k;
+
+	for (k = 0; k < SHARD_CNT; k++)
+	{
+		Shard &sh = m_shards[k];
+		std::lock_guard<std::mutex> lock(sh.mtx);
+
+		sh.index.clear();
+		sh.slots.clear();
+		sh.hand = 0;
+		sh.used = 0;
+	}
+}
+
+template<typename V>
+void ClockCache<V>::GetStats(CacheStats &st)
+{
+	size_t k;
+
+	st.hits = m_hits.load(std::memory_order_relaxed);
+	st.misses = m_misses.load(std::memory_order_relaxed);
+	st.evictions = m_evictions.load(std::memory_order_relaxed);
+	st.entries = 0;
+	st.capacity = m_capacity;
+	st.pinned = 0;
+
+	for (k = 0; k < SHARD_CNT; k++)
+	{
+		std::lock_guard<std::mutex> lock(m_shards[k].mtx);
+		st.entries += m_shards[k].slots.size();
+	}
+}
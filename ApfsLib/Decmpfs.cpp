@@ -21,6 +21,8 @@
 #include <iostream>
 #include <cstring>
 #include <cassert>
+#include <atomic>
+#include <chrono>
 
 #include "Decmpfs.h"
 #include "Endian.h"
@@ -50,6 +52,13 @@ struct CmpfRsrc
 	CmpfRsrcEntry entry[32];
 };
 
+static std::atomic<uint64_t> s_decomp_files(0);
+static std::atomic<uint64_t> s_decomp_failures(0);
+static std::atomic<uint64_t> s_decomp_decompressed_bytes(0);
+static std::atomic<uint64_t> s_decomp_nsec(0);
+
+static bool DecompressFileInternal(ApfsDir &dir, uint64_t ino, std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed);
+
 bool IsDecompAlgoSupported(uint16_t algo)
 {
 	switch (algo)
@@ -86,6 +95,31 @@ bool IsDecompAlgoInRsrc(uint16_t algo)
 }
 
 bool DecompressFile(ApfsDir &dir, uint64_t ino, std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed)
+{
+	auto start = std::chrono::steady_clock::now();
+	bool rc;
+
+	rc = DecompressFileInternal(dir, ino, decompressed, compressed);
+
+	s_decomp_files.fetch_add(1, std::memory_order_relaxed);
+	if (rc)
+		s_decomp_decompressed_bytes.fetch_add(decompressed.size(), std::memory_order_relaxed);
+	else
+		s_decomp_failures.fetch_add(1, std::memory_order_relaxed);
+	s_decomp_nsec.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+
+	return rc;
+}
+
+void GetDecompStats(DecompStats &st)
+{
+	st.files = s_decomp_files.load(std::memory_order_relaxed);
+	st.failures = s_decomp_failures.load(std::memory_order_relaxed);
+	st.decompressed_bytes = s_decomp_decompressed_bytes.load(std::memory_order_relaxed);
+	st.nsec = s_decomp_nsec.load(std::memory_order_relaxed);
+}
+
+static bool DecompressFileInternal(ApfsDir &dir, uint64_t ino, std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed)
 {
 	if (compressed.size() < sizeof(CompressionHeader))
 		return false;
@@ -23,6 +23,14 @@
 
 #include "ApfsDir.h"
 
+struct DecompStats
+{
+	uint64_t files;
+	uint64_t failures;
+	uint64_t decompressed_bytes;
+	uint64_t nsec;
+};
+
 struct CompressionHeader
 {
 	le_uint32_t signature;
@@ -34,3 +42,4 @@ bool IsDecompAlgoSupported(uint16_t algo);
 bool IsDecompAlgoInRsrc(uint16_t algo);
 
 bool DecompressFile(ApfsDir &dir, uint64_t ino, std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed);
+void GetDecompStats(DecompStats &st);
@@ -17,7 +17,13 @@
 	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <functional>
+#include <mutex>
+#include <vector>
 
 #include "Device.h"
 
@@ -29,15 +35,291 @@
 #include "DeviceSparseImage.h"
 #include "DeviceVDI.h"
 
-Device::Device()
+constexpr unsigned int Device::IO_THREADS;
+constexpr uint64_t Device::READV_MAX_MERGE;
+constexpr size_t Device::READV_MAX_SEGMENTS;
+
+// Reads on the spot, for devices that can't read from several threads.
+class SyncReadQueue : public ReadQueue
+{
+public:
+	SyncReadQueue(Device &dev, unsigned int depth) : ReadQueue(dev, depth) {}
+	~SyncReadQueue() { Drain(); }
+
+protected:
+	void Queue(void *data, uint64_t offs, uint64_t len, uint64_t tag) override
+	{
+		auto start = std::chrono::steady_clock::now();
+		bool ok = m_dev.Read(data, offs, len);
+
+		m_dev.AccountRead(len, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		m_completed.push_back(std::make_pair(tag, ok));
+	}
+
+	void Reap(uint64_t &tag, bool &ok) override
+	{
+		tag = m_completed.front().first;
+		ok = m_completed.front().second;
+		m_completed.pop_front();
+	}
+
+private:
+	std::deque<std::pair<uint64_t, bool>> m_completed;
+};
+
+// Runs the reads on the I/O threads of the device.
+class ThreadedReadQueue : public ReadQueue
+{
+public:
+	ThreadedReadQueue(Device &dev, unsigned int depth) : ReadQueue(dev, depth) {}
+	~ThreadedReadQueue() { Drain(); }
+
+protected:
+	void Queue(void *data, uint64_t offs, uint64_t len, uint64_t tag) override
+	{
+		if (!m_dev.m_io_pool.Submit(std::bind(&ThreadedReadQueue::ReadTask, this, data, offs, len, tag)))
+			ReadTask(data, offs, len, tag);
+	}
+
+	void Reap(uint64_t &tag, bool &ok) override
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		m_cv.wait(lock, [this] { return !m_completed.empty(); });
+		tag = m_completed.front().first;
+		ok = m_completed.front().second;
+		m_completed.pop_front();
+	}
+
+private:
+	void ReadTask(void *data, uint64_t offs, uint64_t len, uint64_t tag)
+	{
+		auto start = std::chrono::steady_clock::now();
+		bool ok = m_dev.Read(data, offs, len);
+
+		m_dev.AccountRead(len, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+		// Notify under the lock, the queue may be gone right after.
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_completed.push_back(std::make_pair(tag, ok));
+		m_cv.notify_one();
+	}
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::deque<std::pair<uint64_t, bool>> m_completed;
+};
+
+ReadQueue::ReadQueue(Device &dev, unsigned int depth) : m_dev(dev), m_depth(depth ? depth : 1)
+{
+	m_in_flight = 0;
+}
+
+ReadQueue::~ReadQueue()
+{
+}
+
+void ReadQueue::Submit(void *data, uint64_t offs, uint64_t len, uint64_t tag)
+{
+	uint64_t done_tag;
+	bool done_ok;
+
+	if (m_in_flight == m_depth)
+	{
+		Reap(done_tag, done_ok);
+		m_in_flight--;
+		m_done.push_back(std::make_pair(done_tag, done_ok));
+	}
+
+	Queue(data, offs, len, tag);
+	m_in_flight++;
+}
+
+void ReadQueue::Complete(uint64_t tag, bool ok)
+{
+	m_done.push_back(std::make_pair(tag, ok));
+}
+
+bool ReadQueue::Wait(uint64_t &tag, bool &ok)
+{
+	if (!m_done.empty())
+	{
+		tag = m_done.front().first;
+		ok = m_done.front().second;
+		m_done.pop_front();
+		return true;
+	}
+
+	if (m_in_flight == 0)
+		return false;
+
+	Reap(tag, ok);
+	m_in_flight--;
+	return true;
+}
+
+bool ReadQueue::WaitAll()
+{
+	uint64_t tag;
+	bool ok;
+	bool rc = true;
+
+	while (Wait(tag, ok))
+		rc = rc && ok;
+
+	return rc;
+}
+
+void ReadQueue::Drain()
+{
+	uint64_t tag;
+	bool ok;
+
+	while (m_in_flight > 0)
+	{
+		Reap(tag, ok);
+		m_in_flight--;
+	}
+}
+
+Device::Device() : m_read_ops(0), m_read_bytes(0), m_read_nsec(0)
 {
 	m_sector_size = 0x200;
+	m_io_pool.SetThreadCount(IO_THREADS);
 }
 
 Device::~Device()
 {
 }
 
+void Device::AccountRead(uint64_t bytes, uint64_t nsec)
+{
+	m_read_ops.fetch_add(1, std::memory_order_relaxed);
+	m_read_bytes.fetch_add(bytes, std::memory_order_relaxed);
+	m_read_nsec.fetch_add(nsec, std::memory_order_relaxed);
+}
+
+void Device::GetStats(DeviceStats &st) const
+{
+	st.read_ops = m_read_ops.load(std::memory_order_relaxed);
+	st.read_bytes = m_read_bytes.load(std::memory_order_relaxed);
+	st.read_nsec = m_read_nsec.load(std::memory_order_relaxed);
+}
+
+std::unique_ptr<ReadQueue> Device::CreateReadQueue(unsigned int depth)
+{
+	if (SupportsConcurrentReads())
+		return std::unique_ptr<ReadQueue>(new ThreadedReadQueue(*this, depth));
+	else
+		return std::unique_ptr<ReadQueue>(new SyncReadQueue(*this, depth));
+}
+
+bool Device::ReadV(const ReadSegment *segs, size_t cnt)
+{
+	struct Pending
+	{
+		std::mutex mutex;
+		std::condition_variable cv;
+		size_t cnt;
+		bool ok;
+	};
+
+	std::vector<ReadSegment> sorted(segs, segs + cnt);
+	std::vector<size_t> group_start;
+	Pending pending;
+	uint64_t group_len = 0;
+	size_t k;
+	bool ok;
+
+	if (cnt == 0)
+		return true;
+
+	std::sort(sorted.begin(), sorted.end(), [](const ReadSegment &a, const ReadSegment &b) { return a.offs < b.offs; });
+
+	for (k = 0; k < sorted.size(); k++)
+	{
+		if (k == 0 || sorted[k].offs != sorted[k - 1].offs + sorted[k - 1].len ||
+			group_len + sorted[k].len > READV_MAX_MERGE || k - group_start.back() == READV_MAX_SEGMENTS)
+		{
+			group_start.push_back(k);
+			group_len = 0;
+		}
+		group_len += sorted[k].len;
+	}
+	group_start.push_back(sorted.size());
+
+	if (group_start.size() == 2 || !SupportsConcurrentReads())
+	{
+		ok = true;
+		for (k = 0; k + 1 < group_start.size(); k++)
+			ok = ReadAdjacent(sorted.data() + group_start[k], group_start[k + 1] - group_start[k]) && ok;
+		return ok;
+	}
+
+	// The first group is read on this thread.
+	pending.cnt = group_start.size() - 2;
+	pending.ok = true;
+
+	for (k = 1; k + 1 < group_start.size(); k++)
+	{
+		const ReadSegment *first = sorted.data() + group_start[k];
+		size_t n = group_start[k + 1] - group_start[k];
+		std::function<void()> task = [this, &pending, first, n]() {
+			bool rc = ReadAdjacent(first, n);
+
+			std::lock_guard<std::mutex> lock(pending.mutex);
+			pending.ok = pending.ok && rc;
+			if (--pending.cnt == 0)
+				pending.cv.notify_all();
+		};
+
+		if (!m_io_pool.Submit(task))
+			task();
+	}
+
+	ok = ReadAdjacent(sorted.data(), group_start[1]);
+
+	std::unique_lock<std::mutex> lock(pending.mutex);
+
+	while (pending.cnt > 0)
+		pending.cv.wait(lock);
+
+	return ok && pending.ok;
+}
+
+bool Device::ReadAdjacent(const ReadSegment *segs, size_t cnt)
+{
+	std::vector<uint8_t> bounce;
+	uint64_t len = 0;
+	uint64_t pos;
+	size_t k;
+	bool contiguous = true;
+
+	for (k = 0; k < cnt; k++)
+	{
+		if (k > 0 && segs[k].data != static_cast<uint8_t *>(segs[k - 1].data) + segs[k - 1].len)
+			contiguous = false;
+		len += segs[k].len;
+	}
+
+	if (contiguous)
+		return Read(segs[0].data, segs[0].offs, len);
+
+	bounce.resize(len);
+
+	if (!Read(bounce.data(), segs[0].offs, len))
+		return false;
+
+	pos = 0;
+	for (k = 0; k < cnt; k++)
+	{
+		memcpy(segs[k].data, bounce.data() + pos, segs[k].len);
+		pos += segs[k].len;
+	}
+
+	return true;
+}
+
 Device * Device::OpenDevice(const char * name)
 {
 	Device *dev = nullptr;
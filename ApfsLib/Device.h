@@ -19,7 +19,74 @@
 
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <utility>
+
+#include "ThreadPool.h"
+
+struct DeviceStats
+{
+	uint64_t read_ops;
+	uint64_t read_bytes;
+	uint64_t read_nsec;
+};
+
+class Device;
+
+// One piece of a vectored read, len bytes at offs into data.
+struct ReadSegment
+{
+	uint64_t offs;
+	uint64_t len;
+	void *data;
+};
+
+// Completion queue for asynchronous reads. Every user creates its own queue
+// with Device::CreateReadQueue, so completions of different users don't get
+// mixed up. A queue must only be used by one thread at a time.
+class ReadQueue
+{
+public:
+	virtual ~ReadQueue();
+
+	ReadQueue(const ReadQueue &o) = delete;
+	ReadQueue &operator=(const ReadQueue &o) = delete;
+
+	// Queues a read of len bytes at offs into data. The buffer must stay
+	// valid until Wait has returned tag. If the queue is full, this first
+	// waits for one of the queued reads.
+	void Submit(void *data, uint64_t offs, uint64_t len, uint64_t tag);
+	// Adds the completion of a read that was done elsewhere.
+	void Complete(uint64_t tag, bool ok);
+	// Waits for one of the queued reads. Returns false if there is none.
+	bool Wait(uint64_t &tag, bool &ok);
+	// Waits for all queued reads, returns false if any of them failed.
+	bool WaitAll();
+
+	unsigned int GetDepth() const { return m_depth; }
+
+protected:
+	ReadQueue(Device &dev, unsigned int depth);
+
+	// Queue is only called if less than depth reads are in flight, Reap only
+	// if there is at least one.
+	virtual void Queue(void *data, uint64_t offs, uint64_t len, uint64_t tag) = 0;
+	virtual void Reap(uint64_t &tag, bool &ok) = 0;
+	// Must be called by the destructors of the backends, the buffers may be
+	// gone as soon as the queue is.
+	void Drain();
+
+	Device &m_dev;
+
+private:
+	const unsigned int m_depth;
+	unsigned int m_in_flight;
+	std::deque<std::pair<uint64_t, bool>> m_done;
+};
 
 class Device
 {
@@ -35,11 +102,49 @@ public:
 	virtual bool Read(void *data, uint64_t offs, uint64_t len) = 0;
 	virtual uint64_t GetSize() const = 0;
 
+	// True if Read may be called from several threads at once.
+	virtual bool SupportsConcurrentReads() const { return false; }
+
+	// Creates a queue for up to depth reads in flight. The default runs the
+	// reads on the I/O threads of the device if it supports concurrent reads,
+	// and right away in Submit otherwise, so callers have to serialize Submit
+	// like Read then.
+	virtual std::unique_ptr<ReadQueue> CreateReadQueue(unsigned int depth);
+
+	// Reads all segments, returns false if any of them failed. Segments that
+	// are adjacent on the device are read together by ReadAdjacent. If the
+	// device supports concurrent reads, the merged reads run in parallel on
+	// the I/O threads.
+	virtual bool ReadV(const ReadSegment *segs, size_t cnt);
+
 	unsigned int GetSectorSize() const { return m_sector_size; }
 	void SetSectorSize(unsigned int size) { m_sector_size = size; }
 
+	// Reads are accounted by the caller, so the backends don't need to care.
+	void AccountRead(uint64_t bytes, uint64_t nsec);
+	void GetStats(DeviceStats &st) const;
+
 	static Device *OpenDevice(const char *name);
 
+	// Threads for the reads of the default ReadQueue and of ReadV.
+	static constexpr unsigned int IO_THREADS = 8;
+	// Limits of the reads merged by ReadV.
+	static constexpr uint64_t READV_MAX_MERGE = 1024 * 1024;
+	static constexpr size_t READV_MAX_SEGMENTS = 256;
+
+protected:
+	// Reads segments that follow each other on the device, in that order.
+	// The default does it with one Read, through a bounce buffer if the
+	// segments are not contiguous in memory.
+	virtual bool ReadAdjacent(const ReadSegment *segs, size_t cnt);
+
 private:
+	friend class ThreadedReadQueue;
+
 	unsigned int m_sector_size;
+	ThreadPool m_io_pool;
+
+	std::atomic<uint64_t> m_read_ops;
+	std::atomic<uint64_t> m_read_bytes;
+	std::atomic<uint64_t> m_read_nsec;
 };
@@ -21,17 +21,250 @@ along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h>
 #include <linux/fs.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
 #include <iostream>
+#include <vector>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
 
 #include "DeviceLinux.h"
 #include "Global.h"
 
+#ifdef HAVE_IO_URING
+
+// Queue on an io_uring of its own. The rings are set up with the raw system
+// calls, so that there is no dependency on liburing.
+class UringReadQueue : public ReadQueue
+{
+public:
+	UringReadQueue(DeviceLinux &dev, int fd, unsigned int depth);
+	~UringReadQueue();
+
+	bool Init();
+
+protected:
+	void Queue(void *data, uint64_t offs, uint64_t len, uint64_t tag) override;
+	void Reap(uint64_t &tag, bool &ok) override;
+
+private:
+	struct Slot
+	{
+		struct iovec iov;
+		uint64_t offs;
+		uint64_t tag;
+		std::chrono::steady_clock::time_point start;
+	};
+
+	int m_fd;
+	int m_ring;
+
+	void *m_sq_ptr;
+	size_t m_sq_size;
+	void *m_cq_ptr;
+	size_t m_cq_size;
+	struct io_uring_sqe *m_sqes;
+	size_t m_sqes_size;
+
+	uint32_t *m_sq_tail;
+	uint32_t m_sq_mask;
+	uint32_t *m_sq_array;
+	uint32_t *m_cq_head;
+	uint32_t *m_cq_tail;
+	uint32_t m_cq_mask;
+	struct io_uring_cqe *m_cqes;
+
+	std::vector<Slot> m_slots;
+	std::vector<uint32_t> m_free_slots;
+	// Reads that had to be done synchronously.
+	std::deque<std::pair<uint64_t, bool>> m_completed;
+};
+
+UringReadQueue::UringReadQueue(DeviceLinux &dev, int fd, unsigned int depth) : ReadQueue(dev, depth)
+{
+	m_fd = fd;
+	m_ring = -1;
+	m_sq_ptr = MAP_FAILED;
+	m_sq_size = 0;
+	m_cq_ptr = MAP_FAILED;
+	m_cq_size = 0;
+	m_sqes = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+	m_sqes_size = 0;
+}
+
+UringReadQueue::~UringReadQueue()
+{
+	if (m_ring != -1)
+		Drain();
+
+	if (m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqes_size);
+	if (m_cq_ptr != MAP_FAILED)
+		munmap(m_cq_ptr, m_cq_size);
+	if (m_sq_ptr != MAP_FAILED)
+		munmap(m_sq_ptr, m_sq_size);
+	if (m_ring != -1)
+		close(m_ring);
+}
+
+bool UringReadQueue::Init()
+{
+	struct io_uring_params p;
+	uint8_t *sq;
+	uint8_t *cq;
+	uint32_t k;
+
+	memset(&p, 0, sizeof(p));
+
+	// Fails with ENOSYS on old kernels and EPERM in some sandboxes.
+	m_ring = static_cast<int>(syscall(__NR_io_uring_setup, GetDepth(), &p));
+	if (m_ring == -1)
+		return false;
+
+	m_sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	m_sq_ptr = mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQ_RING);
+	m_cq_ptr = mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_CQ_RING);
+	m_sqes = static_cast<struct io_uring_sqe *>(mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQES));
+
+	if (m_sq_ptr == MAP_FAILED || m_cq_ptr == MAP_FAILED || m_sqes == MAP_FAILED)
+		return false;
+
+	sq = static_cast<uint8_t *>(m_sq_ptr);
+	cq = static_cast<uint8_t *>(m_cq_ptr);
+
+	m_sq_tail = reinterpret_cast<uint32_t *>(sq + p.sq_off.tail);
+	m_sq_mask = *reinterpret_cast<uint32_t *>(sq + p.sq_off.ring_mask);
+	m_sq_array = reinterpret_cast<uint32_t *>(sq + p.sq_off.array);
+	m_cq_head = reinterpret_cast<uint32_t *>(cq + p.cq_off.head);
+	m_cq_tail = reinterpret_cast<uint32_t *>(cq + p.cq_off.tail);
+	m_cq_mask = *reinterpret_cast<uint32_t *>(cq + p.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+
+	// The kernel may round up the number of entries, but the base class
+	// never has more than depth reads in flight.
+	m_slots.resize(GetDepth());
+	m_free_slots.resize(GetDepth());
+	for (k = 0; k < GetDepth(); k++)
+		m_free_slots[k] = GetDepth() - 1 - k;
+
+	return true;
+}
+
+void UringReadQueue::Queue(void *data, uint64_t offs, uint64_t len, uint64_t tag)
+{
+	uint32_t tail;
+	uint32_t slot_idx;
+	struct io_uring_sqe *sqe;
+	int rc;
+
+	slot_idx = m_free_slots.back();
+	m_free_slots.pop_back();
+
+	Slot &slot = m_slots[slot_idx];
+	slot.iov.iov_base = data;
+	slot.iov.iov_len = len;
+	slot.offs = offs;
+	slot.tag = tag;
+	slot.start = std::chrono::steady_clock::now();
+
+	// Only this thread writes the tail, the kernel only reads it.
+	tail = *m_sq_tail;
+	sqe = m_sqes + (tail & m_sq_mask);
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = m_fd;
+	sqe->off = offs;
+	sqe->addr = reinterpret_cast<uint64_t>(&slot.iov);
+	sqe->len = 1;
+	sqe->user_data = slot_idx;
+
+	m_sq_array[tail & m_sq_mask] = tail & m_sq_mask;
+	__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do
+	{
+		rc = static_cast<int>(syscall(__NR_io_uring_enter, m_ring, 1, 0, 0, nullptr, 0));
+	} while (rc == -1 && errno == EINTR);
+
+	if (rc != 1)
+	{
+		// The kernel didn't take the entry. It only looks at the tail in
+		// io_uring_enter, so the entry can be taken back and read here.
+		__atomic_store_n(m_sq_tail, tail, __ATOMIC_RELEASE);
+		m_free_slots.push_back(slot_idx);
+
+		auto start = std::chrono::steady_clock::now();
+		bool ok = m_dev.Read(data, offs, len);
+
+		m_dev.AccountRead(len, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		m_completed.push_back(std::make_pair(tag, ok));
+	}
+}
+
+void UringReadQueue::Reap(uint64_t &tag, bool &ok)
+{
+	uint32_t head;
+	uint32_t slot_idx;
+	int32_t res;
+	int rc;
+
+	if (!m_completed.empty())
+	{
+		tag = m_completed.front().first;
+		ok = m_completed.front().second;
+		m_completed.pop_front();
+		return;
+	}
+
+	head = *m_cq_head;
+
+	while (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+	{
+		rc = static_cast<int>(syscall(__NR_io_uring_enter, m_ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+		if (rc == -1 && errno != EINTR)
+		{
+			// Can't wait on the ring any more, but the reads are still
+			// pointing into the buffers.
+			std::cerr << "io_uring_enter failed with error " << strerror(errno) << std::endl;
+			abort();
+		}
+	}
+
+	slot_idx = static_cast<uint32_t>(m_cqes[head & m_cq_mask].user_data);
+	res = m_cqes[head & m_cq_mask].res;
+	__atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+
+	Slot &slot = m_slots[slot_idx];
+	tag = slot.tag;
+
+	// Short reads only happen at the end of the device or on signals.
+	if (res >= 0 && static_cast<uint64_t>(res) < slot.iov.iov_len)
+		ok = m_dev.Read(static_cast<uint8_t *>(slot.iov.iov_base) + res, slot.offs + res, slot.iov.iov_len - res);
+	else
+		ok = res >= 0;
+
+	m_dev.AccountRead(slot.iov.iov_len, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - slot.start).count());
+	m_free_slots.push_back(slot_idx);
+}
+
+#endif
+
 DeviceLinux::DeviceLinux()
 {
 	m_device = -1;
@@ -81,6 +314,66 @@ void DeviceLinux::Close()
 	m_size = 0;
 }
 
+std::unique_ptr<ReadQueue> DeviceLinux::CreateReadQueue(unsigned int depth)
+{
+#ifdef HAVE_IO_URING
+	std::unique_ptr<UringReadQueue> queue(new UringReadQueue(*this, m_device, depth));
+
+	if (queue->Init())
+		return std::unique_ptr<ReadQueue>(queue.release());
+#endif
+
+	return Device::CreateReadQueue(depth);
+}
+
+bool DeviceLinux::ReadAdjacent(const ReadSegment *segs, size_t cnt)
+{
+	std::vector<struct iovec> iov(cnt);
+	struct iovec *cur;
+	uint64_t offs;
+	ssize_t nread;
+	size_t left;
+	size_t k;
+
+	for (k = 0; k < cnt; k++)
+	{
+		iov[k].iov_base = segs[k].data;
+		iov[k].iov_len = segs[k].len;
+	}
+
+	cur = iov.data();
+	left = cnt;
+	offs = segs[0].offs;
+
+	while (left > 0)
+	{
+		nread = preadv64(m_device, cur, static_cast<int>(left), offs);
+
+		if (nread < 0 && errno == EINTR)
+			continue;
+		if (nread <= 0)
+			return false;
+
+		offs += nread;
+
+		// Skip what has been read, in case the read was short.
+		while (left > 0 && static_cast<size_t>(nread) >= cur->iov_len)
+		{
+			nread -= cur->iov_len;
+			cur++;
+			left--;
+		}
+
+		if (left > 0)
+		{
+			cur->iov_base = static_cast<uint8_t *>(cur->iov_base) + nread;
+			cur->iov_len -= nread;
+		}
+	}
+
+	return true;
+}
+
 bool DeviceLinux::Read(void* data, uint64_t offs, uint64_t len)
 {
 	size_t nread;
@@ -36,6 +36,13 @@ public:
 	bool Read(void *data, uint64_t offs, uint64_t len) override;
 
 	uint64_t GetSize() const override { return m_size; }
+	bool SupportsConcurrentReads() const override { return true; }
+	// Uses an io_uring if the kernel allows it, the I/O threads otherwise.
+	std::unique_ptr<ReadQueue> CreateReadQueue(unsigned int depth) override;
+
+protected:
+	// One preadv, straight into the segments.
+	bool ReadAdjacent(const ReadSegment *segs, size_t cnt) override;
 
 private:
 	int m_device;
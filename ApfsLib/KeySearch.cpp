@@ -0,0 +1,195 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "KeySearch.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KEYSEARCH_X86
+#include <immintrin.h>
+#endif
+
+typedef size_t(*CountLessFunc)(const uint64_t *v, size_t n, uint64_t key);
+
+// Entries left for the final linear compare. Four AVX2 compares.
+constexpr size_t SEARCH_WINDOW = 16;
+
+static size_t CountLessScalar(const uint64_t *v, size_t n, uint64_t key)
+{
+	size_t cnt = 0;
+	size_t k;
+
+	for (k = 0; k < n; k++)
+		cnt += (v[k] < key) ? 1 : 0;
+
+	return cnt;
+}
+
+#ifdef KEYSEARCH_X86
+// There are only signed 64 bit compares, so both sides get the sign bit
+// flipped first.
+__attribute__((target("sse4.2,popcnt")))
+static size_t CountLessSSE42(const uint64_t *v, size_t n, uint64_t key)
+{
+	const __m128i bias = _mm_set1_epi64x(INT64_MIN);
+	const __m128i k = _mm_xor_si128(_mm_set1_epi64x(static_cast<int64_t>(key)), bias);
+	size_t cnt = 0;
+	size_t i;
+
+	for (i = 0; i + 2 <= n; i += 2)
+	{
+		__m128i x = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(v + i)), bias);
+		__m128i lt = _mm_cmpgt_epi64(k, x);
+		cnt += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(lt)));
+	}
+
+	for (; i < n; i++)
+		cnt += (v[i] < key) ? 1 : 0;
+
+	return cnt;
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t CountLessAVX2(const uint64_t *v, size_t n, uint64_t key)
+{
+	const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+	const __m256i k = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<int64_t>(key)), bias);
+	size_t cnt = 0;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+	{
+		__m256i x = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(v + i)), bias);
+		__m256i lt = _mm256_cmpgt_epi64(k, x);
+		cnt += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
+	}
+
+	for (; i < n; i++)
+		cnt += (v[i] < key) ? 1 : 0;
+
+	return cnt;
+}
+#endif
+
+static bool ImplSupported(KeySearchImpl impl)
+{
+	switch (impl)
+	{
+	case KeySearchImpl::Scalar:
+		return true;
+#ifdef KEYSEARCH_X86
+	case KeySearchImpl::SSE42:
+		return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+	case KeySearchImpl::AVX2:
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+#endif
+	default:
+		return false;
+	}
+}
+
+static KeySearchImpl SelectImpl()
+{
+	if (ImplSupported(KeySearchImpl::AVX2))
+		return KeySearchImpl::AVX2;
+	if (ImplSupported(KeySearchImpl::SSE42))
+		return KeySearchImpl::SSE42;
+	return KeySearchImpl::Scalar;
+}
+
+static CountLessFunc GetCountLess(KeySearchImpl impl)
+{
+	switch (impl)
+	{
+#ifdef KEYSEARCH_X86
+	case KeySearchImpl::SSE42:
+		return CountLessSSE42;
+	case KeySearchImpl::AVX2:
+		return CountLessAVX2;
+#endif
+	default:
+		return CountLessScalar;
+	}
+}
+
+static KeySearchImpl s_impl = SelectImpl();
+static CountLessFunc s_count_less = GetCountLess(s_impl);
+
+size_t LowerBound64(const uint64_t *v, size_t n, uint64_t key)
+{
+	const uint64_t *base = v;
+	size_t half;
+
+	// Everything before base is < key, the result is in [base, base + n].
+	while (n > SEARCH_WINDOW)
+	{
+		half = n / 2;
+		base = (base[half] < key) ? (base + half) : base;
+		n -= half;
+	}
+
+	// Not worth an indirect call.
+	if (n <= 2)
+		return (base - v) + CountLessScalar(base, n, key);
+
+	return (base - v) + s_count_less(base, n, key);
+}
+
+size_t UpperBound64(const uint64_t *v, size_t n, uint64_t key)
+{
+	if (key == UINT64_MAX)
+		return n;
+
+	return LowerBound64(v, n, key + 1);
+}
+
+size_t SkipEqual64(const uint64_t *v, size_t n, uint64_t key)
+{
+	size_t bound = 1;
+	size_t lo;
+	size_t hi;
+
+	if (n == 0 || v[0] != key)
+		return 0;
+
+	while (bound < n && v[bound] == key)
+		bound *= 2;
+
+	// v[bound / 2] == key, the end is in (bound / 2, min(bound, n)].
+	lo = bound / 2 + 1;
+	hi = (bound < n) ? bound : n;
+
+	return lo + UpperBound64(v + lo, hi - lo, key);
+}
+
+KeySearchImpl GetKeySearchImpl()
+{
+	return s_impl;
+}
+
+bool SetKeySearchImpl(KeySearchImpl impl)
+{
+	if (!ImplSupported(impl))
+		return false;
+
+	s_impl = impl;
+	s_count_less = GetCountLess(impl);
+
+	return true;
+}
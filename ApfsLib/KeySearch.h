@@ -0,0 +1,49 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+enum class KeySearchImpl
+{
+	Scalar,
+	SSE42,
+	AVX2
+};
+
+// Searches in sorted arrays of 64 bit keys, like the key index of the
+// B-tree nodes. The range is narrowed down by a branch-free binary search
+// first, the last few entries are then compared at once with SIMD
+// instructions, if the CPU has them. The implementation is chosen at
+// startup.
+
+// Index of the first entry >= key.
+size_t LowerBound64(const uint64_t *v, size_t n, uint64_t key);
+// Index of the first entry > key.
+size_t UpperBound64(const uint64_t *v, size_t n, uint64_t key);
+// Same as UpperBound64, if v starts with the first entry >= key. Faster
+// when there are only a few entries equal to key.
+size_t SkipEqual64(const uint64_t *v, size_t n, uint64_t key);
+
+KeySearchImpl GetKeySearchImpl();
+// Mainly for benchmarks. Returns false if the CPU doesn't support impl.
+bool SetKeySearchImpl(KeySearchImpl impl);
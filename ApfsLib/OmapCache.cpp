@@ -0,0 +1,184 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "OmapCache.h"
+
+OmapCache::OmapCache() : m_slot_cnt(0), m_mask(0), m_hits(0), m_misses(0), m_evictions(0)
+{
+}
+
+OmapCache::~OmapCache()
+{
+}
+
+void OmapCache::SetSize(size_t bytes)
+{
+	size_t cnt = BUCKET_SIZE;
+
+	m_slots.reset();
+	m_slot_cnt = 0;
+	m_mask = 0;
+
+	if (bytes < BUCKET_SIZE * sizeof(Slot))
+		return;
+
+	while (cnt * 2 * sizeof(Slot) <= bytes)
+		cnt *= 2;
+
+	m_slots.reset(new Slot[cnt]);
+	m_slot_cnt = cnt;
+	m_mask = cnt - 1;
+
+	Clear();
+}
+
+bool OmapCache::Get(omap_res_t &res, oid_t oid, xid_t xid)
+{
+	uint64_t seq;
+	uint64_t flags_size;
+	size_t base;
+	size_t k;
+
+	if (m_slot_cnt == 0)
+		return false;
+
+	base = Hash(oid, xid) & m_mask & ~(BUCKET_SIZE - 1);
+
+	for (k = 0; k < BUCKET_SIZE; k++)
+	{
+		Slot &s = m_slots[base + k];
+
+		seq = s.seq.load(std::memory_order_acquire);
+		if (seq & 1)
+			continue;
+
+		if (s.oid.load(std::memory_order_relaxed) != oid || s.xid.load(std::memory_order_relaxed) != xid)
+			continue;
+
+		res.oid = oid;
+		res.xid = s.res_xid.load(std::memory_order_relaxed);
+		res.paddr = s.paddr.load(std::memory_order_relaxed);
+		flags_size = s.flags_size.load(std::memory_order_relaxed);
+		res.flags = static_cast<uint32_t>(flags_size >> 32);
+		res.size = static_cast<uint32_t>(flags_size);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if (s.seq.load(std::memory_order_relaxed) != seq)
+			break;
+
+		m_hits.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	m_misses.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+void OmapCache::Put(const omap_res_t &res, oid_t oid, xid_t xid)
+{
+	uint64_t hash;
+	uint64_t seq;
+	uint64_t cur_oid;
+	size_t base;
+	size_t victim;
+	size_t k;
+
+	if (m_slot_cnt == 0 || oid == 0)
+		return;
+
+	hash = Hash(oid, xid);
+	base = hash & m_mask & ~(BUCKET_SIZE - 1);
+
+	// The slot holding the same key, or a free one, or else one picked by
+	// the upper hash bits and the eviction count, which is random enough to
+	// not always throw out the same entry.
+	victim = BUCKET_SIZE;
+
+	for (k = 0; k < BUCKET_SIZE; k++)
+	{
+		cur_oid = m_slots[base + k].oid.load(std::memory_order_relaxed);
+
+		if (cur_oid == oid && m_slots[base + k].xid.load(std::memory_order_relaxed) == xid)
+		{
+			victim = k;
+			break;
+		}
+
+		if (cur_oid == 0 && victim == BUCKET_SIZE)
+			victim = k;
+	}
+
+	if (victim == BUCKET_SIZE)
+	{
+		victim = ((hash >> 32) + m_evictions.load(std::memory_order_relaxed)) & (BUCKET_SIZE - 1);
+		m_evictions.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	Slot &s = m_slots[base + victim];
+
+	seq = s.seq.load(std::memory_order_relaxed);
+	if (seq & 1)
+		return;
+	if (!s.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_relaxed))
+		return;
+	std::atomic_thread_fence(std::memory_order_release);
+
+	s.oid.store(oid, std::memory_order_relaxed);
+	s.xid.store(xid, std::memory_order_relaxed);
+	s.res_xid.store(res.xid, std::memory_order_relaxed);
+	s.paddr.store(res.paddr, std::memory_order_relaxed);
+	s.flags_size.store((static_cast<uint64_t>(res.flags) << 32) | res.size, std::memory_order_relaxed);
+
+	s.seq.store(seq + 2, std::memory_order_release);
+}
+
+void OmapCache::Clear()
+{
+	size_t k;
+
+	for (k = 0; k < m_slot_cnt; k++)
+	{
+		m_slots[k].seq.store(0, std::memory_order_relaxed);
+		m_slots[k].oid.store(0, std::memory_order_relaxed);
+		m_slots[k].xid.store(0, std::memory_order_relaxed);
+		m_slots[k].res_xid.store(0, std::memory_order_relaxed);
+		m_slots[k].paddr.store(0, std::memory_order_relaxed);
+		m_slots[k].flags_size.store(0, std::memory_order_relaxed);
+	}
+}
+
+void OmapCache::GetStats(CacheStats &st) const
+{
+	size_t k;
+
+	st.hits = m_hits.load(std::memory_order_relaxed);
+	st.misses = m_misses.load(std::memory_order_relaxed);
+	st.evictions = m_evictions.load(std::memory_order_relaxed);
+	st.entries = 0;
+	st.capacity = m_slot_cnt;
+	st.pinned = 0;
+
+	for (k = 0; k < m_slot_cnt; k++)
+	{
+		if (m_slots[k].oid.load(std::memory_order_relaxed) != 0)
+			st.entries++;
+	}
+}
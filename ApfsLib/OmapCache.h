@@ -0,0 +1,81 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+
+#include "ApfsNodeMapper.h"
+#include "ClockCache.h"
+
+// Cache of omap translations, (oid, xid) => omap_res_t, so that loading a
+// node of a virtual tree doesn't need a full descent of the omap tree each
+// time.
+//
+// The table is a flat array of slots in groups of BUCKET_SIZE, an entry can
+// be in any slot of the group its hash selects. Lookups don't take any
+// lock, every slot has a sequence counter, which is odd while the slot is
+// being written. A reader doesn't retry, a slot that changed under it is
+// just a miss. A writer that finds the slot busy doesn't store the entry.
+class OmapCache
+{
+	static constexpr size_t BUCKET_SIZE = 4;
+
+	struct Slot
+	{
+		std::atomic<uint64_t> seq;
+		std::atomic<uint64_t> oid;
+		std::atomic<uint64_t> xid;
+		std::atomic<uint64_t> res_xid;
+		std::atomic<uint64_t> paddr;
+		std::atomic<uint64_t> flags_size;
+	};
+
+public:
+	OmapCache();
+	~OmapCache();
+
+	OmapCache(const OmapCache &o) = delete;
+	OmapCache &operator=(const OmapCache &o) = delete;
+
+	// Must not be called while the cache is in use. 0 disables the cache.
+	void SetSize(size_t bytes);
+	size_t GetSize() const { return m_slot_cnt * sizeof(Slot); }
+
+	bool Get(omap_res_t &res, oid_t oid, xid_t xid);
+	void Put(const omap_res_t &res, oid_t oid, xid_t xid);
+	void Clear();
+
+	void GetStats(CacheStats &st) const;
+
+private:
+	static uint64_t Hash(oid_t oid, xid_t xid) { return (oid ^ (xid * 0xC2B2AE3D27D4EB4FULL)) * 0x9E3779B97F4A7C15ULL; }
+
+	std::unique_ptr<Slot[]> m_slots;
+	size_t m_slot_cnt;
+	size_t m_mask;
+
+	std::atomic<uint64_t> m_hits;
+	std::atomic<uint64_t> m_misses;
+	std::atomic<uint64_t> m_evictions;
+};
@@ -0,0 +1,299 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+#include "ReadAhead.h"
+#include "ApfsContainer.h"
+#include "ApfsDir.h"
+#include "ApfsVolume.h"
+
+constexpr uint64_t ReadAhead::CHUNK_SIZE;
+constexpr uint64_t ReadAhead::READAHEAD_MIN_WINDOW;
+constexpr uint64_t ReadAhead::READAHEAD_MAX_WINDOW;
+
+ReadAheadStream::ReadAheadStream(uint64_t private_id, uint64_t size) :
+	m_private_id(private_id),
+	m_size(size),
+	m_next_offs(0),
+	m_window(0),
+	m_ra_end(0),
+	m_generation(0)
+{
+}
+
+ReadAhead::ReadAhead(ApfsVolume &vol) :
+	m_vol(vol),
+	m_tasks(0),
+	m_stat_bytes(0),
+	m_stat_cancelled(0)
+{
+	m_pool.SetThreadCount(NX_READAHEAD_THREADS);
+}
+
+ReadAhead::~ReadAhead()
+{
+	Wait();
+}
+
+void ReadAhead::SetSize(size_t bytes)
+{
+	m_cache.SetCapacity(bytes / CHUNK_SIZE);
+}
+
+std::shared_ptr<ReadAheadStream> ReadAhead::Open(uint64_t private_id, uint64_t size) const
+{
+	return std::make_shared<ReadAheadStream>(private_id, size);
+}
+
+bool ReadAhead::Read(const std::shared_ptr<ReadAheadStream> &s, void *data, uint64_t offs, size_t size)
+{
+	std::shared_ptr<const Chunk> chunk;
+	uint8_t *bdata = reinterpret_cast<uint8_t *>(data);
+	uint64_t end = offs + size;
+	uint64_t ra_first = 0;
+	uint64_t ra_last = 0;
+	uint32_t generation;
+	bool seq;
+	uint64_t idx;
+	uint64_t chunk_offs;
+	uint64_t chunk_end;
+	uint64_t cur_size;
+
+	if (m_cache.GetCapacity() == 0 || size == 0)
+		return ApfsDir(m_vol).ReadFile(data, s->m_private_id, offs, size);
+
+	{
+		std::lock_guard<std::mutex> lock(s->m_mutex);
+
+		seq = (offs == s->m_next_offs);
+		s->m_next_offs = end;
+
+		if (seq)
+		{
+			s->m_window = s->m_window ? std::min(s->m_window * 2, READAHEAD_MAX_WINDOW) : READAHEAD_MIN_WINDOW;
+
+			// Queue the whole chunks behind this read up to the end of the
+			// window, unless they already are.
+			ra_first = std::max(s->m_ra_end, (end + CHUNK_SIZE - 1) / CHUNK_SIZE);
+			ra_last = (std::min(end + s->m_window, s->m_size) + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+			if (ra_last > ra_first)
+				s->m_ra_end = ra_last;
+		}
+		else
+		{
+			s->m_window = 0;
+			s->m_ra_end = 0;
+			s->Cancel();
+		}
+
+		generation = s->m_generation.load(std::memory_order_relaxed);
+	}
+
+	if (ra_last > ra_first)
+		Queue(s, generation, ra_first, ra_last);
+
+	// Don't let other readers of the stream wait for what was just cancelled.
+	if (!seq)
+	{
+		std::lock_guard<std::mutex> lock(m_pending_mutex);
+		m_pending_cv.notify_all();
+	}
+
+	for (idx = offs / CHUNK_SIZE; idx * CHUNK_SIZE < end; idx++)
+	{
+		if (!GetChunk(chunk, s->m_private_id, idx))
+		{
+			// Random reads only use what is already there.
+			if (!seq)
+				return ApfsDir(m_vol).ReadFile(data, s->m_private_id, offs, size);
+
+			if (!LoadChunks(s->m_private_id, s->m_size, idx, (end + CHUNK_SIZE - 1) / CHUNK_SIZE, &chunk))
+				return ApfsDir(m_vol).ReadFile(data, s->m_private_id, offs, size);
+		}
+
+		chunk_offs = std::max(offs, idx * CHUNK_SIZE) - idx * CHUNK_SIZE;
+		chunk_end = std::min(end, (idx + 1) * CHUNK_SIZE) - idx * CHUNK_SIZE;
+		cur_size = chunk_end - chunk_offs;
+
+		// The last chunk ends with the stream.
+		if (chunk_end > chunk->data.size())
+		{
+			memset(bdata, 0, cur_size);
+			if (chunk_offs < chunk->data.size())
+				memcpy(bdata, chunk->data.data() + chunk_offs, chunk->data.size() - chunk_offs);
+		}
+		else
+		{
+			memcpy(bdata, chunk->data.data() + chunk_offs, cur_size);
+		}
+
+		bdata += cur_size;
+	}
+
+	return true;
+}
+
+void ReadAhead::Wait()
+{
+	std::unique_lock<std::mutex> lock(m_pending_mutex);
+
+	while (m_tasks > 0)
+		m_pending_cv.wait(lock);
+}
+
+void ReadAhead::WriteStats(std::ostream &os, const char *name)
+{
+	CacheStats cs;
+
+	m_cache.GetStats(cs);
+
+	os << std::dec;
+	os << name << ".hits " << cs.hits << std::endl;
+	os << name << ".misses " << cs.misses << std::endl;
+	os << name << ".evictions " << cs.evictions << std::endl;
+	os << name << ".entries " << cs.entries << std::endl;
+	os << name << ".capacity " << cs.capacity << std::endl;
+	os << name << ".bytes " << m_stat_bytes.load(std::memory_order_relaxed) << std::endl;
+	os << name << ".cancelled " << m_stat_cancelled.load(std::memory_order_relaxed) << std::endl;
+}
+
+bool ReadAhead::GetChunk(std::shared_ptr<const Chunk> &chunk, uint64_t private_id, uint64_t idx)
+{
+	uint64_t key = ChunkKey(private_id, idx);
+
+	{
+		// Rather wait for a read-ahead that is on its way than read twice.
+		// Read-ahead of a cancelled generation may be a large read that isn't
+		// needed anymore, so the chunk is read right away instead.
+		std::unique_lock<std::mutex> lock(m_pending_mutex);
+
+		while (IsPending(key))
+			m_pending_cv.wait(lock);
+	}
+
+	if (!m_cache.Get(key, chunk))
+		return false;
+
+	return chunk->private_id == private_id && chunk->idx == idx;
+}
+
+bool ReadAhead::LoadChunks(uint64_t private_id, uint64_t size, uint64_t first, uint64_t last, std::shared_ptr<const Chunk> *chunk)
+{
+	std::vector<uint8_t> buf;
+	uint64_t offs = first * CHUNK_SIZE;
+	uint64_t end = std::min(last * CHUNK_SIZE, size);
+	uint64_t idx;
+
+	if (end <= offs)
+		return false;
+
+	// One read for all chunks, so that the device sees large requests.
+	buf.resize(end - offs);
+
+	if (!ApfsDir(m_vol).ReadFile(buf.data(), private_id, offs, buf.size()))
+		return false;
+
+	for (idx = first; idx < last && idx * CHUNK_SIZE < end; idx++)
+	{
+		std::shared_ptr<Chunk> c = std::make_shared<Chunk>();
+		uint64_t chunk_offs = idx * CHUNK_SIZE - offs;
+		uint64_t chunk_size = std::min(CHUNK_SIZE, end - idx * CHUNK_SIZE);
+
+		c->private_id = private_id;
+		c->idx = idx;
+		c->data.assign(buf.begin() + chunk_offs, buf.begin() + chunk_offs + chunk_size);
+
+		m_cache.Put(ChunkKey(private_id, idx), c);
+
+		if (chunk && idx == first)
+			*chunk = c;
+	}
+
+	return true;
+}
+
+bool ReadAhead::IsPending(uint64_t key) const
+{
+	auto range = m_pending.equal_range(key);
+
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		if (it->second.stream->m_generation.load(std::memory_order_relaxed) == it->second.generation)
+			return true;
+	}
+
+	return false;
+}
+
+void ReadAhead::Queue(const std::shared_ptr<ReadAheadStream> &s, uint32_t generation, uint64_t first, uint64_t last)
+{
+	uint64_t idx;
+
+	{
+		std::lock_guard<std::mutex> lock(m_pending_mutex);
+
+		for (idx = first; idx < last; idx++)
+			m_pending.insert(std::make_pair(ChunkKey(s->m_private_id, idx), Pending{ s.get(), generation }));
+		m_tasks++;
+	}
+
+	// No worker threads, no read-ahead.
+	if (!m_pool.Submit(std::bind(&ReadAhead::ReadAheadTask, this, s, generation, first, last)))
+		Unqueue(s, generation, first, last);
+}
+
+void ReadAhead::Unqueue(const std::shared_ptr<ReadAheadStream> &s, uint32_t generation, uint64_t first, uint64_t last)
+{
+	uint64_t idx;
+
+	// Notify under the lock, Wait() may destroy the object right after.
+	std::lock_guard<std::mutex> lock(m_pending_mutex);
+
+	for (idx = first; idx < last; idx++)
+	{
+		auto range = m_pending.equal_range(ChunkKey(s->m_private_id, idx));
+
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (it->second.stream == s.get() && it->second.generation == generation)
+			{
+				m_pending.erase(it);
+				break;
+			}
+		}
+	}
+
+	m_tasks--;
+	m_pending_cv.notify_all();
+}
+
+void ReadAhead::ReadAheadTask(std::shared_ptr<ReadAheadStream> s, uint32_t generation, uint64_t first, uint64_t last)
+{
+	if (s->m_generation.load(std::memory_order_relaxed) != generation)
+		m_stat_cancelled.fetch_add(1, std::memory_order_relaxed);
+	else if (LoadChunks(s->m_private_id, s->m_size, first, last, nullptr))
+		m_stat_bytes.fetch_add(std::min(last * CHUNK_SIZE, s->m_size) - first * CHUNK_SIZE, std::memory_order_relaxed);
+
+	Unqueue(s, generation, first, last);
+}
@@ -0,0 +1,134 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include "ClockCache.h"
+#include "ThreadPool.h"
+
+class ApfsVolume;
+
+// Read state of an open data stream.
+class ReadAheadStream
+{
+	friend class ReadAhead;
+
+public:
+	ReadAheadStream(uint64_t private_id, uint64_t size);
+
+	// Drops the queued read-ahead of the stream, e.g. when the file is closed.
+	void Cancel() { m_generation.fetch_add(1, std::memory_order_relaxed); }
+
+private:
+	std::mutex m_mutex;
+	const uint64_t m_private_id;
+	const uint64_t m_size;
+	uint64_t m_next_offs;
+	uint64_t m_window;
+	uint64_t m_ra_end;
+	std::atomic<uint32_t> m_generation;
+};
+
+// Sequential read-ahead of file data.
+//
+// As long as the reads of a stream continue where the previous one ended,
+// the window doubles from READAHEAD_MIN_WINDOW up to READAHEAD_MAX_WINDOW,
+// and the data in the window is read by a thread pool of its own, in one
+// large read per step, into a chunk cache of the volume. The metadata
+// prefetch of the container pool doesn't have to wait behind these reads. A read elsewhere
+// resets the window and cancels the queued read-ahead of the stream.
+class ReadAhead
+{
+public:
+	static constexpr uint64_t CHUNK_SIZE = 128 * 1024;
+	static constexpr uint64_t READAHEAD_MIN_WINDOW = 128 * 1024;
+	static constexpr uint64_t READAHEAD_MAX_WINDOW = 4 * 1024 * 1024;
+
+	ReadAhead(ApfsVolume &vol);
+	~ReadAhead();
+
+	ReadAhead(const ReadAhead &o) = delete;
+	ReadAhead &operator=(const ReadAhead &o) = delete;
+
+	// Budget of the chunk cache. Must not be called while the cache is in
+	// use. 0 disables read-ahead.
+	void SetSize(size_t bytes);
+	size_t GetSize() const { return m_cache.GetCapacity() * CHUNK_SIZE; }
+
+	std::shared_ptr<ReadAheadStream> Open(uint64_t private_id, uint64_t size) const;
+	// Same as ApfsDir::ReadFile, but goes through the chunk cache and
+	// starts the read-ahead if the stream is read sequentially.
+	bool Read(const std::shared_ptr<ReadAheadStream> &s, void *data, uint64_t offs, size_t size);
+
+	// Waits until all queued read-ahead has finished or been cancelled.
+	void Wait();
+
+	void WriteStats(std::ostream &os, const char *name);
+
+private:
+	struct Chunk
+	{
+		uint64_t private_id;
+		uint64_t idx;
+		std::vector<uint8_t> data;
+	};
+
+	// A chunk queued for read-ahead, for the generation of the stream it
+	// was queued with. The task holds a reference to the stream.
+	struct Pending
+	{
+		const ReadAheadStream *stream;
+		uint32_t generation;
+	};
+
+	static uint64_t ChunkKey(uint64_t private_id, uint64_t idx) { return private_id * 0xC2B2AE3D27D4EB4FULL + idx; }
+
+	bool GetChunk(std::shared_ptr<const Chunk> &chunk, uint64_t private_id, uint64_t idx);
+	bool LoadChunks(uint64_t private_id, uint64_t size, uint64_t first, uint64_t last, std::shared_ptr<const Chunk> *chunk);
+	bool IsPending(uint64_t key) const;
+	void Queue(const std::shared_ptr<ReadAheadStream> &s, uint32_t generation, uint64_t first, uint64_t last);
+	void Unqueue(const std::shared_ptr<ReadAheadStream> &s, uint32_t generation, uint64_t first, uint64_t last);
+	void ReadAheadTask(std::shared_ptr<ReadAheadStream> s, uint32_t generation, uint64_t first, uint64_t last);
+
+	ApfsVolume &m_vol;
+	ClockCache<std::shared_ptr<const Chunk>> m_cache;
+
+	// Chunks queued or being read by a task, by chunk key
+	std::mutex m_pending_mutex;
+	std::condition_variable m_pending_cv;
+	std::unordered_multimap<uint64_t, Pending> m_pending;
+	unsigned int m_tasks;
+
+	std::atomic<uint64_t> m_stat_bytes;
+	std::atomic<uint64_t> m_stat_cancelled;
+
+	// Declared last, so that the workers are gone before the rest.
+	ThreadPool m_pool;
+};
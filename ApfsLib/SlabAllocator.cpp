@@ -0,0 +1,193 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cassert>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "SlabAllocator.h"
+
+SlabAllocator::SlabAllocator()
+{
+	m_obj_size = 0;
+	m_objs_per_slab = 0;
+	m_data_offset = 0;
+	m_in_use = 0;
+	m_total = 0;
+	m_huge_pages = false;
+	m_have_huge_pages = false;
+}
+
+SlabAllocator::~SlabAllocator()
+{
+	size_t k;
+
+	assert(m_in_use == 0);
+
+	for (k = 0; k < m_slabs.size(); k++)
+		UnmapSlab(m_slabs[k]);
+	m_slabs.clear();
+	m_free.clear();
+}
+
+bool SlabAllocator::Init(size_t obj_size, bool huge_pages)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	size_t rounded = (obj_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+	// The objects are page-aligned, so any size that rounds the same way fits
+	// into the existing slabs.
+	if (!m_slabs.empty())
+		return obj_size != 0 && rounded == m_obj_size;
+
+	if (obj_size == 0 || obj_size > SLAB_SIZE / 2)
+		return false;
+
+	m_obj_size = rounded;
+	m_huge_pages = huge_pages;
+
+	// Layout of a slab: n headers, padding up to the next page, n buffers.
+	m_objs_per_slab = SLAB_SIZE / (m_obj_size + HEADER_SIZE);
+	m_data_offset = (m_objs_per_slab * HEADER_SIZE + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+	while (m_data_offset + m_objs_per_slab * m_obj_size > SLAB_SIZE)
+	{
+		m_objs_per_slab--;
+		m_data_offset = (m_objs_per_slab * HEADER_SIZE + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	}
+
+	return true;
+}
+
+void *SlabAllocator::Alloc(uint8_t *&data)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	FreeObj obj;
+
+	if (m_free.empty() && !AddSlab())
+	{
+		data = nullptr;
+		return nullptr;
+	}
+
+	obj = m_free.back();
+	m_free.pop_back();
+	m_in_use++;
+
+	data = obj.data;
+	return obj.hdr;
+}
+
+void SlabAllocator::Free(void *hdr, uint8_t *data)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	FreeObj obj;
+
+	obj.hdr = hdr;
+	obj.data = data;
+
+	m_free.push_back(obj);
+	m_in_use--;
+}
+
+void SlabAllocator::GetStats(SlabStats &st)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	st.slabs = m_slabs.size();
+	st.slab_size = SLAB_SIZE;
+	st.objs_in_use = m_in_use;
+	st.objs_total = m_total;
+	st.huge_pages = m_have_huge_pages;
+}
+
+bool SlabAllocator::AddSlab()
+{
+	uint8_t *base;
+	size_t k;
+	FreeObj obj;
+
+	if (m_objs_per_slab == 0)
+		return false;
+
+	base = MapSlab();
+	if (!base)
+		return false;
+
+	m_slabs.push_back(base);
+	m_free.reserve(m_free.size() + m_objs_per_slab);
+
+	// Hand out the objects in ascending order.
+	for (k = m_objs_per_slab; k > 0; k--)
+	{
+		obj.hdr = base + (k - 1) * HEADER_SIZE;
+		obj.data = base + m_data_offset + (k - 1) * m_obj_size;
+		m_free.push_back(obj);
+	}
+
+	m_total += m_objs_per_slab;
+
+	return true;
+}
+
+uint8_t *SlabAllocator::MapSlab()
+{
+#ifdef _WIN32
+	return reinterpret_cast<uint8_t *>(_aligned_malloc(SLAB_SIZE, PAGE_SIZE));
+#else
+	void *mem;
+
+#ifdef MAP_HUGETLB
+	if (m_huge_pages)
+	{
+		mem = mmap(nullptr, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED)
+		{
+			m_have_huge_pages = true;
+			return reinterpret_cast<uint8_t *>(mem);
+		}
+	}
+#endif
+
+	mem = mmap(nullptr, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return nullptr;
+
+#ifdef MADV_HUGEPAGE
+	// No reserved huge pages, let the kernel try transparent huge pages instead.
+	if (m_huge_pages)
+		madvise(mem, SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+
+	return reinterpret_cast<uint8_t *>(mem);
+#endif
+}
+
+void SlabAllocator::UnmapSlab(uint8_t *base)
+{
+#ifdef _WIN32
+	_aligned_free(base);
+#else
+	munmap(base, SLAB_SIZE);
+#endif
+}
@@ -0,0 +1,88 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+struct SlabStats
+{
+	uint64_t slabs;
+	uint64_t slab_size;
+	uint64_t objs_in_use;
+	uint64_t objs_total;
+	bool huge_pages;
+};
+
+// Allocator for fixed-size, page-aligned buffers. Every buffer comes with a
+// small header, which is stored in the same slab, in a separate array at the
+// start, so that the buffers themselves stay page-aligned.
+// Slabs are kept until the allocator is destroyed, so memory handed out once
+// always stays valid memory of the same type.
+class SlabAllocator
+{
+public:
+	static constexpr size_t SLAB_SIZE = 2 * 1024 * 1024;
+	static constexpr size_t HEADER_SIZE = 64;
+	static constexpr size_t PAGE_SIZE = 4096;
+
+	SlabAllocator();
+	~SlabAllocator();
+
+	SlabAllocator(const SlabAllocator &o) = delete;
+	SlabAllocator &operator=(const SlabAllocator &o) = delete;
+
+	// Can only be changed as long as no slabs have been allocated.
+	bool Init(size_t obj_size, bool huge_pages = false);
+
+	// Returns the header of a free object, and the corresponding buffer in data.
+	void *Alloc(uint8_t *&data);
+	void Free(void *hdr, uint8_t *data);
+
+	size_t GetObjSize() const { return m_obj_size; }
+
+	void GetStats(SlabStats &st);
+
+private:
+	struct FreeObj
+	{
+		void *hdr;
+		uint8_t *data;
+	};
+
+	bool AddSlab();
+	uint8_t *MapSlab();
+	void UnmapSlab(uint8_t *base);
+
+	std::mutex m_mutex;
+	std::vector<uint8_t *> m_slabs;
+	std::vector<FreeObj> m_free;
+
+	size_t m_obj_size;
+	size_t m_objs_per_slab;
+	size_t m_data_offset;
+	size_t m_in_use;
+	size_t m_total;
+
+	bool m_huge_pages;
+	bool m_have_huge_pages;
+};
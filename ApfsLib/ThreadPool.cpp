@@ -0,0 +1,96 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool()
+{
+	m_thread_cnt = 0;
+	m_stop = false;
+}
+
+ThreadPool::~ThreadPool()
+{
+	Stop();
+}
+
+void ThreadPool::SetThreadCount(unsigned int threads)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_threads.empty())
+		m_thread_cnt = threads;
+}
+
+void ThreadPool::Stop()
+{
+	size_t k;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cv.notify_all();
+
+	// Pending tasks are still run, their owners may be waiting for them.
+	for (k = 0; k < m_threads.size(); k++)
+		m_threads[k].join();
+	m_threads.clear();
+}
+
+bool ThreadPool::Submit(const std::function<void()> &task)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_stop || m_thread_cnt == 0)
+			return false;
+
+		while (m_threads.size() < m_thread_cnt)
+			m_threads.emplace_back(&ThreadPool::Worker, this);
+
+		m_queue.push_back(task);
+	}
+	m_cv.notify_one();
+
+	return true;
+}
+
+void ThreadPool::Worker()
+{
+	std::function<void()> task;
+
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			while (!m_stop && m_queue.empty())
+				m_cv.wait(lock);
+
+			if (m_queue.empty())
+				return;
+
+			task = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+
+		task();
+	}
+}
@@ -0,0 +1,59 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Small pool of worker threads for background work, like prefetching
+// metadata. Tasks must not block on other tasks of the same pool.
+// The threads are only created by the first Submit, so that the process can
+// still fork (fuse_daemonize) after the pool has been set up.
+class ThreadPool
+{
+public:
+	ThreadPool();
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool &o) = delete;
+	ThreadPool &operator=(const ThreadPool &o) = delete;
+
+	void SetThreadCount(unsigned int threads);
+	unsigned int GetThreadCount() const { return m_thread_cnt; }
+	void Stop();
+
+	// Returns false if the pool has no threads or has been stopped. The task
+	// is not run then.
+	bool Submit(const std::function<void()> &task);
+
+private:
+	void Worker();
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::deque<std::function<void()>> m_queue;
+	std::vector<std::thread> m_threads;
+	unsigned int m_thread_cnt;
+	bool m_stop;
+};
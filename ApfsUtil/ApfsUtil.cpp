@@ -93,6 +93,11 @@ int main(int argc, char *argv[])
 		container = new ApfsContainer(device, offset, size);
 
 		if (container->Init()) {
+			printf("Checkpoints (xid):");
+			for (const auto &cp : container->GetCheckPoints())
+				printf(" %" PRIu64, cp.xid);
+			printf("\n\n");
+
 			// printf("Listing volumes:\n");
 			for (int k = 0; k < NX_MAX_FILE_SYSTEMS; k++) {
 				if (!container->GetVolumeInfo(k, apsb))
@@ -119,22 +124,15 @@ int main(int argc, char *argv[])
 				if (apsb.apfs_snap_meta_tree_oid) {
 					printf("Snapshots:\n");
 					BTree snap_tree(*container);
-					BTreeIterator it;
-					BTreeEntry bte;
-					const j_snap_metadata_key_t *sme_k;
-					const j_snap_metadata_val_t *sme_v;
 
 					snap_tree.Init(apsb.apfs_snap_meta_tree_oid, apsb.apfs_o.o_xid);
-					if (snap_tree.GetIteratorBegin(it)) {
-						for (;;) {
-							if (!it.GetEntry(bte)) break;
-							sme_k = reinterpret_cast<const j_snap_metadata_key_t*>(bte.key);
-							sme_v = reinterpret_cast<const j_snap_metadata_val_t*>(bte.val);
-							if ((sme_k->hdr.obj_id_and_type >> OBJ_TYPE_SHIFT) != APFS_TYPE_SNAP_METADATA) break;
-							printf("    %" PRIu64 " : '%s'\n", sme_k->hdr.obj_id_and_type & OBJ_ID_MASK, sme_v->name);
-							if (!it.next()) break;
-						}
-					}
+					snap_tree.Scan(BTScanBegin(), BTScanEnd(), [](const BTreeEntry &bte) -> bool {
+						const j_snap_metadata_key_t *sme_k = reinterpret_cast<const j_snap_metadata_key_t*>(bte.key);
+						const j_snap_metadata_val_t *sme_v = reinterpret_cast<const j_snap_metadata_val_t*>(bte.val);
+						if ((sme_k->hdr.obj_id_and_type >> OBJ_TYPE_SHIFT) != APFS_TYPE_SNAP_METADATA) return false;
+						printf("    %" PRIu64 " : '%s'\n", sme_k->hdr.obj_id_and_type & OBJ_ID_MASK, sme_v->name);
+						return true;
+					});
 				}
 				printf("\n");
 			}
@@ -36,9 +36,11 @@
 #ifdef __APPLE__
 #include <fuse/fuse.h>
 #include <fuse/fuse_lowlevel.h>
+#include <unistd.h>
 #endif
 
 #include <getopt.h>
+#include <climits>
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -54,8 +56,10 @@
 #include <cassert>
 #include <cstring>
 #include <cstddef>
+#include <algorithm>
 
 #include <iostream>
+#include <sstream>
 
 static_assert(sizeof(fuse_ino_t) == 8, "Sorry, on 32-bit systems, you need to use FUSE-3.");
 
@@ -75,159 +79,214 @@ static bool g_set_gid = false;
 static int g_physblksize = 512;
 static std::string g_password;
 static xid_t g_snap_xid = 0;
+static size_t g_cache_size = NX_CACHE_DEFAULT_SIZE;
+static bool g_huge_pages = false;
+static size_t g_pin_size = 0;
+static unsigned int g_prefetch_window = NX_PREFETCH_DEFAULT_WINDOW;
+static size_t g_omap_cache_size = NX_OMAP_CACHE_DEFAULT_SIZE;
+static size_t g_omap_preload_size = 0;
+static size_t g_extent_cache_size = NX_EXTENT_CACHE_DEFAULT_SIZE;
+static size_t g_read_ahead_size = NX_READAHEAD_DEFAULT_SIZE;
+static std::string g_cache_file;
+
+// Virtual file in the root directory with the cache and I/O counters. APFS
+// object ids only use 60 bits, so the inode number can't collide.
+static const char STATS_NAME[] = ".apfs-stats";
+constexpr fuse_ino_t STATS_INO = 0xFFFFFFFFFFFFFFF0ULL;
 
 struct Directory
 {
-	Directory() {}
+	Directory() : listed(false) {}
 	~Directory() {}
 
-	std::vector<char> dirbuf;
+	// Read on the first readdir. The offsets of readdir and readdirplus are
+	// indexes into it, so the kernel can switch between the two.
+	std::vector<ApfsDir::DirRec> entries;
+	bool listed;
 };
 
 struct File
 {
-	File() {}
+	File() : is_stats(false) {}
 	~File() {}
 
 	bool IsCompressed() const { return (ino.bsd_flags & APFS_UF_COMPRESSED) != 0; }
+	bool IsBuffered() const { return is_stats || IsCompressed(); }
 
 	ApfsDir::Inode ino;
 	std::vector<uint8_t> decomp_data;
+	std::shared_ptr<ReadAheadStream> read_ahead;
+	bool is_stats;
 };
 
-static bool apfs_stat_internal(fuse_ino_t ino, struct stat &st)
+static void apfs_write_stats(std::vector<uint8_t> &data)
 {
-	ApfsDir dir(*g_volume);
-	ApfsDir::Inode rec;
-	bool rc = false;
+	std::ostringstream os;
+	DecompStats ds;
 
-	memset(&st, 0, sizeof(st));
+	g_container->WriteStats(os);
+	g_volume->WriteStats(os);
 
-	if (ino == ROOT_DIR_PARENT)
-	{
-		st.st_ino = 1;
-		st.st_mode = S_IFDIR | 0755;
-		st.st_nlink = 2;
-		return true;
-	}
+	GetDecompStats(ds);
+	os << "decmpfs.files " << ds.files << std::endl;
+	os << "decmpfs.failures " << ds.failures << std::endl;
+	os << "decmpfs.decompressed_bytes " << ds.decompressed_bytes << std::endl;
+	os << "decmpfs.usec " << ds.nsec / 1000 << std::endl;
 
-	rc = dir.GetInode(rec, ino);
+	const std::string &str = os.str();
+	data.assign(str.begin(), str.end());
+}
 
-	if (!rc)
-	{
-		std::cerr << "Unable to read inode " << ino << std::endl;
-		return false;
-	}
-	else
-	{
-		constexpr uint64_t div_nsec = 1000000000;
+static bool apfs_stat_inode(ApfsDir &dir, fuse_ino_t ino, const ApfsDir::Inode &rec, struct stat &st)
+{
+	constexpr uint64_t div_nsec = 1000000000;
+	bool rc;
 
-		// st_dev?
-		st.st_ino = ino;
-		st.st_mode = rec.mode;
-		// st.st_nlink = rec.ino.refcnt;
-		st.st_nlink = 1;
+	memset(&st, 0, sizeof(st));
+
+	// st_dev?
+	st.st_ino = ino;
+	st.st_mode = rec.mode;
+	// st.st_nlink = rec.ino.refcnt;
+	st.st_nlink = 1;
 
-		st.st_uid = g_set_uid ? g_uid : rec.owner;
-		st.st_gid = g_set_gid ? g_gid : rec.group;
+	st.st_uid = g_set_uid ? g_uid : rec.owner;
+	st.st_gid = g_set_gid ? g_gid : rec.group;
 
-		if (rec.optional_present_flags & ApfsDir::Inode::INO_HAS_RDEV)
-			st.st_rdev = rec.rdev;
+	if (rec.optional_present_flags & ApfsDir::Inode::INO_HAS_RDEV)
+		st.st_rdev = rec.rdev;
 
-		// st_uid
-		// st_gid
-		// st_rdev?
+	// st_uid
+	// st_gid
+	// st_rdev?
 
-		if (S_ISREG(st.st_mode))
+	if (S_ISREG(st.st_mode))
+	{
+		if (rec.bsd_flags & APFS_UF_COMPRESSED) // Compressed
 		{
-			if (rec.bsd_flags & APFS_UF_COMPRESSED) // Compressed
-			{
-				if (rec.internal_flags & INODE_HAS_UNCOMPRESSED_SIZE) {
-					st.st_size = rec.uncompressed_size;
-				} else {
-					std::vector<uint8_t> data;
-					rc = dir.GetAttribute(data, ino, "com.apple.decmpfs");
-					if (rc)
+			if (rec.internal_flags & INODE_HAS_UNCOMPRESSED_SIZE) {
+				st.st_size = rec.uncompressed_size;
+			} else {
+				std::vector<uint8_t> data;
+				rc = dir.GetAttribute(data, ino, "com.apple.decmpfs");
+				if (rc)
+				{
+					const CompressionHeader *decmpfs = reinterpret_cast<const CompressionHeader *>(data.data());
+
+					if (IsDecompAlgoSupported(decmpfs->algo))
 					{
-						const CompressionHeader *decmpfs = reinterpret_cast<const CompressionHeader *>(data.data());
-
-						if (IsDecompAlgoSupported(decmpfs->algo))
-						{
-							st.st_size = decmpfs->size;
-							// st.st_blocks = data.size() / 512;
-							if (g_debug & Dbg_Cmpfs)
-								std::cout << "Compressed size " << decmpfs->size << " bytes." << std::endl;
-						}
-						else if (IsDecompAlgoInRsrc(decmpfs->algo))
-						{
-							rc = dir.GetAttribute(data, ino, "com.apple.ResourceFork");
-
-							if (!rc)
-								st.st_size = 0;
-							else
-								// Compressed size
-								st.st_size = data.size();
-						}
+						st.st_size = decmpfs->size;
+						// st.st_blocks = data.size() / 512;
+						if (g_debug & Dbg_Cmpfs)
+							std::cout << "Compressed size " << decmpfs->size << " bytes." << std::endl;
+					}
+					else if (IsDecompAlgoInRsrc(decmpfs->algo))
+					{
+						rc = dir.GetAttribute(data, ino, "com.apple.ResourceFork");
+
+						if (!rc)
+							st.st_size = 0;
 						else
-						{
+							// Compressed size
 							st.st_size = data.size();
-							std::cerr << "Unknown compression algorithm " << decmpfs->algo << std::endl;
-							if (!g_lax)
-								return false;
-						}
 					}
 					else
 					{
-						std::cerr << "Flag 0x20 set but no com.apple.decmpfs attribute!!!" << std::endl;
+						st.st_size = data.size();
+						std::cerr << "Unknown compression algorithm " << decmpfs->algo << std::endl;
 						if (!g_lax)
 							return false;
 					}
 				}
+				else
+				{
+					std::cerr << "Flag 0x20 set but no com.apple.decmpfs attribute!!!" << std::endl;
+					if (!g_lax)
+						return false;
+				}
 			}
-			else if (rec.optional_present_flags & ApfsDir::Inode::INO_HAS_DSTREAM)
-			{
-				st.st_size = rec.ds_size;
+		}
+		else if (rec.optional_present_flags & ApfsDir::Inode::INO_HAS_DSTREAM)
+		{
+			st.st_size = rec.ds_size;
 
-				// st.st_size = rec.sizes.size;
-				// st_blksize
-				// st.st_blocks = rec.sizes.size_on_disk / 512;
-			}
-			else
-			{
-				st.st_size = 0;
-			}
+			// st.st_size = rec.sizes.size;
+			// st_blksize
+			// st.st_blocks = rec.sizes.size_on_disk / 512;
 		}
-		else if (S_ISDIR(st.st_mode))
+		else
 		{
-			st.st_size = rec.nchildren_nlink;
+			st.st_size = 0;
 		}
+	}
+	else if (S_ISDIR(st.st_mode))
+	{
+		st.st_size = rec.nchildren_nlink;
+	}
 
 #ifdef __linux__
-		// What about this?
-		// st.st_birthtime.tv_sec = rec.ino->create_time / div_nsec;
-		// st.st_birthtime.tv_nsec = rec.ino->create_time % div_nsec;
-
-		st.st_mtim.tv_sec = rec.mod_time / div_nsec;
-		st.st_mtim.tv_nsec = rec.mod_time % div_nsec;
-		st.st_ctim.tv_sec = rec.change_time / div_nsec;
-		st.st_ctim.tv_nsec = rec.change_time % div_nsec;
-		st.st_atim.tv_sec = rec.access_time / div_nsec;
-		st.st_atim.tv_nsec = rec.access_time % div_nsec;
+	// What about this?
+	// st.st_birthtime.tv_sec = rec.ino->create_time / div_nsec;
+	// st.st_birthtime.tv_nsec = rec.ino->create_time % div_nsec;
+
+	st.st_mtim.tv_sec = rec.mod_time / div_nsec;
+	st.st_mtim.tv_nsec = rec.mod_time % div_nsec;
+	st.st_ctim.tv_sec = rec.change_time / div_nsec;
+	st.st_ctim.tv_nsec = rec.change_time % div_nsec;
+	st.st_atim.tv_sec = rec.access_time / div_nsec;
+	st.st_atim.tv_nsec = rec.access_time % div_nsec;
 #endif
 #ifdef __APPLE__
-		st.st_birthtimespec.tv_sec = rec.create_time / div_nsec;
-		st.st_birthtimespec.tv_nsec = rec.create_time % div_nsec;
-		st.st_mtimespec.tv_sec = rec.mod_time / div_nsec;
-		st.st_mtimespec.tv_nsec = rec.mod_time % div_nsec;
-		st.st_ctimespec.tv_sec = rec.change_time / div_nsec;
-		st.st_ctimespec.tv_nsec = rec.change_time % div_nsec;
-		st.st_atimespec.tv_sec = rec.access_time / div_nsec;
-		st.st_atimespec.tv_nsec = rec.access_time % div_nsec;
-
-		// st.st_gen = rec.ino.gen_count;
+	st.st_birthtimespec.tv_sec = rec.create_time / div_nsec;
+	st.st_birthtimespec.tv_nsec = rec.create_time % div_nsec;
+	st.st_mtimespec.tv_sec = rec.mod_time / div_nsec;
+	st.st_mtimespec.tv_nsec = rec.mod_time % div_nsec;
+	st.st_ctimespec.tv_sec = rec.change_time / div_nsec;
+	st.st_ctimespec.tv_nsec = rec.change_time % div_nsec;
+	st.st_atimespec.tv_sec = rec.access_time / div_nsec;
+	st.st_atimespec.tv_nsec = rec.access_time % div_nsec;
+
+	// st.st_gen = rec.ino.gen_count;
 #endif
+	return true;
+}
+
+static bool apfs_stat_internal(fuse_ino_t ino, struct stat &st)
+{
+	ApfsDir dir(*g_volume);
+	ApfsDir::Inode rec;
+	bool rc = false;
+
+	memset(&st, 0, sizeof(st));
+
+	if (ino == ROOT_DIR_PARENT)
+	{
+		st.st_ino = 1;
+		st.st_mode = S_IFDIR | 0755;
+		st.st_nlink = 2;
+		return true;
+	}
+
+	if (ino == STATS_INO)
+	{
+		// The size is unknown until the file is opened, it is read with direct_io.
+		st.st_ino = ino;
+		st.st_mode = S_IFREG | 0444;
+		st.st_nlink = 1;
+		st.st_uid = g_set_uid ? g_uid : 0;
+		st.st_gid = g_set_gid ? g_gid : 0;
 		return true;
 	}
+
+	rc = dir.GetInode(rec, ino);
+
+	if (!rc)
+	{
+		std::cerr << "Unable to read inode " << ino << std::endl;
+		return false;
+	}
+
+	return apfs_stat_inode(dir, ino, rec, st);
 }
 
 /*
@@ -367,6 +426,24 @@ static void apfs_lookup(fuse_req_t req, fuse_ino_t ino, const char *name)
 
 	rc = dir.LookupName(res, ino, name);
 
+	// A real file of that name hides the statistics.
+	if (!rc && ino == ROOT_DIR_INO_NUM && !strcmp(name, STATS_NAME))
+	{
+		fuse_entry_param e;
+
+		memset(&e, 0, sizeof(e));
+		e.ino = STATS_INO;
+		e.attr_timeout = FUSE_TIMEOUT;
+		e.entry_timeout = FUSE_TIMEOUT;
+		apfs_stat_internal(STATS_INO, e.attr);
+
+		if (g_debug & Dbg_Info)
+			std::cout << "OK (stats)" << std::endl;
+
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
 	if (g_debug & Dbg_Info)
 		std::cout << (rc ? "OK" : "FAIL") << std::endl;
 
@@ -400,6 +477,20 @@ static void apfs_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
 
 	if ((fi->flags & 3) != O_RDONLY)
 		fuse_reply_err(req, EACCES);
+	else if (ino == STATS_INO)
+	{
+		File *f = new File();
+
+		// Take a snapshot of the counters, so that the file stays consistent
+		// while it is read.
+		f->is_stats = true;
+		apfs_write_stats(f->decomp_data);
+
+		fi->fh = reinterpret_cast<uint64_t>(f);
+		fi->direct_io = 1;
+
+		fuse_reply_open(req, fi);
+	}
 	else
 	{
 		File *f = new File();
@@ -443,6 +534,11 @@ static void apfs_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
 			}
 		}
 
+		else
+		{
+			f->read_ahead = g_volume->readahead().Open(f->ino.private_id, f->ino.ds_size);
+		}
+
 		fi->fh = reinterpret_cast<uint64_t>(f);
 
 		fuse_reply_open(req, fi);
@@ -463,19 +559,18 @@ static void apfs_opendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
 
 static void apfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
 {
-	ApfsDir dir(*g_volume);
 	File *file = reinterpret_cast<File *>(fi->fh);
 
 	if (g_debug & Dbg_Info)
 		std::cout << std::hex << "apfs_read: ino=" << ino << " size=" << size << " off=" << off << std::endl;
 
-	if (!file->IsCompressed())
+	if (!file->IsBuffered())
 	{
 		// bool rc;
 		std::vector<char> buf(size, 0);
 
 		// rc =
-		dir.ReadFile(buf.data(), file->ino.private_id, off, size);
+		g_volume->readahead().Read(file->read_ahead, buf.data(), off, size);
 
 		// std::cerr << "apfs_read: fuse_reply_buf(req, " << reinterpret_cast<uint64_t>(buf.data()) << ", " << size << ")" << std::endl;
 
@@ -494,75 +589,123 @@ static void apfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, st
 	}
 }
 
-static void dirbuf_add(fuse_req_t req, std::vector<char> &dirbuf, const char *name, fuse_ino_t ino, mode_t mode)
+static bool list_directory(Directory &dirptr, fuse_ino_t ino)
+{
+	ApfsDir dir(*g_volume);
+
+	if (!dirptr.listed)
+	{
+		if (!dir.ListDirectory(dirptr.entries, ino))
+			return false;
+
+		dirptr.listed = true;
+	}
+
+	return true;
+}
+
+static void apfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
 {
+	Directory *dirptr = reinterpret_cast<Directory *>(fi->fh);
+	std::vector<char> buf(size);
 	struct stat st;
-	size_t oldsize;
+	size_t pos = 0;
+	size_t len;
+	size_t k;
+
+	if (g_debug & Dbg_Info)
+		std::cout << "apfs_readdir: " << std::hex << ino << std::endl;
+
+	if (!list_directory(*dirptr, ino))
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
 
 	memset(&st, 0, sizeof(st));
-	oldsize = dirbuf.size();
-	dirbuf.resize(oldsize + fuse_add_direntry(req, nullptr, 0, name, nullptr, 0));
-	st.st_ino = ino;
-	st.st_mode = mode;
-	fuse_add_direntry(req, &dirbuf[oldsize], dirbuf.size() - oldsize, name, &st, dirbuf.size());
-}
 
-#define min(x, y) ((x) < (y) ? (x) : (y))
+	for (k = off; k < dirptr->entries.size(); k++)
+	{
+		const ApfsDir::DirRec &rec = dirptr->entries[k];
+
+		st.st_ino = rec.file_id;
+		st.st_mode = (rec.flags & DREC_TYPE_MASK) << 12;
 
-static int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize, off_t off, size_t maxsize)
-{
-	if (static_cast<size_t>(off) < bufsize)
-		return fuse_reply_buf(req, buf + off, min(bufsize - off, maxsize));
-	else
-		return fuse_reply_buf(req, NULL, 0);
-}
+		len = fuse_add_direntry(req, buf.data() + pos, size - pos, rec.name.c_str(), &st, k + 1);
+		if (len > size - pos)
+			break;
 
+		pos += len;
+	}
 
-static void apfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+	fuse_reply_buf(req, buf.data(), pos);
+}
+
+#if FUSE_USE_VERSION >= 30
+static void apfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
 {
 	ApfsDir dir(*g_volume);
-	std::vector<ApfsDir::DirRec> dir_list;
 	Directory *dirptr = reinterpret_cast<Directory *>(fi->fh);
-	std::vector<char> &dirbuf = dirptr->dirbuf;
-	bool rc;
+	std::vector<char> buf(size);
+	std::vector<uint64_t> ids;
+	std::vector<ApfsDir::Inode> inodes;
+	fuse_entry_param e;
+	size_t first;
+	size_t cnt;
+	size_t pos = 0;
+	size_t len;
+	size_t k;
 
 	if (g_debug & Dbg_Info)
-		std::cout << "apfs_readdir: " << std::hex << ino << std::endl;
+		std::cout << "apfs_readdirplus: " << std::hex << ino << std::endl;
 
-	if (dirbuf.size() == 0)
+	if (!list_directory(*dirptr, ino))
 	{
-		dirbuf.reserve(0x1000);
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
 
-#if 0 // Not needed
-		if (ino != 1)
-		{
-			ApfsDir::Inode dirrec;
+	// Only the entries that may fit into the reply.
+	first = std::min<size_t>(off, dirptr->entries.size());
+	cnt = std::min(dirptr->entries.size() - first, size / fuse_add_direntry_plus(req, nullptr, 0, "", nullptr, 0));
 
-			rc = dir.GetInode(dirrec, ino);
+	// The inodes of all of them in one sweep over the fs tree, instead of a
+	// lookup for each one.
+	ids.resize(cnt);
+	for (k = 0; k < cnt; k++)
+		ids[k] = dirptr->entries[first + k].file_id;
 
-			if (!rc)
-			{
-				fuse_reply_err(req, ENOENT);
-				return;
-			}
+	dir.GetInodes(inodes, ids);
+
+	for (k = 0; k < cnt; k++)
+	{
+		const ApfsDir::DirRec &rec = dirptr->entries[first + k];
 
-			dirbuf_add(req, dirbuf, ".", ino);
-			dirbuf_add(req, dirbuf, "..", dirrec.ino.parent_id);
+		memset(&e, 0, sizeof(e));
+
+		if (inodes[k].obj_id != 0 && apfs_stat_inode(dir, rec.file_id, inodes[k], e.attr))
+		{
+			e.ino = rec.file_id;
+			e.attr_timeout = FUSE_TIMEOUT;
+			e.entry_timeout = FUSE_TIMEOUT;
 		}
-#endif
-		rc = dir.ListDirectory(dir_list, ino);
-		if (!rc)
+		else
 		{
-			fuse_reply_err(req, ENOENT);
-			return;
+			// Without ino, the kernel only lists the entry and looks it up later.
+			e.attr.st_ino = rec.file_id;
+			e.attr.st_mode = (rec.flags & DREC_TYPE_MASK) << 12;
 		}
 
-		for (size_t k = 0; k < dir_list.size(); k++)
-			dirbuf_add(req, dirbuf, dir_list[k].name.c_str(), dir_list[k].file_id, (dir_list[k].flags & DREC_TYPE_MASK) << 12);
+		len = fuse_add_direntry_plus(req, buf.data() + pos, size - pos, rec.name.c_str(), &e, first + k + 1);
+		if (len > size - pos)
+			break;
+
+		pos += len;
 	}
 
-	reply_buf_limited(req, dirbuf.data(), dirbuf.size(), off, size);
+	fuse_reply_buf(req, buf.data(), pos);
 }
+#endif
 
 static void apfs_readlink(fuse_req_t req, fuse_ino_t ino)
 {
@@ -583,6 +726,8 @@ static void apfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *
 		std::cout << std::hex << "apfs_release " << ino << std::endl;
 
 	File *file = reinterpret_cast<File *>(fi->fh);
+	if (file->read_ahead)
+		file->read_ahead->Cancel();
 	delete file;
 
 	fuse_reply_err(req, 0);
@@ -599,6 +744,16 @@ static void apfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_inf
 	fuse_reply_err(req, 0);
 }
 
+static void apfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void)userdata;
+	(void)conn;
+
+	// Runs after fuse_daemonize, so the worker threads of the warmup survive.
+	if (!g_cache_file.empty())
+		g_container->LoadCacheManifest(g_cache_file.c_str(), g_volume);
+}
+
 static void apfs_statfs(fuse_req_t req, fuse_ino_t ino)
 {
 	struct statvfs st;
@@ -656,6 +811,22 @@ void usage(const char *name)
 	std::cout << "pass=...      : Specify volume passphrase (same as -r)." << std::endl;
 	std::cout << "xid=N         : Mount specific xid." << std::endl;
 	std::cout << "snap=N        : Mount snapshot with given id. Use apfsutil for getting the ids." << std::endl;
+	std::cout << "cache_mb=N    : Size of the metadata cache in MB (default 64)." << std::endl;
+	std::cout << "hugepages     : Try to back the metadata cache with huge pages." << std::endl;
+	std::cout << "pin_mb=N      : Load the upper levels of the omap and fs trees at mount and" << std::endl;
+	std::cout << "                keep up to N MB of them in memory (default 0)." << std::endl;
+	std::cout << "prefetch=N    : Number of leaves to read ahead when scanning directories" << std::endl;
+	std::cout << "                and attributes (default 4, 0 disables read-ahead)." << std::endl;
+	std::cout << "omap_cache_mb=N: Size of the oid to block translation cache of the volume" << std::endl;
+	std::cout << "                in MB (default 4, 0 disables it)." << std::endl;
+	std::cout << "omap_preload_mb=N: Read the whole omap of the volume into memory at mount" << std::endl;
+	std::cout << "                if it needs at most N MB (default 0, disabled)." << std::endl;
+	std::cout << "extent_cache_mb=N: Memory for the extent lists of recently read files," << std::endl;
+	std::cout << "                in MB (default 8, 0 disables it)." << std::endl;
+	std::cout << "readahead_mb=N: Memory for reading ahead files that are read sequentially," << std::endl;
+	std::cout << "                in MB (default 16, 0 disables read-ahead)." << std::endl;
+	std::cout << "cache_file=...: Save the list of cached metadata blocks there at unmount, and" << std::endl;
+	std::cout << "                reload them in the background at the next mount." << std::endl;
 	std::cout << std::endl;
 }
 
@@ -706,6 +877,48 @@ static int apfs_parse_fuse_opt(void *data, const char *arg, int key, struct fuse
 			g_snap_xid = strtoull(strchr(arg, '=') + sizeof(char), nullptr, 10);
 			return 0;
 		}
+		else if (!strncmp(arg, "cache_mb=", 9)) {
+			g_cache_size = strtoull(strchr(arg, '=') + sizeof(char), nullptr, 10) * 1024 * 1024;
+			return 0;
+		}
+		else if (!strncmp(arg, "pin_mb=", 7)) {
+			g_pin_size = strtoull(strchr(arg, '=') + sizeof(char), nullptr, 10) * 1024 * 1024;
+			return 0;
+		}
+		else if (!strncmp(arg, "prefetch=", 9)) {
+			g_prefetch_window = strtoul(strchr(arg, '=') + sizeof(char), nullptr, 10);
+			return 0;
+		}
+		else if (!strncmp(arg, "omap_cache_mb=", 14)) {
+			g_omap_cache_size = strtoull(strchr(arg, '=') + sizeof(char), nullptr, 10) * 1024 * 1024;
+			return 0;
+		}
+		else if (!strncmp(arg, "omap_preload_mb=", 16)) {
+			g_omap_preload_size = strtoull(strchr(arg, '=') + sizeof(char), nullptr, 10) * 1024 * 1024;
+			return 0;
+		}
+		else if (!strncmp(arg, "extent_cache_mb=", 16)) {
+			g_extent_cache_size = strtoull(strchr(arg, '=') + sizeof(char), nullptr, 10) * 1024 * 1024;
+			return 0;
+		}
+		else if (!strncmp(arg, "readahead_mb=", 13)) {
+			g_read_ahead_size = strtoull(strchr(arg, '=') + sizeof(char), nullptr, 10) * 1024 * 1024;
+			return 0;
+		}
+		else if (!strncmp(arg, "cache_file=", 11)) {
+			g_cache_file = strchr(arg, '=') + sizeof(char);
+			// fuse_daemonize changes the working directory to /.
+			if (!g_cache_file.empty() && g_cache_file[0] != '/') {
+				char cwd[PATH_MAX];
+				if (getcwd(cwd, sizeof(cwd)))
+					g_cache_file = std::string(cwd) + '/' + g_cache_file;
+			}
+			return 0;
+		}
+		else if (!strcmp(arg, "hugepages")) {
+			g_huge_pages = true;
+			return 0;
+		}
 	}
 	return 1;
 }
@@ -735,6 +948,7 @@ int main(int argc, char *argv[])
 	// ops.bmap = apfs_bmap;
 	// ops.destroy = apfs_destroy;
 	ops.getattr = apfs_getattr;
+	ops.init = apfs_init;
 #ifdef __linux__
 	ops.getxattr = apfs_getxattr;
 #endif
@@ -747,6 +961,9 @@ int main(int argc, char *argv[])
 	ops.opendir = apfs_opendir;
 	ops.read = apfs_read;
 	ops.readdir = apfs_readdir;
+#if FUSE_USE_VERSION >= 30
+	ops.readdirplus = apfs_readdirplus;
+#endif
 	ops.readlink = apfs_readlink;
 	ops.release = apfs_release;
 	ops.releasedir = apfs_releasedir;
@@ -889,6 +1106,14 @@ int main(int argc, char *argv[])
 	}
 
 	g_container = new ApfsContainer(g_disk_main, main_offset, main_size, g_disk_tier2, tier2_offset, tier2_size);
+	g_container->SetCacheSize(g_cache_size);
+	g_container->SetCacheHugePages(g_huge_pages);
+	g_container->SetPinSize(g_pin_size);
+	g_container->SetPrefetchWindow(g_prefetch_window);
+	g_container->SetOmapCacheSize(g_omap_cache_size);
+	g_container->SetOmapPreloadSize(g_omap_preload_size);
+	g_container->SetExtentCacheSize(g_extent_cache_size);
+	g_container->SetReadAheadSize(g_read_ahead_size);
 	if (!g_container->Init(g_xid))
 	{
 		std::cerr << "Unable to load container." << std::endl;
@@ -950,6 +1175,10 @@ int main(int argc, char *argv[])
 #endif
 	fuse_opt_free_args(&args);
 
+	if (!g_cache_file.empty())
+		g_container->SaveCacheManifest(g_cache_file.c_str(), g_volume);
+	g_container->WaitCacheWarmup();
+
 	delete g_volume;
 	delete g_container;
 	g_disk_main->Close();